@@ -0,0 +1,7 @@
+CC?=cc
+prefix=/usr/local
+exec_prefix=/usr/local
+bindir=/usr/local/bin
+libdir=/usr/local/lib
+includedir=/usr/local/include
+sysconfdir=/usr/local/etc
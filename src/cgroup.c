@@ -0,0 +1,506 @@
+/* cgroup redirect mode of the launcher (root only).
+   the command runs in a fresh cgroup v2 with bpf programs attached to it:
+   - connect4 rewrites every non loopback tcp connect() to the relay listener
+     of the launcher and remembers the original destination by socket cookie,
+     udp connect() is refused unless dns/leaks are allowed.
+   - sock_ops moves the destination to a map keyed by the client's local port
+     once it is known (TCP_CONNECT_CB), the relay looks it up with getpeername().
+   - sendmsg4/connect6/sendmsg6/sock_create refuse udp, inet6 and raw traffic.
+   the relay builds the proxy chain with the dll's connect() hook, so every
+   binary of the cgroup is covered, static or not, with no hook in the process. */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "core.h"
+#include "common.h"
+
+#if defined(__linux__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+
+#define MAX_INSNS 64
+#define MAP_ENTRIES 65536
+#define RELAY_BUFF_SIZE (16 * 1024)
+
+struct bpf_prog_buf {
+	struct bpf_insn insn[MAX_INSNS];
+	int pc;
+};
+
+static connect_t chain_connect;
+static int port_map_fd = -1;
+static int allow_leak, allow_dns;
+
+/* tiny assembler, jumps are emitted with off 0 and patched to the current pc */
+static int emit(struct bpf_prog_buf *p, __u8 code, __u8 dst, __u8 src, __s16 off, __s32 imm) {
+	struct bpf_insn *i = &p->insn[p->pc];
+	memset(i, 0, sizeof(*i));
+	i->code = code;
+	i->dst_reg = dst;
+	i->src_reg = src;
+	i->off = off;
+	i->imm = imm;
+	return p->pc++;
+}
+
+static void patch(struct bpf_prog_buf *p, int at) {
+	p->insn[at].off = (__s16) (p->pc - at - 1);
+}
+
+static void emit_map_fd(struct bpf_prog_buf *p, __u8 dst, int fd) {
+	emit(p, BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, fd);
+	emit(p, 0, 0, 0, 0, 0);
+}
+
+static void emit_ret(struct bpf_prog_buf *p, int v) {
+	emit(p, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, v);
+	emit(p, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+}
+
+/* r3 = ctx->user_port, jumps to the returned slots when it is a dns port */
+static void emit_dns_check(struct bpf_prog_buf *p, int *j53, int *j853) {
+	emit(p, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct bpf_sock_addr, user_port), 0);
+	*j53 = emit(p, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_3, 0, 0, htons(53));
+	*j853 = emit(p, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_3, 0, 0, htons(853));
+}
+
+static void build_connect4(struct bpf_prog_buf *p, int cookie_map, unsigned short relay_port) {
+	int j_lo, j_stream, j53 = -1, j853 = -1;
+
+	emit(p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+	emit(p, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_6, offsetof(struct bpf_sock_addr, user_ip4), 0);
+	emit(p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_7, 0, 0);
+	emit(p, BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_3, 0, 0, 0xff);
+	j_lo = emit(p, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_3, 0, 0, 127);
+	emit(p, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_8, BPF_REG_6, offsetof(struct bpf_sock_addr, type), 0);
+	j_stream = emit(p, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_8, 0, 0, SOCK_STREAM);
+	/* udp and friends */
+	if(allow_dns)
+		emit_dns_check(p, &j53, &j853);
+	emit_ret(p, allow_leak ? 1 : 0);
+
+	patch(p, j_stream);
+	emit(p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0);
+	emit(p, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie);
+	emit(p, BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_0, -8, 0);
+	emit(p, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct bpf_sock_addr, user_port), 0);
+	emit(p, BPF_ALU64 | BPF_LSH | BPF_K, BPF_REG_3, 0, 0, 32);
+	emit(p, BPF_ALU64 | BPF_OR | BPF_X, BPF_REG_3, BPF_REG_7, 0, 0);
+	emit(p, BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_3, -16, 0);
+	emit_map_fd(p, BPF_REG_1, cookie_map);
+	emit(p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+	emit(p, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8);
+	emit(p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0);
+	emit(p, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -16);
+	emit(p, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, BPF_ANY);
+	emit(p, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_update_elem);
+	emit(p, BPF_ALU | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, htonl(INADDR_LOOPBACK));
+	emit(p, BPF_STX | BPF_MEM | BPF_W, BPF_REG_6, BPF_REG_3, offsetof(struct bpf_sock_addr, user_ip4), 0);
+	emit(p, BPF_ALU | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, htons(relay_port));
+	emit(p, BPF_STX | BPF_MEM | BPF_W, BPF_REG_6, BPF_REG_3, offsetof(struct bpf_sock_addr, user_port), 0);
+
+	patch(p, j_lo);
+	if(j53 != -1) {
+		patch(p, j53);
+		patch(p, j853);
+	}
+	emit_ret(p, 1);
+}
+
+static void build_sendmsg4(struct bpf_prog_buf *p) {
+	int j_lo, j53 = -1, j853 = -1;
+
+	emit(p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+	emit(p, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct bpf_sock_addr, user_ip4), 0);
+	emit(p, BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_3, 0, 0, 0xff);
+	j_lo = emit(p, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_3, 0, 0, 127);
+	if(allow_dns)
+		emit_dns_check(p, &j53, &j853);
+	emit_ret(p, 0);
+	patch(p, j_lo);
+	if(j53 != -1) {
+		patch(p, j53);
+		patch(p, j853);
+	}
+	emit_ret(p, 1);
+}
+
+/* inet6 is not relayed, only ::1 (and dns datagrams if allowed) may pass */
+static void build_inet6(struct bpf_prog_buf *p) {
+	int j_nz[3], j_lo, j_stream = -1, j53 = -1, j853 = -1, i;
+
+	emit(p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+	for(i = 0; i < 3; i++) {
+		emit(p, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct bpf_sock_addr, user_ip6[i]), 0);
+		j_nz[i] = emit(p, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_3, 0, 0, 0);
+	}
+	emit(p, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct bpf_sock_addr, user_ip6[3]), 0);
+	j_lo = emit(p, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_3, 0, 0, htonl(1));
+	for(i = 0; i < 3; i++)
+		patch(p, j_nz[i]);
+	if(allow_dns) {
+		emit(p, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_8, BPF_REG_6, offsetof(struct bpf_sock_addr, type), 0);
+		j_stream = emit(p, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_8, 0, 0, SOCK_STREAM);
+		emit_dns_check(p, &j53, &j853);
+		patch(p, j_stream);
+	}
+	emit_ret(p, 0);
+	patch(p, j_lo);
+	if(j53 != -1) {
+		patch(p, j53);
+		patch(p, j853);
+	}
+	emit_ret(p, 1);
+}
+
+static void build_sock_create(struct bpf_prog_buf *p) {
+	int j_raw;
+	emit(p, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct bpf_sock, type), 0);
+	j_raw = emit(p, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_2, 0, 0, SOCK_RAW);
+	emit_ret(p, 1);
+	patch(p, j_raw);
+	emit_ret(p, 0);
+}
+
+static void build_sock_ops(struct bpf_prog_buf *p, int cookie_map, int port_map) {
+	int j_op, j_null;
+
+	emit(p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+	emit(p, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct bpf_sock_ops, op), 0);
+	j_op = emit(p, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_2, 0, 0, BPF_SOCK_OPS_TCP_CONNECT_CB);
+	emit(p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0);
+	emit(p, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie);
+	emit(p, BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_0, -8, 0);
+	emit_map_fd(p, BPF_REG_1, cookie_map);
+	emit(p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+	emit(p, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8);
+	emit(p, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+	j_null = emit(p, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, 0);
+	emit(p, BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_3, BPF_REG_0, 0, 0);
+	emit(p, BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_3, -16, 0);
+	emit(p, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct bpf_sock_ops, local_port), 0);
+	emit(p, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -24, 0);
+	emit_map_fd(p, BPF_REG_1, port_map);
+	emit(p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+	emit(p, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -24);
+	emit(p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0);
+	emit(p, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -16);
+	emit(p, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, BPF_ANY);
+	emit(p, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_update_elem);
+	emit_map_fd(p, BPF_REG_1, cookie_map);
+	emit(p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+	emit(p, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8);
+	emit(p, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_delete_elem);
+	patch(p, j_op);
+	patch(p, j_null);
+	emit_ret(p, 1);
+}
+
+static int sys_bpf(int cmd, union bpf_attr *attr) {
+	return syscall(SYS_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int create_map(unsigned key_size) {
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_LRU_HASH;
+	attr.key_size = key_size;
+	attr.value_size = sizeof(__u64);
+	attr.max_entries = MAP_ENTRIES;
+	return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int load_and_attach(struct bpf_prog_buf *p, int prog_type, int attach_type, int cgfd) {
+	static char log[16 * 1024];
+	union bpf_attr attr;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = prog_type;
+	attr.expected_attach_type = attach_type;
+	attr.insns = (__u64) (uintptr_t) p->insn;
+	attr.insn_cnt = p->pc;
+	attr.license = (__u64) (uintptr_t) "GPL";
+	attr.log_buf = (__u64) (uintptr_t) log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+	log[0] = 0;
+	if((fd = sys_bpf(BPF_PROG_LOAD, &attr)) == -1) {
+		fprintf(stderr, LOG_PREFIX "cgroup: bpf program %d rejected: %s\n%s\n", attach_type, strerror(errno), log);
+		return -1;
+	}
+	memset(&attr, 0, sizeof(attr));
+	attr.target_fd = cgfd;
+	attr.attach_bpf_fd = fd;
+	attr.attach_type = attach_type;
+	if(sys_bpf(BPF_PROG_ATTACH, &attr) == -1) {
+		fprintf(stderr, LOG_PREFIX "cgroup: can't attach bpf program %d: %s\n", attach_type, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* "<mount of cgroup2><our own cgroup>" */
+static int own_cgroup_path(char *buf, size_t bufsize) {
+	char line[1024], mnt[512] = "", type[64], rel[512] = "";
+	FILE *f;
+
+	if(!(f = fopen("/proc/self/mounts", "r")))
+		return -1;
+	while(fgets(line, sizeof(line), f))
+		if(sscanf(line, "%*s %511s %63s", mnt, type) == 2 && !strcmp(type, "cgroup2"))
+			break;
+		else
+			mnt[0] = 0;
+	fclose(f);
+	if(!mnt[0])
+		return -1;
+	if((f = fopen("/proc/self/cgroup", "r"))) {
+		while(fgets(line, sizeof(line), f))
+			if(!strncmp(line, "0::", 3) && sscanf(line + 3, "%511s", rel) == 1)
+				break;
+		fclose(f);
+	}
+	if(!strcmp(rel, "/"))
+		rel[0] = 0;
+	snprintf(buf, bufsize, "%s%s", mnt, rel);
+	return 0;
+}
+
+static int cgroup_populated(const char *cgdir) {
+	char path[1024], line[128];
+	int populated = 0;
+	FILE *f;
+	snprintf(path, sizeof(path), "%s/cgroup.events", cgdir);
+	if(!(f = fopen(path, "r")))
+		return 0;
+	while(fgets(line, sizeof(line), f))
+		if(sscanf(line, "populated %d", &populated) == 1)
+			break;
+	fclose(f);
+	return populated;
+}
+
+static void relay_copy(int a, int b) {
+	char buff[RELAY_BUFF_SIZE];
+	struct pollfd pfd[2];
+	int open_dirs = 2;
+	ssize_t n;
+
+	pfd[0].fd = a;
+	pfd[1].fd = b;
+	pfd[0].events = pfd[1].events = POLLIN;
+	while(open_dirs) {
+		int i;
+		if(poll(pfd, 2, -1) == -1) {
+			if(errno == EINTR)
+				continue;
+			return;
+		}
+		for(i = 0; i < 2; i++) {
+			if(!pfd[i].revents)
+				continue;
+			n = read(pfd[i].fd, buff, sizeof(buff));
+			if(n <= 0) {
+				shutdown(pfd[!i].fd, SHUT_WR);
+				pfd[i].fd = -1;
+				open_dirs--;
+				continue;
+			}
+			if(write(pfd[!i].fd, buff, n) != n)
+				return;
+		}
+	}
+}
+
+static void *relay_conn(void *arg) {
+	int client = (int) (intptr_t) arg, sock = -1;
+	struct sockaddr_in peer, dst;
+	socklen_t plen = sizeof(peer);
+	union bpf_attr attr;
+	__u32 key;
+	__u64 val;
+
+	if(getpeername(client, (struct sockaddr *) &peer, &plen))
+		goto out;
+	key = ntohs(peer.sin_port);
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = port_map_fd;
+	attr.key = (__u64) (uintptr_t) &key;
+	attr.value = (__u64) (uintptr_t) &val;
+	if(sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr)) {
+		PDEBUG("cgroup: no destination for local port %u\n", key);
+		goto out;
+	}
+	sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+
+	memset(&dst, 0, sizeof(dst));
+	dst.sin_family = AF_INET;
+	dst.sin_addr.s_addr = (in_addr_t) (val & 0xffffffff);
+	dst.sin_port = (in_port_t) (val >> 32);
+	if((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		goto out;
+	if(chain_connect(sock, (struct sockaddr *) &dst, sizeof(dst)))
+		goto out;
+	relay_copy(client, sock);
+	out:
+	if(sock != -1)
+		close(sock);
+	close(client);
+	return NULL;
+}
+
+static void *relay_accept(void *arg) {
+	int lsock = (int) (intptr_t) arg, c;
+	pthread_attr_t attr;
+	pthread_t t;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for(;;) {
+		if((c = accept(lsock, NULL, NULL)) == -1) {
+			if(errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+				continue;
+			break;
+		}
+		if(pthread_create(&t, &attr, relay_conn, (void *) (intptr_t) c))
+			close(c);
+	}
+	return NULL;
+}
+
+int cgroup_run(const char *dll_path, char **argv) {
+	struct bpf_prog_buf prog;
+	struct sockaddr_in addr;
+	socklen_t alen = sizeof(addr);
+	char base[768], cgdir[1024], path[1100];
+	int cgfd = -1, cookie_map, lsock, status = 0, ret = EXIT_FAILURE;
+	char *env;
+	pthread_t t;
+	pid_t child;
+
+	if(geteuid()) {
+		fprintf(stderr, LOG_PREFIX "cgroup mode requires root\n");
+		return EXIT_FAILURE;
+	}
+	env = getenv(PROXYBOUND_ALLOW_LEAKS_ENV_VAR);
+	allow_leak = env && *env == '1';
+	env = getenv(PROXYBOUND_ALLOW_DNS_ENV_VAR);
+	allow_dns = env && *env == '1';
+
+	if(!(chain_connect = load_dll_connect(dll_path)))
+		return EXIT_FAILURE;
+
+	lsock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(lsock == -1 || bind(lsock, (struct sockaddr *) &addr, sizeof(addr)) || listen(lsock, 1024) ||
+	   getsockname(lsock, (struct sockaddr *) &addr, &alen)) {
+		perror(LOG_PREFIX "cgroup: relay listener");
+		return EXIT_FAILURE;
+	}
+
+	if(own_cgroup_path(base, sizeof(base))) {
+		fprintf(stderr, LOG_PREFIX "cgroup: no cgroup2 hierarchy mounted\n");
+		return EXIT_FAILURE;
+	}
+	snprintf(cgdir, sizeof(cgdir), "%s/proxybound.%d", base, (int) getpid());
+	if(mkdir(cgdir, 0755) || (cgfd = open(cgdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+		fprintf(stderr, LOG_PREFIX "cgroup: can't create %s: %s\n", cgdir, strerror(errno));
+		goto out_rmdir;
+	}
+
+	if((cookie_map = create_map(sizeof(__u64))) == -1 || (port_map_fd = create_map(sizeof(__u32))) == -1) {
+		perror(LOG_PREFIX "cgroup: bpf map");
+		goto out_rmdir;
+	}
+
+	memset(&prog, 0, sizeof(prog));
+	build_connect4(&prog, cookie_map, ntohs(addr.sin_port));
+	if(load_and_attach(&prog, BPF_PROG_TYPE_CGROUP_SOCK_ADDR, BPF_CGROUP_INET4_CONNECT, cgfd) == -1)
+		goto out_rmdir;
+	memset(&prog, 0, sizeof(prog));
+	build_sock_ops(&prog, cookie_map, port_map_fd);
+	if(load_and_attach(&prog, BPF_PROG_TYPE_SOCK_OPS, BPF_CGROUP_SOCK_OPS, cgfd) == -1)
+		goto out_rmdir;
+	if(!allow_leak) {
+		memset(&prog, 0, sizeof(prog));
+		build_sendmsg4(&prog);
+		if(load_and_attach(&prog, BPF_PROG_TYPE_CGROUP_SOCK_ADDR, BPF_CGROUP_UDP4_SENDMSG, cgfd) == -1)
+			goto out_rmdir;
+		memset(&prog, 0, sizeof(prog));
+		build_inet6(&prog);
+		if(load_and_attach(&prog, BPF_PROG_TYPE_CGROUP_SOCK_ADDR, BPF_CGROUP_INET6_CONNECT, cgfd) == -1)
+			goto out_rmdir;
+		memset(&prog, 0, sizeof(prog));
+		build_inet6(&prog);
+		if(load_and_attach(&prog, BPF_PROG_TYPE_CGROUP_SOCK_ADDR, BPF_CGROUP_UDP6_SENDMSG, cgfd) == -1)
+			goto out_rmdir;
+		memset(&prog, 0, sizeof(prog));
+		build_sock_create(&prog);
+		if(load_and_attach(&prog, BPF_PROG_TYPE_CGROUP_SOCK, BPF_CGROUP_INET_SOCK_CREATE, cgfd) == -1)
+			goto out_rmdir;
+	}
+
+	if(pthread_create(&t, NULL, relay_accept, (void *) (intptr_t) lsock)) {
+		perror("pthread_create");
+		goto out_rmdir;
+	}
+
+	snprintf(path, sizeof(path), "%s/cgroup.procs", cgdir);
+	child = fork();
+	if(child == -1) {
+		perror("fork");
+		goto out_rmdir;
+	}
+	if(child == 0) {
+		int fd = open(path, O_WRONLY);
+		if(fd == -1 || write(fd, "0", 1) != 1) {
+			perror(LOG_PREFIX "cgroup: can't join cgroup");
+			_exit(127);
+		}
+		close(fd);
+		execvp(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+
+	if(waitpid(child, &status, 0) == -1)
+		goto out_rmdir;
+	ret = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+
+	/* keep relaying for daemonized descendants until the cgroup is empty */
+	while(cgroup_populated(cgdir))
+		poll(NULL, 0, 200);
+
+	out_rmdir:
+	if(cgfd != -1)
+		close(cgfd);
+	rmdir(cgdir);
+	return ret;
+}
+
+#else
+
+int cgroup_run(const char *dll_path, char **argv) {
+	(void) dll_path; (void) argv;
+	fprintf(stderr, LOG_PREFIX "cgroup mode requires linux (little endian)\n");
+	return EXIT_FAILURE;
+}
+
+#endif
@@ -57,3 +57,16 @@ char *get_config_path(char* default_path, char* pbuf, size_t bufsize) {
 	have:
 	return path;
 }
+
+/* what the metrics segment of a config is named after, the dll and
+   `proxybound stats` have to agree on it */
+void metrics_source(char *conf, char *buf, size_t bufsize) {
+	char pbuf[1024];
+	char *port = getenv(PROXYBOUND_SOCKS5_PORT_ENV_VAR);
+	char *host = getenv(PROXYBOUND_SOCKS5_HOST_ENV_VAR);
+
+	if(port)
+		snprintf(buf, bufsize, "socks5 %s:%s", host ? host : "127.0.0.1", port);
+	else
+		snprintf(buf, bufsize, "%s", get_config_path(conf, pbuf, sizeof(pbuf)));
+}
@@ -6,6 +6,15 @@
 #define PROXYBOUND_ALLOW_LEAKS_ENV_VAR "PROXYBOUND_ALLOW_LEAKS"
 #define PROXYBOUND_ALLOW_DNS_ENV_VAR "PROXYBOUND_ALLOW_DNS"
 #define PROXYBOUND_WORKING_INDICATOR_ENV_VAR "PROXYBOUND_WORKING_INDICATOR"
+#define PROXYBOUND_SECCOMP_ENV_VAR "PROXYBOUND_SECCOMP"
+#define PROXYBOUND_READY_FD_ENV_VAR "PROXYBOUND_READY_FD"
+#define PROXYBOUND_SNAPSHOT_FD_ENV_VAR "PROXYBOUND_SNAPSHOT_FD"
+#define PROXYBOUND_LOG_ENV_VAR "PROXYBOUND_LOG"
+#define PROXYBOUND_LOG_LEVEL_ENV_VAR "PROXYBOUND_LOG_LEVEL"
+#define PROXYBOUND_METRICS_ENV_VAR "PROXYBOUND_METRICS"
+#define PROXYBOUND_LOCK_STATS_ENV_VAR "PROXYBOUND_LOCK_STATS"
+#define PROXYBOUND_TRACE_FILE_ENV_VAR "PROXYBOUND_TRACE_FILE"
+#define PROXYBOUND_RECORD_ENV_VAR "PROXYBOUND_RECORD"
 #define PROXYBOUND_CONF_FILE "proxybound.conf"
 #define LOG_PREFIX "[Proxybound] "
 #ifndef SYSCONFDIR
@@ -15,5 +24,10 @@
 #include <stddef.h>
 
 char *get_config_path(char* default_path, char* pbuf, size_t bufsize);
+void metrics_source(char *conf, char *buf, size_t bufsize);
+int supervise_run(const char *dll_path, char **argv);
+int cgroup_run(const char *dll_path, char **argv);
+int stats_run(int argc, char **argv);
+void *load_dll_sym(const char *dll_path, const char *name);
 
 //RcB: DEP "common.c"
\ No newline at end of file
@@ -17,6 +17,7 @@
 
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -35,21 +36,27 @@
 #include <assert.h>
 #include "core.h"
 #include "common.h"
+#include "trace.h"
+#include <pthread.h>
 
 #ifdef THREAD_SAFE
-#include <pthread.h>
 pthread_mutex_t internal_ips_lock;
 pthread_mutex_t hostdb_lock;
+pthread_mutex_t proxy_state_lock;
 #endif
 
-extern int tcp_read_time_out;
-extern int tcp_connect_time_out;
 extern int proxybound_quiet_mode;
 extern unsigned int remote_dns_subnet;
+extern unsigned int proxybound_sticky_ttl;
+extern unsigned int proxybound_chain_retries;
+extern unsigned int proxybound_retry_budget;
+extern unsigned int proxybound_retry_backoff;
+extern unsigned int proxybound_retry_backoff_max;
+extern int tcp_read_time_out;
 
 extern ip_type hostsreader_get_numeric_ip_for_name(const char* name);
 
-internal_ip_lookup_table internal_ips = { 0, 0, NULL };
+internal_ip_lookup_table internal_ips;
 
 uint32_t dalias_hash(char *s0) {
 	unsigned char *s = (void *) s0;
@@ -69,14 +76,27 @@ uint32_t index_from_internal_ip(ip_type internalip) {
 	return ret;
 }
 
+static string_hash_tuple *internal_ips_entry(uint32_t index) {
+	return &internal_ips.chunk[index / INTERNAL_IPS_CHUNK][index % INTERNAL_IPS_CHUNK];
+}
+
 char *string_from_internal_ip(ip_type internalip) {
-	char *res = NULL;
 	uint32_t index = index_from_internal_ip(internalip);
-	MUTEX_LOCK(&internal_ips_lock);
-	if(index < internal_ips.counter)
-		res = internal_ips.list[index]->string;
-	MUTEX_UNLOCK(&internal_ips_lock);
-	return res;
+	if(index >= __atomic_load_n(&internal_ips.counter, __ATOMIC_ACQUIRE))
+		return NULL;
+	return internal_ips_entry(index)->string;
+}
+
+/* index of name, or -1 */
+static int64_t internal_ips_find(const char *name, uint32_t hash) {
+	uint32_t i = __atomic_load_n(&internal_ips.bucket[hash % INTERNAL_IPS_BUCKETS], __ATOMIC_ACQUIRE);
+	string_hash_tuple *e;
+	for(; i; i = e->next) {
+		e = internal_ips_entry(i - 1);
+		if(e->hash == hash && !strcmp(name, e->string))
+			return i - 1;
+	}
+	return -1;
 }
 
 in_addr_t make_internal_ip(uint32_t index) {
@@ -175,18 +195,6 @@ static void encode_base_64(char *src, char *dest, int max_len) {
 	*dest++ = 0;
 }
 
-void proxybound_write_log(char *str, ...) {
-	char buff[1024*20];
-	va_list arglist;
-	if(!proxybound_quiet_mode) {
-		va_start(arglist, str);
-		vsnprintf(buff, sizeof(buff), str, arglist);
-		va_end(arglist);
-		fprintf(stderr, "%s", buff);
-		fflush(stderr);
-	}
-}
-
 static int write_n_bytes(int fd, char *buff, size_t size) {
 	int i = 0;
 	size_t wrote = 0;
@@ -200,23 +208,42 @@ static int write_n_bytes(int fd, char *buff, size_t size) {
 	}
 }
 
-static int read_n_bytes(int fd, char *buff, size_t size) {
+static int read_n_bytes(int fd, char *buff, size_t size, int timeout) {
 	int ready;
 	size_t i;
+	ssize_t got;
 	struct pollfd pfd[1];
 
 	pfd[0].fd = fd;
 	pfd[0].events = POLLIN;
 	for(i = 0; i < size; i++) {
 		pfd[0].revents = 0;
-		ready = poll_retry(pfd, 1, tcp_read_time_out);
-		if(ready != 1 || !(pfd[0].revents & POLLIN) || 1 != read(fd, &buff[i], 1))
+		got = 0;
+		ready = poll_retry(pfd, 1, timeout);
+		if(!ready) {
+			errno = ETIMEDOUT;
 			return -1;
+		}
+		if(ready != 1 || !(pfd[0].revents & POLLIN) || 1 != (got = read(fd, &buff[i], 1))) {
+			if(ready == 1 && got != -1)
+				errno = ECONNRESET;  // hung up
+			return -1;
+		}
 	}
 	return (int) size;
 }
 
-static int timed_connect(int sock, const struct sockaddr *addr, socklen_t len) {
+/* read_n_bytes() of the proxy's answer to what it got at sent, the wait is
+   a sample for its adaptive timeout of kind */
+static int read_answer(int fd, char *buff, size_t size, int timeout, proxy_data *pd, int kind, uint64_t sent) {
+	int ret = read_n_bytes(fd, buff, size, timeout), err = errno;
+	if(ret == (int) size || err == ETIMEDOUT)
+		proxy_timeout_record(pd, kind, metrics_now_us() - sent);
+	errno = err;
+	return ret;
+}
+
+static int timed_connect(int sock, const struct sockaddr *addr, socklen_t len, int timeout) {
 	int ret, value;
 	socklen_t value_len;
 	struct pollfd pfd[1];
@@ -228,7 +255,7 @@ static int timed_connect(int sock, const struct sockaddr *addr, socklen_t len) {
 	PDEBUG("timed_connect: core.c: ret=%d\n", ret);
 	
 	if(ret == -1 && errno == EINPROGRESS) {
-		ret = poll_retry(pfd, 1, tcp_connect_time_out);
+		ret = poll_retry(pfd, 1, timeout);
 		PDEBUG("timed_connect: core.c: poll ret=%d\n", ret);
 		if(ret == 1) {
 			value_len = sizeof(socklen_t);
@@ -254,34 +281,89 @@ static int timed_connect(int sock, const struct sockaddr *addr, socklen_t len) {
 	return ret;
 }
 
+/* credentials part of the handshake, built once when the config is loaded:
+ * http: "Proxy-Authorization: Basic ...\r\n" (empty without user), socks4: "user\0",
+ * socks5: rfc1929 username/password request. returns -1 if it doesn't fit. */
+int proxy_build_auth(proxy_type pt, const char *user, const char *pass, unsigned char *out, size_t outsize) {
+	size_t ulen = strlen(user);
+	size_t passlen = strlen(pass);
+	size_t len = 0;
+
+	if(ulen > 0xFF || passlen > 0xFF) {
+		proxybound_log(PB_LOG_ERROR, LOG_PREFIX "ERROR: USER+PASS/DOMAIN SIZE EXCEEDS MAX VALUE OF 255!\n\n\n");
+		return -1;
+	}
+	switch (pt) {
+		case HTTP_TYPE:
+			if(user[0]) {
+#define HTTP_AUTH_MAX ((0xFF * 2) + 1 + 1)
+				// 2 * 0xff: username and pass, plus 1 for ':' and 1 for zero terminator.
+				char src[HTTP_AUTH_MAX];
+				char dst[(4 * HTTP_AUTH_MAX)];
+
+				memcpy(src, user, ulen);
+				memcpy(src + ulen, ":", 1);
+				memcpy(src + ulen + 1, pass, passlen);
+				src[ulen + 1 + passlen] = 0;
+
+				encode_base_64(src, dst, sizeof(dst));
+				len = snprintf((char *) out, outsize, "Proxy-Authorization: Basic %s\r\n", dst);
+			}
+			break;
+		case SOCKS4_TYPE:
+			len = ulen + 1;
+			if(len <= outsize)
+				memcpy(out, user, len);
+			break;
+		case SOCKS5_TYPE:
+			len = 3 + ulen + passlen;
+			if(len <= outsize) {
+				out[0] = 1;	// version
+				out[1] = ulen;
+				memcpy(out + 2, user, ulen);
+				out[2 + ulen] = passlen;
+				memcpy(out + 3 + ulen, pass, passlen);
+			}
+			break;
+	}
+	return len < outsize ? (int) len : -1;
+}
+
 #define INVALID_INDEX 0xFFFFFFFFU
-static int tunnel_to(int sock, ip_type ip, unsigned short port, proxy_type pt, char *user, char *pass) {
+/* hop: ip is the next proxy of the chain, not the target. the proxy
+   answers the greeting itself, the request only once it reached ip, which
+   for a target can take any time: its reply waits tcp_read_time_out */
+static int tunnel_to(int sock, ip_type ip, unsigned short port, proxy_data *pd, int hop) {
+	int timeout = proxy_timeout(pd, TIMEOUT_READ);
+	int reply_timeout = hop ? proxy_timeout(pd, TIMEOUT_HOP) : tcp_read_time_out;
+	proxy_type pt = pd->pt;
+	const unsigned char *auth = proxy_auth(pd);
 	char *dns_name = NULL;
 	size_t dns_len = 0;
 
 	PDEBUG("tunnel_to: core.c: init tunnel_to()\n");
+	errno = 0;  // read_n_bytes() leaves ETIMEDOUT for a proxy that stays silent
 
 	// we use ip addresses with 224.* to lookup their dns name in our table, to allow remote DNS resolution
 	// the range 224-255.* is reserved, and it won't go outside (unless the app does some other stuff with
 	// the results returned from gethostbyname et al.)
 	// the hardcoded number 224 can now be changed using the config option remote_dns_subnet to i.e. 127
 	if(ip.octet[0] == remote_dns_subnet) {
+		uint64_t lookup_start = metrics_now_us();
 		dns_name = string_from_internal_ip(ip);
+		PB_TRACE(fake_ip_lookup, lookup_start, metrics_now_us(), ip.as_int, port, dns_name ? 0 : -1);
 		if(!dns_name)
-			goto err;
+			goto err_local;
 		dns_len = strlen(dns_name);
 		if(!dns_len)
-			goto err;
+			goto err_local;
 	}
 	
 	PDEBUG("tunnel_to: core.c: host dns %s\n", dns_name ? dns_name : "<NULL>");
 
-	size_t ulen = strlen(user);
-	size_t passlen = strlen(pass);
-
-	if(ulen > 0xFF || passlen > 0xFF || dns_len > 0xFF) {
-		proxybound_write_log(LOG_PREFIX "ERROR: USER+PASS/DOMAIN SIZE EXCEEDS MAX VALUE OF 255!\n\n\n");
-		goto err;
+	if(!auth || dns_len > 0xFF) {
+		proxybound_log(PB_LOG_ERROR, LOG_PREFIX "ERROR: USER+PASS/DOMAIN SIZE EXCEEDS MAX VALUE OF 255!\n\n\n");
+		goto err_local;
 	}
 
 	int len;
@@ -300,25 +382,11 @@ static int tunnel_to(int sock, ip_type ip, unsigned short port, proxy_type pt, c
 				snprintf((char *) buff, sizeof(buff), "CONNECT %s:%d HTTP/1.0\r\n", dns_name,
 					 ntohs(port));
 
-				if(user[0]) {
-#define HTTP_AUTH_MAX ((0xFF * 2) + 1 + 1)
-					// 2 * 0xff: username and pass, plus 1 for ':' and 1 for zero terminator.
-					char src[HTTP_AUTH_MAX];
-					char dst[(4 * HTTP_AUTH_MAX)];
-
-					memcpy(src, user, ulen);
-					memcpy(src + ulen, ":", 1);
-					memcpy(src + ulen + 1, pass, passlen);
-					src[ulen + 1 + passlen] = 0;
-
-					encode_base_64(src, dst, sizeof(dst));
-					strcat((char *) buff, "Proxy-Authorization: Basic ");
-					strcat((char *) buff, dst);
-					strcat((char *) buff, "\r\n\r\n");
-				} else
-					strcat((char *) buff, "\r\n");
-
 				len = strlen((char *) buff);
+				memcpy(buff + len, auth, pd->auth_len);
+				len += pd->auth_len;
+				memcpy(buff + len, "\r\n", 2);
+				len += 2;
 
 				if(len != send(sock, buff, len, 0))
 					goto err;
@@ -326,7 +394,7 @@ static int tunnel_to(int sock, ip_type ip, unsigned short port, proxy_type pt, c
 				len = 0;
 				// read header byte by byte.
 				while(len < BUFF_SIZE) {
-					if(1 == read_n_bytes(sock, (char *) (buff + len), 1))
+					if(1 == read_n_bytes(sock, (char *) (buff + len), 1, reply_timeout))
 						len++;
 					else
 						goto err;
@@ -355,12 +423,8 @@ static int tunnel_to(int sock, ip_type ip, unsigned short port, proxy_type pt, c
 					ip.octet[3] = 1;
 				}
 				memcpy(&buff[4], &ip, 4);	// dest host
-				len = ulen + 1;	// username
-				if(len > 1)
-					memcpy(&buff[8], user, len);
-				else {
-					buff[8] = 0;
-				}
+				len = pd->auth_len;	// username
+				memcpy(&buff[8], auth, len);
 
 				// do socksv4a dns resolution on the server
 				if(dns_len) {
@@ -371,7 +435,7 @@ static int tunnel_to(int sock, ip_type ip, unsigned short port, proxy_type pt, c
 				if((len + 8) != write_n_bytes(sock, (char *) buff, (8 + len)))
 					goto err;
 
-				if(8 != read_n_bytes(sock, (char *) buff, 8))
+				if(8 != read_n_bytes(sock, (char *) buff, 8, reply_timeout))
 					goto err;
 
 				if(buff[0] != 0 || buff[1] != 90)
@@ -381,7 +445,8 @@ static int tunnel_to(int sock, ip_type ip, unsigned short port, proxy_type pt, c
 			}
 			break;
 		case SOCKS5_TYPE:{
-				if(user) {
+				uint64_t sent = metrics_now_us();
+				if(auth) {
 					buff[0] = 5;	//version
 					buff[1] = 2;	//nomber of methods
 					buff[2] = 0;	// no auth method
@@ -396,7 +461,7 @@ static int tunnel_to(int sock, ip_type ip, unsigned short port, proxy_type pt, c
 						goto err;
 				}
 
-				if(2 != read_n_bytes(sock, (char *) buff, 2))
+				if(2 != read_answer(sock, (char *) buff, 2, timeout, pd, TIMEOUT_READ, sent))
 					goto err;
 
 				if(buff[0] != 5 || (buff[1] != 0 && buff[1] != 2)) {
@@ -409,24 +474,12 @@ static int tunnel_to(int sock, ip_type ip, unsigned short port, proxy_type pt, c
 				if(buff[1] == 2) {
 					// authentication
 					char in[2];
-					char out[515];
-					char *cur = out;
-					size_t c;
-					*cur++ = 1;	// version
-					c = ulen & 0xFF;
-					*cur++ = c;
-					memcpy(cur, user, c);
-					cur += c;
-					c = passlen & 0xFF;
-					*cur++ = c;
-					memcpy(cur, pass, c);
-					cur += c;
-
-					if((cur - out) != write_n_bytes(sock, out, cur - out))
+
+					if(pd->auth_len != write_n_bytes(sock, (char *) auth, pd->auth_len))
 						goto err;
 
 
-					if(2 != read_n_bytes(sock, in, 2))
+					if(2 != read_n_bytes(sock, in, 2, timeout))
 						goto err;
 					if(in[0] != 1 || in[1] != 0) {
 						if(in[0] != 1)
@@ -458,11 +511,13 @@ static int tunnel_to(int sock, ip_type ip, unsigned short port, proxy_type pt, c
 				if(buff_iter != write_n_bytes(sock, (char *) buff, buff_iter))
 					goto err;
 
-				if(4 != read_n_bytes(sock, (char *) buff, 4))
+				if(4 != read_n_bytes(sock, (char *) buff, 4, reply_timeout))
 					goto err;
 
-				if(buff[0] != 5 || buff[1] != 0)
+				if(buff[0] != 5)
 					goto err;
+				if(buff[1] != 0)
+					return BLOCKED;	// answered, but won't or can't reach it
 
 				switch (buff[3]) {
 
@@ -474,14 +529,14 @@ static int tunnel_to(int sock, ip_type ip, unsigned short port, proxy_type pt, c
 						break;
 					case 3:
 						len = 0;
-						if(1 != read_n_bytes(sock, (char *) &len, 1))
+						if(1 != read_n_bytes(sock, (char *) &len, 1, reply_timeout))
 							goto err;
 						break;
 					default:
 						goto err;
 				}
 
-				if(len + 2 != read_n_bytes(sock, (char *) buff, len + 2))
+				if(len + 2 != read_n_bytes(sock, (char *) buff, len + 2, reply_timeout))
 					goto err;
 
 				return SUCCESS;
@@ -490,17 +545,31 @@ static int tunnel_to(int sock, ip_type ip, unsigned short port, proxy_type pt, c
 	}
 
 	err:
-	return SOCKET_ERROR;
+	return errno == ETIMEDOUT ? TIMED_OUT : SOCKET_ERROR;
+	err_local:
+	return LOCAL_ERROR;
 }
 
 #define TP "... "
 #define DT "Dynamic chain"
 #define ST "Strict chain"
 #define RT "Random chain"
+#define RRT "Round robin chain"
+#define HT "Hash chain"
+
+/* latency_order: the time to the current end of the chain, so chain_step()
+   can tell the hop to hop part of its time from the way there */
+static __thread uint64_t path_us;
+
+static int in_table(const proxy_data *pd) {
+	return pd >= proxybound_pd && pd < proxybound_pd + proxybound_proxy_count;
+}
 
 static int start_chain(int *fd, proxy_data * pd, char *begin_mark) {
 	struct sockaddr_in addr;
 	char ip_buf[16];
+	uint64_t start, end;
+	int timeout;
 
 	*fd = socket(PF_INET, SOCK_STREAM, 0);
 	if(*fd == -1)
@@ -508,50 +577,142 @@ static int start_chain(int *fd, proxy_data * pd, char *begin_mark) {
 	
 	pc_stringfromipv4(&pd->ip.octet[0], ip_buf);
 	proxybound_write_log(LOG_PREFIX "%s " TP "%s:%d\n", begin_mark, ip_buf, htons(pd->port));
-	pd->ps = PLAY_STATE;
+	proxy_set_state(pd, PLAY_STATE);
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
 	addr.sin_addr.s_addr = (in_addr_t) pd->ip.as_int;
 	addr.sin_port = pd->port;
-	if(timed_connect(*fd, (struct sockaddr *) &addr, sizeof(addr))) {
-		pd->ps = DOWN_STATE;
+	timeout = proxy_timeout(pd, TIMEOUT_CONNECT);
+	start = metrics_now_us();
+	if(timed_connect(*fd, (struct sockaddr *) &addr, sizeof(addr), timeout)) {
+		end = metrics_now_us();
+		metrics_proxy_connect(pd, end - start, 0);
+		PB_TRACE(tcp_connect, start, end, pd->ip.as_int, pd->port, -1);
+		if(end - start >= timeout * 1000ULL)
+			proxy_timeout_record(pd, TIMEOUT_CONNECT, end - start);
+		proxy_set_state(pd, DOWN_STATE);
 		goto error1;
 	}
-	pd->ps = BUSY_STATE;
+	end = metrics_now_us();
+	metrics_proxy_connect(pd, end - start, 1);
+	PB_TRACE(tcp_connect, start, end, pd->ip.as_int, pd->port, 0);
+	proxy_timeout_record(pd, TIMEOUT_CONNECT, end - start);
+	path_us = end - start;
+	if(proxybound_latency_order && in_table(pd))
+		latency_record(LATENCY_ORIGIN, pd - proxybound_pd, path_us);
+	proxy_set_state(pd, BUSY_STATE);
 	return SUCCESS;
 	error1:
-	proxybound_write_log(LOG_PREFIX TP "timeout\n");
+	proxybound_log(PB_LOG_WARN, LOG_PREFIX TP "timeout\n");
 	error:
 	if(*fd != -1)
 		close(*fd);
+	*fd = -1;
 	return SOCKET_ERROR;
 }
 
-unsigned int get_rand_int(unsigned int range){
-    static FILE *fp;
-    unsigned int randval;
-    if (!fp) {
-        fp = fopen("/dev/urandom", "r");
-    }
-    if(fread(&randval, sizeof(randval), 1, fp)) {
-	return (randval % range);
-    } else {
-	srand((unsigned int)time(NULL));
-	return (rand() % range);
-    }
+/* xorshift64*, one state per thread seeded from getrandom() on first use.
+   a fork() child seeds again, prefork workers would pick the same chains
+   and jitter as their parent and siblings otherwise */
+static __thread uint64_t rand_state;
+static pthread_once_t rand_once = PTHREAD_ONCE_INIT;
+
+static void rand_atfork_child(void) {
+	rand_state = 0;
+}
+
+static void rand_atfork(void) {
+	pthread_atfork(NULL, NULL, rand_atfork_child);
+}
+
+static void rand_seed(void) {
+	uint64_t seed = 0;
+	pthread_once(&rand_once, rand_atfork);
+#ifdef SYS_getrandom
+	if(syscall(SYS_getrandom, &seed, sizeof(seed), 0) != sizeof(seed))
+		seed = 0;
+#endif
+	if(!seed)
+		seed = metrics_now_us() ^ ((uint64_t) getpid() << 32) ^ (uintptr_t) &rand_state;
+	rand_state = seed ? seed : 0x9e3779b97f4a7c15ULL;
+}
+
+unsigned int get_rand_int(unsigned int range) {
+	uint64_t x;
+	if(!rand_state)
+		rand_seed();
+	x = rand_state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	rand_state = x;
+	/* maps the high 32 bits onto the range without a division */
+	return (unsigned int) (((x * 0x2545F4914F6CDD1DULL) >> 32) * range >> 32);
+}
+
+static uint64_t mix64(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+/* the destination host: the name behind a fake ip or the address */
+static uint64_t dest_key(ip_type ip) {
+	char *name = ip.octet[0] == remote_dns_subnet ? string_from_internal_ip(ip) : NULL;
+	uint64_t h = 1469598103934665603ULL;
+	if(!name)
+		return mix64(h ^ ip.as_int);
+	for(; *name; name++) {
+		h ^= (unsigned char) *name;
+		h *= 1099511628211ULL;
+	}
+	return h;
 }
 
-static proxy_data *select_proxy(select_type how, proxy_data * pd, unsigned int proxy_count, unsigned int *offset) {
-	unsigned int i = 0, k = 0;
+static proxy_data *select_proxy(select_type how, proxy_data * pd, unsigned int proxy_count, unsigned int *offset,
+				uint64_t key) {
+	proxy_data *best = NULL;
+	uint64_t score, best_score = 0;
+	unsigned int i = 0, k, start;
 	if(*offset >= proxy_count)
 		return NULL;
 	switch (how) {
 		case RANDOMLY:
-			do {
-				k++;
-				i = 0 + get_rand_int(proxy_count);
-			} while(pd[i].ps != PLAY_STATE && k < proxy_count * 100);
-			break;
+			return proxy_random_alive(pd->group);  // pd is the range of one group
+		case ROUND_ROBINLY:
+			start = __atomic_fetch_add(&proxybound_groups[pd->group].rr, 1, __ATOMIC_RELAXED);
+			for(k = 0; k < proxy_count; k++) {
+				i = (start + k) % proxy_count;
+				if(pd[i].ps == PLAY_STATE)
+					return &pd[i];
+			}
+			return NULL;
+		case HASHED:
+			/* the alive proxy with the highest score for this key, proxies
+			   coming or going only move the keys they win or lose */
+			for(i = 0; i < proxy_count; i++) {
+				if(pd[i].ps != PLAY_STATE)
+					continue;
+				score = mix64(key ^ ((uint64_t) pd[i].ip.as_int << 16 | pd[i].port));
+				if(!best || score > best_score) {
+					best = &pd[i];
+					best_score = score;
+				}
+			}
+			return best;
+		case RANKED:
+			if(!proxybound_rank)
+				return select_proxy(FIFOLY, pd, proxy_count, offset, key);
+			for(i = *offset; i < proxy_count; i++) {
+				best = &proxybound_pd[proxybound_rank[pd - proxybound_pd + i]];
+				if(best->ps == PLAY_STATE) {
+					*offset = i;
+					return best;
+				}
+			}
+			return NULL;
 		case FIFOLY:
 			for(i = *offset; i < proxy_count; i++) {
 				if(pd[i].ps == PLAY_STATE) {
@@ -567,36 +728,115 @@ static proxy_data *select_proxy(select_type how, proxy_data * pd, unsigned int p
 	return (pd[i].ps == PLAY_STATE) ? &pd[i] : NULL;
 }
 
+/* random_chain sticky sessions: the chain used for a destination host is
+   reused for sticky_ttl seconds while its proxies stay alive */
+#define STICKY_SLOTS 4096
+#define STICKY_MAX_HOPS 8
+
+typedef struct {
+	uint64_t key;
+	uint64_t expires_us;
+	uint16_t group;
+	uint16_t len;
+	uint32_t hop[STICKY_MAX_HOPS];  // proxy table indices
+} sticky_session;
+
+static sticky_session *sticky_table;
+static pthread_mutex_t sticky_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int sticky_find(uint64_t key, unsigned int group, sticky_session *out) {
+	sticky_session *s;
+	int found = 0;
+	pthread_mutex_lock(&sticky_lock);
+	if(sticky_table) {
+		s = &sticky_table[key % STICKY_SLOTS];
+		if(s->key == key && s->group == group && s->len && s->expires_us > metrics_now_us()) {
+			*out = *s;
+			found = 1;
+		}
+	}
+	pthread_mutex_unlock(&sticky_lock);
+	return found;
+}
 
-static void release_all(proxy_data * pd, unsigned int proxy_count) {
-	unsigned int i;
-	for(i = 0; i < proxy_count; i++)
-		pd[i].ps = PLAY_STATE;
-	return;
+static void sticky_store(uint64_t key, unsigned int group, const uint32_t *hop, unsigned int len) {
+	sticky_session *s;
+	pthread_mutex_lock(&sticky_lock);
+	if(sticky_table || (sticky_table = calloc(STICKY_SLOTS, sizeof(*sticky_table)))) {
+		s = &sticky_table[key % STICKY_SLOTS];
+		s->key = key;
+		s->expires_us = metrics_now_us() + proxybound_sticky_ttl * 1000000ULL;
+		s->group = group;
+		s->len = len;
+		memcpy(s->hop, hop, len * sizeof(*hop));
+	}
+	pthread_mutex_unlock(&sticky_lock);
 }
 
-static void release_busy(proxy_data * pd, unsigned int proxy_count) {
-	unsigned int i;
-	for(i = 0; i < proxy_count; i++)
-		if(pd[i].ps == BUSY_STATE)
-			pd[i].ps = PLAY_STATE;
-	return;
+/* hop n of a random, round robin or hash chain */
+static proxy_data *pick_hop(select_type how, proxy_data *pd, unsigned int proxy_count, unsigned int *offset,
+			    uint64_t key, const sticky_session *sticky, unsigned int n) {
+	if(sticky && n < sticky->len && proxybound_pd[sticky->hop[n]].ps == PLAY_STATE)
+		return &proxybound_pd[sticky->hop[n]];
+	return select_proxy(how, pd, proxy_count, offset, key);
 }
 
-static unsigned int calc_alive(proxy_data * pd, unsigned int proxy_count) {
-	unsigned int i;
-	int alive_count = 0;
-	release_busy(pd, proxy_count);
-	for(i = 0; i < proxy_count; i++)
-		if(pd[i].ps == PLAY_STATE)
-			alive_count++;
-	return alive_count;
+/* the proxies admitted for the chain being built, see limits.c. longer
+   dynamic chains go without limits past LIMIT_MAX_HOPS */
+#define LIMIT_MAX_HOPS 64
+
+typedef struct {
+	unsigned int n;
+	int timed_out;  // the last admit_hop() gave up in a queue
+	limit_hold hold[LIMIT_MAX_HOPS];
+} limit_set;
+
+/* pick_hop() through the proxy limits. with a choice (overflow) a full
+   proxy is marked busy so the selection moves on, and the last full one
+   is queued for once there's nothing else. strict_chain queues right away.
+   NULL when nothing is left or the queue timed out */
+static proxy_data *admit_hop(select_type how, proxy_data *pd, unsigned int proxy_count, unsigned int *offset,
+			     uint64_t key, const sticky_session *plan, unsigned int n, int overflow, limit_set *ls) {
+	proxy_data *p, *full = NULL;
+
+	ls->timed_out = 0;
+	if(!LIMITS_ON() || ls->n == LIMIT_MAX_HOPS)
+		return pick_hop(how, pd, proxy_count, offset, key, plan, n);
+	while((p = pick_hop(how, pd, proxy_count, offset, key, plan, n))) {
+		if(!limit_admit(p, !overflow, &ls->hold[ls->n]))
+			goto admitted;
+		if(!overflow)
+			goto timed_out;
+		full = p;
+		proxy_set_state(p, BUSY_STATE);
+	}
+	if(!full)
+		return NULL;
+	if(limit_admit(full, 1, &ls->hold[ls->n]))
+		goto timed_out;
+	p = full;
+	admitted:
+	ls->n++;
+	return p;
+	timed_out:
+	proxybound_log(PB_LOG_WARN, LOG_PREFIX "proxy limits: timed out waiting for a proxy\n");
+	ls->timed_out = 1;
+	return NULL;
+}
+
+/* a hop that didn't come up gives its slots back right away */
+static void admit_undo(limit_set *ls, proxy_data *p) {
+	if(ls->n && ls->hold[ls->n - 1].idx == (uint32_t) (p - proxybound_pd)) {
+		ls->n--;
+		limit_release(&ls->hold[ls->n], 1);
+	}
 }
 
 static int chain_step(int ns, proxy_data * pfrom, proxy_data * pto) {
-	int retcode = -1;
+	int retcode = -1, hop = in_table(pto);
 	char *hostname;
 	char ip_buf[16];
+	uint64_t start, end;
 
 	PDEBUG("chain_step: core.c: init chain_step()\n");
 
@@ -611,51 +851,134 @@ static int chain_step(int ns, proxy_data * pfrom, proxy_data * pto) {
 	}
 
 	proxybound_write_log(LOG_PREFIX TP "%s:%d\n", hostname, htons(pto->port));
-	retcode = tunnel_to(ns, pto->ip, pto->port, pfrom->pt, pfrom->user, pfrom->pass);
+	start = metrics_now_us();
+	retcode = tunnel_to(ns, pto->ip, pto->port, pfrom, hop);
+	end = metrics_now_us();
+	metrics_proxy_handshake(pfrom, end - start, retcode);
+	/* the time to the target is the target's, not pfrom's */
+	if(hop && (retcode == SUCCESS || retcode == BLOCKED || retcode == TIMED_OUT))
+		proxy_timeout_record(pfrom, TIMEOUT_HOP, end - start);
+	PB_TRACE(tunnel_to, start, end, pto->ip.as_int, pto->port, retcode);
 	switch (retcode) {
 		case SUCCESS:
-			pto->ps = BUSY_STATE;
+			proxy_set_state(pto, BUSY_STATE);
+			if(proxybound_latency_order && in_table(pfrom) && in_table(pto)) {
+				/* the handshake goes over the chain up to pfrom once more */
+				uint64_t hop = end - start > path_us ? end - start - path_us : 0;
+				latency_record(pfrom - proxybound_pd, pto - proxybound_pd, hop);
+				path_us += hop;
+			}
 			break;
 		case BLOCKED:
-			pto->ps = BLOCKED_STATE;
-			proxybound_write_log(LOG_PREFIX "denied\n");
+			proxy_set_state(pto, BLOCKED_STATE);
+			proxybound_log(PB_LOG_WARN, LOG_PREFIX "denied\n");
 			close(ns);
 			break;
 		case SOCKET_ERROR:
-			pto->ps = DOWN_STATE;
-			proxybound_write_log(LOG_PREFIX "socket error or timeout!\n");
+		case TIMED_OUT:
+			proxy_set_state(pto, DOWN_STATE);
+			proxybound_log(PB_LOG_WARN, LOG_PREFIX "socket error or timeout!\n");
+			close(ns);
+			break;
+		default:
 			close(ns);
 			break;
 	}
 	return retcode;
 }
 
+static void chain_done(chain_type ct, uint64_t start, ip_type ip, unsigned short port, int ok) {
+	uint64_t end = metrics_now_us();
+	metrics_chain_done(ct, end - start, ok);
+	PB_TRACE(connect, start, end, ip.as_int, port, ok ? 0 : -1);
+	if(trace_enabled)
+		trace_flush();
+}
+
+/* before retry n (from 1) of a chain that started at start: 0 when
+   chain_retries or chain_retry_budget are used up, else waits
+   min(chain_retry_backoff << (n - 1), chain_retry_backoff_max) ms, the
+   upper half of it random so chains that failed together spread out */
+static int retry_wait(unsigned int n, uint64_t start) {
+	uint64_t ms = proxybound_retry_backoff, spent, budget = proxybound_retry_budget * 1000ULL;
+	struct timespec ts;
+
+	if(n > proxybound_chain_retries)
+		return 0;
+	ms = n - 1 < 32 ? ms << (n - 1) : UINT64_MAX;
+	if(proxybound_retry_backoff_max && ms > proxybound_retry_backoff_max)
+		ms = proxybound_retry_backoff_max;
+	if(ms > 0x7fffffff)
+		ms = 0x7fffffff;
+	ms = ms / 2 + get_rand_int(ms - ms / 2 + 1);
+	if(budget) {
+		spent = metrics_now_us() - start;
+		if(spent >= budget)
+			return 0;
+		if(ms > (budget - spent) / 1000)
+			ms = (budget - spent) / 1000;
+	}
+	if(ms) {
+		ts.tv_sec = ms / 1000;
+		ts.tv_nsec = ms % 1000 * 1000000L;
+		while(nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			;
+	}
+	return 1;
+}
+
 int connect_proxy_chain(int sock, ip_type target_ip,
-			unsigned short target_port, proxy_data * pd,
-			unsigned int proxy_count, chain_type ct, unsigned int max_chain) {
+			unsigned short target_port, unsigned int group,
+			chain_type ct, unsigned int max_chain) {
+	proxy_data *pd = proxybound_pd + proxybound_groups[group].first;
+	unsigned int proxy_count = proxybound_groups[group].count;
 	proxy_data p4;
 	proxy_data *p1, *p2, *p3;
+	uint32_t hops[STICKY_MAX_HOPS];
+	sticky_session session;
+	const sticky_session *plan;
+	select_type how;
+	uint64_t key = 0;
+	char *mark;
+	int sticky;
 	int ns = -1;
 	unsigned int offset = 0;
 	unsigned int alive_count = 0;
 	unsigned int curr_len = 0;
+	unsigned int tries = 0;
+	uint64_t step, start = metrics_now_us();
+	limit_set ls;
+	int rc, err;
 
 	p3 = &p4;
+	ls.n = 0;
+	ls.timed_out = 0;
 
 	PDEBUG("connect: core.c: connect_proxy_chain\n");
 
 	again:
+	limit_release(ls.hold, ls.n);
+	ls.n = 0;
+	ns = -1;  // closed by the hop that failed
+	if(tries++) {
+		metrics_chain_retry(ct);
+		if(!retry_wait(tries - 1, start))
+			goto error_exhausted;
+	}
 
 	switch (ct) {
 		case DYNAMIC_TYPE:
-			alive_count = calc_alive(pd, proxy_count);
+			alive_count = proxy_release_busy(group);
 			offset = 0;
 			do {
-				if(!(p1 = select_proxy(FIFOLY, pd, proxy_count, &offset)))
+				if(!(p1 = admit_hop(RANKED, pd, proxy_count, &offset, 0, NULL, 0, 1, &ls)))
 					goto error_more;
-			} while(SUCCESS != start_chain(&ns, p1, DT) && offset < proxy_count);
+				if(SUCCESS == start_chain(&ns, p1, DT))
+					break;
+				admit_undo(&ls, p1);
+			} while(offset < proxy_count);
 			for(;;) {
-				p2 = select_proxy(FIFOLY, pd, proxy_count, &offset);
+				p2 = admit_hop(RANKED, pd, proxy_count, &offset, 0, NULL, 0, 1, &ls);
 				if(!p2)
 					break;
 				if(SUCCESS != chain_step(ns, p1, p2)) {
@@ -667,14 +990,14 @@ int connect_proxy_chain(int sock, ip_type target_ip,
 			//proxybound_write_log(TP);
 			p3->ip = target_ip;
 			p3->port = target_port;
-			if(SUCCESS != chain_step(ns, p1, p3))
-				goto error;
+			if(SUCCESS != (rc = chain_step(ns, p1, p3)))
+				goto error_exit;
 			break;
 
 		case STRICT_TYPE:
-			alive_count = calc_alive(pd, proxy_count);
+			alive_count = proxy_release_busy(group);
 			offset = 0;
-			if(!(p1 = select_proxy(FIFOLY, pd, proxy_count, &offset))) {
+			if(!(p1 = admit_hop(FIFOLY, pd, proxy_count, &offset, 0, NULL, 0, 0, &ls))) {
 				PDEBUG("connect: core.c: select_proxy failed\n");
 				goto error_strict;
 			}
@@ -683,10 +1006,14 @@ int connect_proxy_chain(int sock, ip_type target_ip,
 				goto error_strict;
 			}
 			while(offset < proxy_count) {
-				if(!(p2 = select_proxy(FIFOLY, pd, proxy_count, &offset)))
+				if(!(p2 = admit_hop(FIFOLY, pd, proxy_count, &offset, 0, NULL, 0, 0, &ls))) {
+					if(ls.timed_out)
+						goto error_strict;
 					break;
+				}
 				if(SUCCESS != chain_step(ns, p1, p2)) {
 					PDEBUG("connect: core.c: chain_step failed\n");
+					ns = -1;  // closed by chain_step()
 					goto error_strict;
 				}
 				p1 = p2;
@@ -694,55 +1021,109 @@ int connect_proxy_chain(int sock, ip_type target_ip,
 			//proxybound_write_log(TP);
 			p3->ip = target_ip;
 			p3->port = target_port;
-			if(SUCCESS != chain_step(ns, p1, p3))
-				goto error;
+			if(SUCCESS != (rc = chain_step(ns, p1, p3)))
+				goto error_target;
 			break;
 
 		case RANDOM_TYPE:
-			alive_count = calc_alive(pd, proxy_count);
+		case ROUND_ROBIN_TYPE:
+		case HASH_TYPE:
+			how = ct == RANDOM_TYPE ? RANDOMLY : ct == HASH_TYPE ? HASHED : ROUND_ROBINLY;
+			mark = ct == RANDOM_TYPE ? RT : ct == HASH_TYPE ? HT : RRT;
+			alive_count = proxy_release_busy(group);
 			if(alive_count < max_chain)
 				goto error_more;
+			if(ct == HASH_TYPE)
+				key = mix64(dest_key(target_ip) ^ target_port);
+			sticky = ct == RANDOM_TYPE && proxybound_sticky_ttl && max_chain <= STICKY_MAX_HOPS;
+			session.len = 0;
+			if(sticky) {
+				key = dest_key(target_ip);
+				if(!sticky_find(key, group, &session))
+					session.len = 0;
+			}
+			/* latency_order draws the whole chain upfront, in the order
+			   with the lowest estimated latency */
+			if(!session.len && ct == RANDOM_TYPE && proxybound_latency_order && max_chain <= LATENCY_MAX_HOPS &&
+			   !latency_pick(group, session.hop, max_chain))
+				session.len = max_chain;
+			plan = session.len ? &session : NULL;
 			curr_len = offset = 0;
 			do {
-				if(!(p1 = select_proxy(RANDOMLY, pd, proxy_count, &offset)))
+				if(!(p1 = admit_hop(how, pd, proxy_count, &offset, key, plan, 0, 1, &ls)))
 					goto error_more;
-			} while(SUCCESS != start_chain(&ns, p1, RT) && offset < max_chain);
+				if(SUCCESS == start_chain(&ns, p1, mark))
+					break;
+				admit_undo(&ls, p1);
+			} while(offset < max_chain);
+			hops[0] = p1 - proxybound_pd;
 			while(++curr_len < max_chain) {
-				if(!(p2 = select_proxy(RANDOMLY, pd, proxy_count, &offset)))
+				if(!(p2 = admit_hop(how, pd, proxy_count, &offset, key, plan, curr_len, 1, &ls)))
 					goto error_more;
 				if(SUCCESS != chain_step(ns, p1, p2)) {
 					PDEBUG("connect: core.c: goto again x2\n");
 					goto again;
 				}
+				if(curr_len < STICKY_MAX_HOPS)
+					hops[curr_len] = p2 - proxybound_pd;
 				p1 = p2;
 			}
 			//proxybound_write_log(TP);
 			p3->ip = target_ip;
 			p3->port = target_port;
-			if(SUCCESS != chain_step(ns, p1, p3))
-				goto error;
+			if(SUCCESS != (rc = chain_step(ns, p1, p3)))
+				goto error_exit;
+			if(sticky)
+				sticky_store(key, group, hops, max_chain);
 
 	}
 
 	proxybound_write_log(LOG_PREFIX TP "ok\n");
+	step = metrics_now_us();
 	dup2(ns, sock);
 	close(ns);
+	limit_established(sock, ls.hold, ls.n);
+	PB_TRACE(dup2, step, metrics_now_us(), target_ip.as_int, target_port, sock);
+	chain_done(ct, start, target_ip, target_port, 1);
 	return 0;
-	error:
-	if(ns != -1)
-		close(ns);
-	errno = ECONNREFUSED;	// for nmap ;)
+	error_exit:
+	/* the exit proxy broke while it answered for the target, that's worth a
+	   retry. a timeout may just be a slow target and a local error isn't
+	   the proxy's fault, neither makes it down */
+	if(rc == SOCKET_ERROR) {
+		proxy_set_state(p1, DOWN_STATE);
+		PDEBUG("connect: core.c: goto again x3\n");
+		goto again;
+	}
+	error_target:
+	ns = -1;  // closed by chain_step()
+	chain_done(ct, start, target_ip, target_port, 0);
+	limit_release(ls.hold, ls.n);
+	errno = rc == TIMED_OUT ? ETIMEDOUT : ECONNREFUSED;	// for nmap ;)
+	return -1;
+
+	error_exhausted:
+	proxybound_log(PB_LOG_WARN, LOG_PREFIX "giving up after %u retries\n", tries - 2);
+	chain_done(ct, start, target_ip, target_port, 0);
+	proxy_release_all(group);
+	errno = ETIMEDOUT;
 	return -1;
 
 	error_more:
-	proxybound_write_log(LOG_PREFIX "ERROR: NEED MORE PROXIES!\n\n\n");
+	proxybound_log(PB_LOG_ERROR, LOG_PREFIX "ERROR: NEED MORE PROXIES!\n\n\n");
+	err = ls.timed_out ? ETIMEDOUT : ENETUNREACH;
+	goto error_release;
 	error_strict:
+	err = ETIMEDOUT;
+	error_release:
 	PDEBUG("connect: core.c: error\n");
+	chain_done(ct, start, target_ip, target_port, 0);
+	limit_release(ls.hold, ls.n);
 	
-	release_all(pd, proxy_count);
+	proxy_release_all(group);
 	if(ns != -1)
 		close(ns);
-	errno = ETIMEDOUT;
+	errno = err;
 	return -1;
 }
 
@@ -754,6 +1135,8 @@ static void gethostbyname_data_setstring(struct gethostbyname_data* data, char*
 struct hostent *proxy_gethostbyname(const char *name, struct gethostbyname_data* data) {
 	char buff[256];
 	uint32_t i, hash;
+	int64_t found;
+	string_hash_tuple *entry;
 	// yep, new_mem never gets freed. once you passed a fake ip to the client, you can't "retreat" it
 	void *new_mem;
 	size_t l;
@@ -792,52 +1175,54 @@ struct hostent *proxy_gethostbyname(const char *name, struct gethostbyname_data*
     
 	MUTEX_UNLOCK(&hostdb_lock);
 	hash = dalias_hash((char *) name);
-	MUTEX_LOCK(&internal_ips_lock);
 
-	// see if we already have this dns entry saved.
-	if(internal_ips.counter) {
-		for(i = 0; i < internal_ips.counter; i++) {
-			if(internal_ips.list[i]->hash == hash && !strcmp(name, internal_ips.list[i]->string)) {
-				data->resolved_addr = make_internal_ip(i);
-				PDEBUG("proxy_gethostbyname: core.c: got cached ip for %s\n", name);
-				goto have_ip;
-			}
-		}
+	// most names are asked for more than once, see if we already have it.
+	if((found = internal_ips_find(name, hash)) != -1) {
+		data->resolved_addr = make_internal_ip(found);
+		PDEBUG("proxy_gethostbyname: core.c: got cached ip for %s\n", name);
+		goto retname;
 	}
-    
-	// grow list if needed.
-	if(internal_ips.capa < internal_ips.counter + 1) {
-		PDEBUG("proxy_gethostbyname: core.c: realloc\n");
-		new_mem = realloc(internal_ips.list, (internal_ips.capa + 16) * sizeof(void *));
-		if(new_mem) {
-			internal_ips.capa += 16;
-			internal_ips.list = new_mem;
-		} else {
+
+	MUTEX_LOCK(&internal_ips_lock);
+	// another thread might have added it meanwhile.
+	if((found = internal_ips_find(name, hash)) != -1) {
+		data->resolved_addr = make_internal_ip(found);
+		goto have_ip;
+	}
+
+	i = internal_ips.counter;
+	data->resolved_addr = make_internal_ip(i);
+	if(data->resolved_addr == (in_addr_t) - 1)
+		goto err_plus_unlock;
+
+	if(!internal_ips.chunk[i / INTERNAL_IPS_CHUNK]) {
+		PDEBUG("proxy_gethostbyname: core.c: new chunk\n");
+		new_mem = calloc(INTERNAL_IPS_CHUNK, sizeof(string_hash_tuple));
+		if(!new_mem) {
     // goto ------------
 	oom:
-			proxybound_write_log(LOG_PREFIX "ERROR: OUT OF MEMORY!\n\n\n");
+			proxybound_log(PB_LOG_ERROR, LOG_PREFIX "ERROR: OUT OF MEMORY!\n\n\n");
 			goto err_plus_unlock;
 		}
+		__atomic_store_n(&internal_ips.chunk[i / INTERNAL_IPS_CHUNK], new_mem, __ATOMIC_RELEASE);
 	}
 
-	data->resolved_addr = make_internal_ip(internal_ips.counter);
-	if(data->resolved_addr == (in_addr_t) - 1)
-		goto err_plus_unlock;
-
 	l = strlen(name);
-	new_mem = malloc(sizeof(string_hash_tuple) + l + 1);
+	new_mem = malloc(l + 1);
 	if(!new_mem)
 		goto oom;
+	memcpy(new_mem, name, l + 1);
 
-	PDEBUG("proxy_gethostbyname: core.c: creating new entry %d for ip of %s\n", (int) internal_ips.counter, name);
-
-	internal_ips.list[internal_ips.counter] = new_mem;
-	internal_ips.list[internal_ips.counter]->hash = hash;
-	internal_ips.list[internal_ips.counter]->string = (char *) new_mem + sizeof(string_hash_tuple);
+	PDEBUG("proxy_gethostbyname: core.c: creating new entry %d for ip of %s\n", (int) i, name);
 
-	memcpy(internal_ips.list[internal_ips.counter]->string, name, l + 1);
+	entry = internal_ips_entry(i);
+	entry->hash = hash;
+	entry->string = new_mem;
+	entry->next = internal_ips.bucket[hash % INTERNAL_IPS_BUCKETS];
 
-	internal_ips.counter += 1;
+	// reverse lookups see the entry first, so a fake ip is never unknown.
+	__atomic_store_n(&internal_ips.counter, i + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&internal_ips.bucket[hash % INTERNAL_IPS_BUCKETS], i + 1, __ATOMIC_RELEASE);
 
     // goto ------------
 	have_ip:
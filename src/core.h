@@ -26,16 +26,26 @@
 #define __CORE_HEADER
 #define BUFF_SIZE 8*1024  // used to read responses from proxies.
 #define     MAX_LOCALNET 64
+#define     MAX_AUTH_SIZE 1024  // prebuilt credentials of one proxy
 
 typedef struct {
 	uint32_t hash;
+	uint32_t next;  // index + 1 of the next entry of the hash bucket, 0 ends
 	char* string;
 } string_hash_tuple;
 
+/* the fake ip table is append only: entries never move and are never
+   freed, so lookups in both directions go without a lock. writers take
+   internal_ips_lock, fill the entry, then publish it with release stores
+   of counter and of the bucket head. */
+#define INTERNAL_IPS_CHUNK 4096
+#define INTERNAL_IPS_CHUNKS 4096  // covers all 2^24 fake ips
+#define INTERNAL_IPS_BUCKETS 65536
+
 typedef struct {
 	uint32_t counter;
-	uint32_t capa;
-	string_hash_tuple** list;
+	string_hash_tuple *chunk[INTERNAL_IPS_CHUNKS];
+	uint32_t bucket[INTERNAL_IPS_BUCKETS];  // index + 1 of the newest entry
 } internal_ip_lookup_table;
 
 extern internal_ip_lookup_table internal_ips;
@@ -43,7 +53,8 @@ extern internal_ip_lookup_table internal_ips;
 #include <pthread.h>
 extern pthread_mutex_t internal_ips_lock;
 extern pthread_mutex_t hostdb_lock;
-# define MUTEX_LOCK(x) pthread_mutex_lock(x)
+extern pthread_mutex_t proxy_state_lock;
+# define MUTEX_LOCK(x) metrics_mutex_lock(x)
 # define MUTEX_UNLOCK(x) pthread_mutex_unlock(x)
 # define MUTEX_INIT(x,y) pthread_mutex_init(x, y)
 #else
@@ -59,7 +70,9 @@ typedef enum {
 	SOCKET_ERROR,  // look errno for more
 	CHAIN_DOWN,    // no proxy in chain responds to tcp
 	CHAIN_EMPTY,   //  if proxy_count = 0
-	BLOCKED  //  target's port blocked on last proxy in the chain
+	BLOCKED,  //  target's port blocked on last proxy in the chain
+	TIMED_OUT,     // no answer in time, the proxy may still be reaching the target
+	LOCAL_ERROR    // the request can't be made, e.g. a fake ip without a name
 } ERR_CODE;
 
 typedef enum {
@@ -71,7 +84,9 @@ typedef enum {
 typedef enum {
 	DYNAMIC_TYPE,
 	STRICT_TYPE,
-	RANDOM_TYPE}
+	RANDOM_TYPE,
+	ROUND_ROBIN_TYPE,
+	HASH_TYPE}
 chain_type;
 
 typedef enum {
@@ -83,7 +98,10 @@ typedef enum {
 
 typedef enum {
 	RANDOMLY,
-	FIFOLY
+	FIFOLY,
+	ROUND_ROBINLY,
+	HASHED,  // rendezvous hashing of the destination
+	RANKED   // FIFOLY in the order of proxybound_rank
 } select_type;
 
 typedef struct {
@@ -91,20 +109,192 @@ typedef struct {
 	unsigned short port;
 } localaddr_arg;
 
+/* one entry of the proxy table, kept small so chain selection walks a
+   dense array. the prebuilt handshake credentials (see proxy_build_auth())
+   live in proxybound_auth_pool, shared between proxies that use the same. */
+#define PROXY_AUTH_INVALID 0xffffffffU  // credentials too long to send
+#define MAX_PROXY_GROUPS 32
+
 typedef struct {
 	ip_type ip;
 	unsigned short port;
-	proxy_type pt;
-	proxy_state ps;
-	char user[256];
-	char pass[256];
+	unsigned char pt;  // proxy_type
+	unsigned char ps;  // proxy_state
+	uint32_t auth_off;
+	uint16_t auth_len;
+	uint16_t group;
+	uint16_t connect_ms, read_ms;  // timeouts of the proxy line, 0 for none
 } proxy_data;
 
+/* [ProxyList] is group 0, every [ProxyGroup name] section adds one. the
+   proxies of a group are a contiguous range of the table */
+typedef struct {
+	char name[32];
+	uint32_t first, count;
+	uint32_t alive, busy;  // members of its index sets, under proxy_state_lock
+	uint32_t rr;  // round_robin_chain cursor, atomic
+} proxy_group;
+
+extern proxy_data *proxybound_pd;
+extern unsigned int proxybound_proxy_count;
+extern const unsigned char *proxybound_auth_pool;
+extern proxy_group proxybound_groups[MAX_PROXY_GROUPS];
+extern unsigned int proxybound_group_count;
+
+static inline const unsigned char *proxy_auth(const proxy_data *pd) {
+	return pd->auth_off == PROXY_AUTH_INVALID ? NULL : proxybound_auth_pool + pd->auth_off;
+}
+
+int proxy_build_auth(proxy_type pt, const char *user, const char *pass, unsigned char *out, size_t outsize);
+int proxy_table_push(ip_type ip, unsigned short port, proxy_type pt, const char *user, const char *pass);
+int proxy_table_add_line(const char *line, size_t len);
+int proxy_table_load_list(const char *path);
+int proxy_table_group(const char *name);
+int proxy_group_find(const char *name);
+int proxy_table_finish(void);
+int proxy_table_adopt(proxy_data *pd, unsigned int count, const unsigned char *auth_pool);
+size_t proxy_table_pool_size(void);
+void proxy_set_state(proxy_data *pd, proxy_state ps);
+unsigned int proxy_release_busy(unsigned int group);
+void proxy_release_all(unsigned int group);
+proxy_data *proxy_random_alive(unsigned int group);
+unsigned int get_rand_int(unsigned int range);
+
+/* ranking from `proxybound probe`, both NULL when there's none. rank holds
+   table indices, the best proxies of a group first, in the group's range */
+#define RANK_WEIGHT_UNKNOWN 32768
+
+extern const uint32_t *proxybound_rank;
+extern const uint16_t *proxybound_weight;
+
+int rank_load(const char *path);
+void rank_adopt(const uint32_t *rank, const uint16_t *weight);
+int probe_run(unsigned int trials, unsigned int concurrency, unsigned int timeout_ms, const char *out);
+
+/* measured hop to hop latencies for latency ordered random chains */
+#define LATENCY_ORIGIN 0xffffffffU  // from for the connect to the first hop
+#define LATENCY_MAX_HOPS 8
+
+extern unsigned int proxybound_latency_order;
+
+void latency_record(uint32_t from, uint32_t to, uint64_t us);
+int latency_pick(unsigned int group, uint32_t *hops, unsigned int n);
+
+/* per proxy limits of handshakes in flight and of connections */
+#define LIMIT_MAX 65535
+#define LIMITS_ON() (proxy_max_inflight || proxy_max_conns)
+
+typedef struct {
+	uint32_t idx;
+	int32_t inflight_slot, conn_slot;  // shared slots, -1 for none
+} limit_hold;
+
+extern unsigned int proxy_max_inflight;
+extern unsigned int proxy_max_conns;
+extern unsigned int proxy_queue_timeout;
+extern int proxy_limits_shared;
+
+int limit_admit(proxy_data *pd, int wait, limit_hold *h);
+void limit_release(limit_hold *h, unsigned int n);
+void limit_established(int fd, const limit_hold *h, unsigned int n);
+void limit_close(int fd);
+void limit_close_range(unsigned int first, unsigned int last);
+
+/* per proxy timeouts, see timeout.c */
+#define TIMEOUT_CONNECT 0  // tcp connect to the proxy
+#define TIMEOUT_READ 1     // the proxy's own answers, the socks5 greeting
+#define TIMEOUT_HOP 2      // handshake of the hop to the next proxy
+#define TIMEOUT_KINDS 3
+
+extern unsigned int proxy_timeout_k;
+extern unsigned int proxy_timeout_floor;
+
+int proxy_timeout(const proxy_data *pd, int kind);
+void proxy_timeout_record(const proxy_data *pd, int kind, uint64_t us);
+
+/* background health checks, one entry per table index */
+typedef struct {
+	uint8_t down;  // last probe failed, atomic
+	uint16_t fails;  // consecutive failed probes
+	uint32_t connect_us, handshake_us;  // of the last good probe
+	uint64_t checked_us;
+} proxy_health;
+
+extern unsigned int health_check_interval;
+extern unsigned int health_check_concurrency;
+extern unsigned int health_check_timeout;
+
+typedef struct {
+	uint8_t ok;
+	uint32_t connect_us, handshake_us;
+} proxy_probe_result;
+
+void proxy_probe_batch(const uint32_t *idx, unsigned int n, unsigned int timeout_ms, proxy_probe_result *res);
+void health_start(void);
+int proxy_health_down(uint32_t i);
+const proxy_health *proxy_health_get(uint32_t i);
+
+void snapshot_reserve(void);
+int snapshot_load(void);
+void snapshot_publish(void);
+
+uint64_t metrics_now_us(void);
+void metrics_proxy_connect(proxy_data *pd, uint64_t us, int ok);
+void metrics_proxy_handshake(proxy_data *pd, uint64_t us, int retcode);
+void *metrics_map_list(const char *kind, uint32_t magic, uint32_t version, size_t size,
+		       void (*init)(void *, const char *));
+void metrics_chain_retry(chain_type ct);
+void metrics_chain_done(chain_type ct, uint64_t us, int ok);
+#ifdef THREAD_SAFE
+void metrics_mutex_lock(pthread_mutex_t *m);
+#endif
+
 int connect_proxy_chain (int sock, ip_type target_ip, unsigned short target_port,
-			 proxy_data * pd, unsigned int proxy_count, chain_type ct,
-			 unsigned int max_chain );
+			 unsigned int group, chain_type ct, unsigned int max_chain );
 
-void proxybound_write_log(char *str, ...);
+/* routing rules: "route domain|cidr|port MATCH GROUP|direct [CHAIN [LEN]]" */
+#define ROUTE_DIRECT -1
+
+typedef enum {
+	ROUTE_DOMAIN,
+	ROUTE_CIDR,
+	ROUTE_PORT
+} route_kind;
+
+typedef struct {
+	uint8_t kind;
+	uint8_t prefix_len;
+	int16_t group;  // ROUTE_DIRECT or a proxy group
+	int32_t chain_type;  // -1 keeps the global chain type
+	uint32_t max_chain;  // 0 keeps the global chain_len
+	uint32_t addr;  // network order
+	uint16_t port_lo, port_hi;
+	char group_name[32];
+	char domain[256];
+} route_rule;
+
+extern route_rule *proxybound_routes;
+extern unsigned int proxybound_route_count;
+
+int route_parse(const char *line);
+int route_compile(void);
+int route_adopt(const route_rule *rules, unsigned int count);
+const route_rule *route_lookup(ip_type ip, unsigned short port, const char *name);
+char *string_from_internal_ip(ip_type internalip);
+
+typedef enum {
+	PB_LOG_ERROR,
+	PB_LOG_WARN,
+	PB_LOG_INFO,
+	PB_LOG_DEBUG
+} log_level;
+
+void proxybound_log(log_level level, const char *fmt, ...);
+void proxybound_write_log(char *str, ...);  // PB_LOG_INFO
+void proxybound_log_flush(void);
+
+int proxybound_install_seccomp(int allow_dns);
+int proxybound_install_connect_notifier(void);
 
 typedef int (*connect_t)(int, const struct sockaddr *, socklen_t);
 typedef struct hostent* (*gethostbyname_t)(const char *);
@@ -114,6 +304,8 @@ typedef int (*getaddrinfo_t)(const char *, const char *, const struct addrinfo *
 typedef int (*getnameinfo_t) (const struct sockaddr *, socklen_t, char *, socklen_t, char *, socklen_t, int);
 
 extern connect_t true_connect;
+
+connect_t load_dll_connect(const char *dll_path);
 extern gethostbyname_t true_gethostbyname;
 extern getaddrinfo_t true_getaddrinfo;
 extern freeaddrinfo_t true_freeaddrinfo;
@@ -121,14 +313,16 @@ extern getnameinfo_t true_getnameinfo;
 extern gethostbyaddr_t true_gethostbyaddr;
     
 typedef ssize_t (*send_t)(int, const void *, size_t, int);
-typedef ssize_t (*sendto_t)(int, const void *, size_t, int, const struct sockaddr, socklen_t);
+typedef ssize_t (*sendto_t)(int, const void *, size_t, int, const struct sockaddr *, socklen_t);
 typedef ssize_t (*sendmsg_t)(int, const struct msghdr *, int);
 typedef int (*bind_t)(int, const struct sockaddr *, socklen_t);
+typedef int (*close_t)(int);
 
 extern send_t true_send;
 extern sendto_t true_sendto;
 extern sendmsg_t true_sendmsg;
 extern bind_t true_bind;
+extern close_t true_close;
 
 struct gethostbyname_data {
 	struct hostent hostent_space;
@@ -0,0 +1,321 @@
+/* background health checks (health_check_interval in the config).
+   one thread per process probes every proxy of the table in batches of
+   health_check_concurrency non blocking sockets: a tcp connect and a
+   handshake that asks for nothing (socks5 method negotiation, an http
+   OPTIONS request; socks4 has none, the connect has to do). a failed
+   proxy is taken out of selection until a later round sees it again, so
+   application connects don't pay the connect timeout of a known dead one.
+   rounds repeat after the interval with +-20% jitter so that the processes
+   of a tree don't probe in lockstep. verdicts go to a shared table of the
+   config, indexed like the proxy table (metrics_health_table): a proxy
+   another process checked within the interval isn't probed again, and a
+   process starting up takes the known ones before its first connect. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "core.h"
+#include "common.h"
+#include "metrics.h"
+
+unsigned int health_check_interval;  // ms, 0 disables the checks
+unsigned int health_check_concurrency = 16;
+unsigned int health_check_timeout;   // ms, 0 takes tcp_connect_time_out
+
+extern int tcp_connect_time_out;
+
+static proxy_health *health;
+static metrics_health_table *shared;  // NULL when it couldn't be mapped
+static int health_state;  // 0 not started, 1 running
+static int atfork_done;
+
+enum { PROBE_CONNECT, PROBE_REPLY, PROBE_DONE };
+
+struct probe {
+	int fd;
+	int stage;
+	int ok;
+	uint32_t idx;
+	uint64_t start, connected, done;
+	size_t got;
+	char buf[16];
+};
+
+const proxy_health *proxy_health_get(uint32_t i) {
+	proxy_health *h = __atomic_load_n(&health, __ATOMIC_ACQUIRE);
+	return h && i < proxybound_proxy_count ? &h[i] : NULL;
+}
+
+int proxy_health_down(uint32_t i) {
+	proxy_health *h = __atomic_load_n(&health, __ATOMIC_ACQUIRE);
+	return h && i < proxybound_proxy_count && __atomic_load_n(&h[i].down, __ATOMIC_RELAXED);
+}
+
+static void probe_start(struct probe *p, uint32_t idx) {
+	proxy_data *pd = &proxybound_pd[idx];
+	struct sockaddr_in addr;
+
+	memset(p, 0, sizeof(*p));
+	p->idx = idx;
+	p->stage = PROBE_DONE;
+	p->start = metrics_now_us();
+	if((p->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+		return;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = pd->ip.as_int;
+	addr.sin_port = pd->port;
+	if(!true_connect(p->fd, (struct sockaddr *) &addr, sizeof(addr)) || errno == EINPROGRESS)
+		p->stage = PROBE_CONNECT;
+}
+
+/* connected: send the no-op request, socks4 is done already */
+static void probe_connected(struct probe *p) {
+	static const char options[] = "OPTIONS * HTTP/1.0\r\n\r\n";
+	proxy_data *pd = &proxybound_pd[p->idx];
+	unsigned char hello[4] = { 5, 1, 0, 2 };
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if(getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+		p->stage = PROBE_DONE;
+		return;
+	}
+	p->connected = metrics_now_us();
+	p->stage = PROBE_REPLY;
+	switch(pd->pt) {
+		case SOCKS4_TYPE:
+			p->ok = 1;
+			p->done = p->connected;
+			p->stage = PROBE_DONE;
+			break;
+		case SOCKS5_TYPE:
+			/* the methods tunnel_to() offers */
+			if(proxy_auth(pd))
+				hello[1] = 2;
+			if(send(p->fd, hello, 2 + hello[1], MSG_NOSIGNAL) != 2 + hello[1])
+				p->stage = PROBE_DONE;
+			break;
+		case HTTP_TYPE:
+			if(send(p->fd, options, sizeof(options) - 1, MSG_NOSIGNAL) != sizeof(options) - 1)
+				p->stage = PROBE_DONE;
+			break;
+	}
+}
+
+static void probe_reply(struct probe *p) {
+	proxy_data *pd = &proxybound_pd[p->idx];
+	ssize_t n = recv(p->fd, p->buf + p->got, sizeof(p->buf) - p->got, 0);
+
+	if(n <= 0) {
+		p->stage = PROBE_DONE;
+		return;
+	}
+	p->got += n;
+	p->done = metrics_now_us();
+	if(pd->pt == SOCKS5_TYPE && p->got >= 2) {
+		p->ok = p->buf[0] == 5 && (p->buf[1] == 0 || p->buf[1] == 2);
+		p->stage = PROBE_DONE;
+	} else if(pd->pt == HTTP_TYPE && p->got >= 5) {
+		p->ok = !memcmp(p->buf, "HTTP/", 5);
+		p->stage = PROBE_DONE;
+	}
+}
+
+/* record a verdict, flip the proxy's state when it changed */
+static void health_set(uint32_t i, int down) {
+	proxy_data *pd = &proxybound_pd[i];
+	char ip_buf[16];
+
+	if(health[i].down == down)
+		return;
+	pc_stringfromipv4(&pd->ip.octet[0], ip_buf);
+	proxybound_log(down ? PB_LOG_WARN : PB_LOG_INFO, LOG_PREFIX "health check: %s:%d %s\n", ip_buf,
+		       ntohs(pd->port), down ? "down" : "up");
+	__atomic_store_n(&health[i].down, down, __ATOMIC_RELAXED);
+	if(down)
+		proxy_set_state(pd, DOWN_STATE);
+	else if(pd->ps == DOWN_STATE)
+		proxy_set_state(pd, PLAY_STATE);
+}
+
+static void health_record(uint32_t i, const proxy_probe_result *r, uint64_t end) {
+	proxy_health *h = &health[i];
+
+	h->checked_us = end;
+	if(r->ok) {
+		h->connect_us = r->connect_us;
+		h->handshake_us = r->handshake_us;
+		h->fails = 0;
+	} else if(h->fails < 0xffff)
+		h->fails++;
+	if(shared) {
+		proxy_data *pd = &proxybound_pd[i];
+		__atomic_store_n(&shared->proxy[i].key, metrics_proxy_key(pd->ip.as_int, pd->port, pd->pt),
+				 __ATOMIC_RELAXED);
+		__atomic_store_n(&shared->proxy[i].down, !r->ok, __ATOMIC_RELAXED);
+		__atomic_store_n(&shared->proxy[i].rtt_us, r->ok ? r->connect_us + r->handshake_us : 0,
+				 __ATOMIC_RELAXED);
+		__atomic_store_n(&shared->proxy[i].checked_us, end, __ATOMIC_RELEASE);
+	}
+	health_set(i, !r->ok);
+}
+
+/* take the verdict of another process when it's younger than max_age */
+static int health_adopt(uint32_t i, uint64_t now, uint64_t max_age) {
+	uint64_t checked;
+
+	if(!shared || !(checked = __atomic_load_n(&shared->proxy[i].checked_us, __ATOMIC_ACQUIRE)) ||
+	   checked + max_age < now)
+		return 0;
+	health[i].checked_us = checked;
+	health_set(i, __atomic_load_n(&shared->proxy[i].down, __ATOMIC_RELAXED));
+	return 1;
+}
+
+/* probes the proxies at table indices idx concurrently, each gets
+   timeout_ms for connect and handshake. also used by `proxybound probe` */
+void proxy_probe_batch(const uint32_t *idx, unsigned int n, unsigned int timeout_ms, proxy_probe_result *res) {
+	struct probe probes[n];
+	struct pollfd pfd[n];
+	unsigned int i, k, pending;
+	uint64_t deadline, now;
+
+	for(i = 0; i < n; i++)
+		probe_start(&probes[i], idx[i]);
+	deadline = metrics_now_us() + timeout_ms * 1000ULL;
+	for(;;) {
+		for(i = 0, pending = 0; i < n; i++) {
+			if(probes[i].stage == PROBE_DONE)
+				continue;
+			pfd[pending].fd = probes[i].fd;
+			pfd[pending].events = probes[i].stage == PROBE_CONNECT ? POLLOUT : POLLIN;
+			pfd[pending].revents = 0;
+			pending++;
+		}
+		now = metrics_now_us();
+		if(!pending || now >= deadline)
+			break;
+		if(poll(pfd, pending, (deadline - now + 999) / 1000) <= 0)
+			continue;
+		for(i = 0, k = 0; i < n; i++) {
+			if(probes[i].stage == PROBE_DONE)
+				continue;
+			if(pfd[k].revents) {
+				if(probes[i].stage == PROBE_CONNECT)
+					probe_connected(&probes[i]);
+				else
+					probe_reply(&probes[i]);
+			}
+			k++;
+		}
+	}
+	for(i = 0; i < n; i++) {
+		struct probe *p = &probes[i];
+		if(p->fd != -1)
+			close(p->fd);
+		res[i].ok = p->ok;
+		res[i].connect_us = p->ok ? p->connected - p->start : 0;
+		res[i].handshake_us = p->ok ? p->done - p->connected : 0;
+	}
+}
+
+static void check_batch(const uint32_t *idx, unsigned int n, unsigned int timeout_ms) {
+	proxy_probe_result res[n];
+	uint64_t now;
+	unsigned int i;
+
+	proxy_probe_batch(idx, n, timeout_ms, res);
+	now = metrics_now_us();
+	for(i = 0; i < n; i++)
+		health_record(idx[i], &res[i], now);
+}
+
+static void *health_thread(void *arg) {
+	unsigned int conc = health_check_concurrency ? health_check_concurrency : 1;
+	unsigned int timeout = health_check_timeout ? health_check_timeout : (unsigned int) tcp_connect_time_out;
+	uint64_t fresh = health_check_interval * 800ULL;  // us, the shortest jittered interval
+	struct timespec ts;
+	uint32_t i, batch[256];
+	unsigned int n;
+	uint64_t ms, now;
+
+	(void) arg;
+	if(conc > 256)
+		conc = 256;
+	for(;;) {
+		now = metrics_now_us();
+		for(i = 0, n = 0; i < proxybound_proxy_count; i++) {
+			if(health_adopt(i, now, fresh))
+				continue;
+			batch[n++] = i;
+			if(n == conc) {
+				check_batch(batch, n, timeout);
+				n = 0;
+				now = metrics_now_us();
+			}
+		}
+		if(n)
+			check_batch(batch, n, timeout);
+		ms = health_check_interval * 4 / 5 + get_rand_int(health_check_interval * 2 / 5 + 1);
+		ts.tv_sec = ms / 1000;
+		ts.tv_nsec = (ms % 1000) * 1000000;
+		while(nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			;
+	}
+	return NULL;
+}
+
+/* a fork() child has no checker thread, the next connect starts one */
+static void atfork_child(void) {
+	health_state = 0;
+}
+
+/* called on connects, cheap once the thread runs */
+void health_start(void) {
+	sigset_t all, old;
+	pthread_attr_t attr;
+	pthread_t thread;
+	uint64_t now;
+	uint32_t i;
+	int expected = 0;
+
+	if(!health_check_interval || !proxybound_proxy_count || __atomic_load_n(&health_state, __ATOMIC_ACQUIRE))
+		return;
+	if(!__atomic_compare_exchange_n(&health_state, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return;
+	if(!health) {
+		proxy_health *h = calloc(proxybound_proxy_count, sizeof(*h));
+		if(!h)
+			return;
+		__atomic_store_n(&health, h, __ATOMIC_RELEASE);
+		shared = metrics_map_list("health", METRICS_HEALTH_MAGIC, METRICS_VERSION,
+					  metrics_health_size(proxybound_proxy_count), NULL);
+		/* what the other processes know */
+		now = metrics_now_us();
+		for(i = 0; i < proxybound_proxy_count; i++)
+			health_adopt(i, now, health_check_interval * 2000ULL);
+	}
+	if(!atfork_done) {
+		pthread_atfork(NULL, NULL, atfork_child);
+		atfork_done = 1;
+	}
+	/* the application's signals must not be delivered to our thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if(pthread_create(&thread, &attr, health_thread, NULL))
+		__atomic_store_n(&health_state, 0, __ATOMIC_RELEASE);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
@@ -0,0 +1,177 @@
+/* latency ordered random chains (latency_order in the config).
+   every chain_step() between two proxies of the table is timed and kept in
+   a sparse matrix: a direct mapped cache of (from, to) pairs with a moving
+   average, LATENCY_ORIGIN as from for the tcp connect to the first hop.
+   a random chain then draws latency_order candidate sets of hops the usual
+   random way, orders each one for the lowest estimated total and takes the
+   cheapest. 1 only reorders the hops that were drawn, so which proxies are
+   used stays as random as before; larger values trade some of that
+   randomness for latency. pairs never measured are estimated at 3/4 of
+   the mean of the measured ones (first hops and the others apart), so new
+   pairs get tried rather than the first one measured staying the best. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "core.h"
+#include "common.h"
+
+#define LATENCY_SLOTS 16384
+#define LATENCY_MAX_CANDIDATES 16
+
+typedef struct {
+	uint32_t from, to;  // table indices, to == 0xffffffff for a free slot
+	uint32_t avg_us;    // moving average, 1/4 weight for a new sample
+	uint32_t samples;
+} latency_pair;
+
+unsigned int proxybound_latency_order;
+
+static latency_pair *pairs;
+static uint64_t sum_us[2], sum_n[2];  // of the averages, [1] for LATENCY_ORIGIN
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int pair_slot(uint32_t from, uint32_t to) {
+	uint64_t x = ((uint64_t) from << 32 | to) * 0x9E3779B97F4A7C15ULL;
+	return (unsigned int) (x >> 50) % LATENCY_SLOTS;
+}
+
+void latency_record(uint32_t from, uint32_t to, uint64_t us) {
+	latency_pair *p;
+	if(us > 0xffffffffULL)
+		us = 0xffffffffULL;
+	pthread_mutex_lock(&latency_lock);
+	if(!pairs && (pairs = malloc(LATENCY_SLOTS * sizeof(*pairs))))
+		memset(pairs, 0xff, LATENCY_SLOTS * sizeof(*pairs));
+	if(pairs) {
+		p = &pairs[pair_slot(from, to)];
+		if(p->from != from || p->to != to || p->to == 0xffffffffU) {
+			/* a new pair takes the slot over */
+			if(p->to != 0xffffffffU) {
+				sum_us[p->from == LATENCY_ORIGIN] -= p->avg_us;
+				sum_n[p->from == LATENCY_ORIGIN]--;
+			}
+			p->from = from;
+			p->to = to;
+			p->avg_us = us;
+			p->samples = 1;
+			sum_us[from == LATENCY_ORIGIN] += us;
+			sum_n[from == LATENCY_ORIGIN]++;
+		} else {
+			uint32_t avg = p->avg_us - p->avg_us / 4 + us / 4;
+			sum_us[from == LATENCY_ORIGIN] += (uint64_t) avg - p->avg_us;  // mod 2^64
+			p->avg_us = avg;
+			p->samples++;
+		}
+	}
+	pthread_mutex_unlock(&latency_lock);
+}
+
+/* under latency_lock */
+static uint64_t estimate(uint32_t from, uint32_t to) {
+	latency_pair *p = &pairs[pair_slot(from, to)];
+	int origin = from == LATENCY_ORIGIN;
+	if(p->from == from && p->to == to)
+		return p->avg_us;
+	return sum_n[origin] ? sum_us[origin] * 3 / 4 / sum_n[origin] : 0;
+}
+
+/* orders hops for the lowest estimated origin -> hop[0] -> .. -> hop[n-1]
+   total, exactly (a dp over subsets) as n is at most STICKY_MAX_HOPS.
+   returns the estimate */
+static uint64_t order_hops(uint32_t *hops, unsigned int n) {
+	uint64_t cost[1 << LATENCY_MAX_HOPS][LATENCY_MAX_HOPS], c, best;
+	uint8_t prev[1 << LATENCY_MAX_HOPS][LATENCY_MAX_HOPS];
+	uint64_t edge[LATENCY_MAX_HOPS][LATENCY_MAX_HOPS], origin[LATENCY_MAX_HOPS];
+	uint32_t ordered[LATENCY_MAX_HOPS];
+	unsigned int full = (1U << n) - 1, mask, i, j, last = 0;
+
+	for(i = 0; i < n; i++) {
+		origin[i] = estimate(LATENCY_ORIGIN, hops[i]);
+		for(j = 0; j < n; j++)
+			edge[i][j] = estimate(hops[i], hops[j]);
+	}
+	for(mask = 1; mask <= full; mask++)
+		for(j = 0; j < n; j++)
+			cost[mask][j] = UINT64_MAX;
+	for(j = 0; j < n; j++)
+		cost[1U << j][j] = origin[j];
+	for(mask = 1; mask <= full; mask++)
+		for(j = 0; j < n; j++) {
+			if(cost[mask][j] == UINT64_MAX)
+				continue;
+			for(i = 0; i < n; i++) {
+				if(mask & (1U << i))
+					continue;
+				c = cost[mask][j] + edge[j][i];
+				if(c < cost[mask | 1U << i][i]) {
+					cost[mask | 1U << i][i] = c;
+					prev[mask | 1U << i][i] = j;
+				}
+			}
+		}
+	best = UINT64_MAX;
+	for(j = 0; j < n; j++)
+		if(cost[full][j] < best) {
+			best = cost[full][j];
+			last = j;
+		}
+	for(mask = full, i = n; i--;) {
+		ordered[i] = hops[last];
+		if(!i)
+			break;
+		j = prev[mask][last];
+		mask &= ~(1U << last);
+		last = j;
+	}
+	memcpy(hops, ordered, n * sizeof(*hops));
+	return best;
+}
+
+/* n distinct alive proxies of a group, drawn like random_chain draws them */
+static int draw_hops(unsigned int group, uint32_t *hops, unsigned int n) {
+	unsigned int i, k, tries = 0;
+	proxy_data *pd;
+
+	for(i = 0; i < n;) {
+		if(!(pd = proxy_random_alive(group)) || tries++ > n * 8)
+			return -1;
+		hops[i] = pd - proxybound_pd;
+		for(k = 0; k < i && hops[k] != hops[i]; k++)
+			;
+		if(k == i)
+			i++;
+	}
+	return 0;
+}
+
+/* the hops of a latency ordered random chain, -1 when the group has too
+   few alive proxies */
+int latency_pick(unsigned int group, uint32_t *hops, unsigned int n) {
+	uint32_t cand[LATENCY_MAX_HOPS];
+	uint64_t est, best = UINT64_MAX;
+	unsigned int k, rounds = proxybound_latency_order;
+
+	if(n > LATENCY_MAX_HOPS)
+		return -1;
+	if(rounds > LATENCY_MAX_CANDIDATES)
+		rounds = LATENCY_MAX_CANDIDATES;
+	for(k = 0; k < rounds; k++) {
+		int measured;
+		if(draw_hops(group, cand, n))
+			return k ? 0 : -1;
+		pthread_mutex_lock(&latency_lock);
+		measured = pairs != NULL;
+		est = measured ? order_hops(cand, n) : 0;
+		pthread_mutex_unlock(&latency_lock);
+		if(!k || est < best) {
+			best = est;
+			memcpy(hops, cand, n * sizeof(*hops));
+		}
+		if(!measured)
+			break;  // nothing to choose by yet
+	}
+	PDEBUG("latency: %u hops, estimate %llu us\n", n, (unsigned long long) best);
+	return 0;
+}
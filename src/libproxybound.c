@@ -34,16 +34,19 @@
 #include <sys/socket.h>
 #include <fcntl.h>
 #include <dlfcn.h>
+#include <sys/syscall.h>
+#include <pthread.h>
 
 #include "core.h"
 #include "common.h"
+#include "trace.h"
+#include "record.h"
 
 #define     satosin(x)      ((struct sockaddr_in *) &(x))
 #define     SOCKADDR(x)     (satosin(x)->sin_addr.s_addr)
 #define     SOCKADDR_2(x)     (satosin(x)->sin_addr)
 #define     SOCKPORT(x)     (satosin(x)->sin_port)
 #define     SOCKFAMILY(x)     (satosin(x)->sin_family)
-#define     MAX_CHAIN 512
 
 connect_t true_connect;
 gethostbyname_t true_gethostbyname;
@@ -56,38 +59,46 @@ send_t true_send;
 sendto_t true_sendto;
 sendmsg_t true_sendmsg;
 bind_t true_bind;
+close_t true_close;
 
 int tcp_read_time_out;
 int tcp_connect_time_out;
 chain_type proxybound_ct;
-proxy_data proxybound_pd[MAX_CHAIN];
-unsigned int proxybound_proxy_count = 0;
 int proxybound_got_chain_data = 0;
 unsigned int proxybound_max_chain = 1;
+unsigned int proxybound_sticky_ttl = 0;
+unsigned int proxybound_chain_retries = 8;
+unsigned int proxybound_retry_budget = 0;
+unsigned int proxybound_retry_backoff = 10;
+unsigned int proxybound_retry_backoff_max = 1000;
+char proxybound_probe_file[1024];
 int proxybound_quiet_mode = 0;
 int proxybound_allow_leak = 0;
 int proxybound_allow_dns = 0;
 int proxybound_working_indicator = 0;
+int proxybound_seccomp = 0;
 int proxybound_resolver = 1;
 localaddr_arg localnet_addr[MAX_LOCALNET];
 size_t num_localnet_addr = 0;
 unsigned int remote_dns_subnet = 224;
-#ifdef THREAD_SAFE
 pthread_once_t init_once = PTHREAD_ONCE_INIT;
-#endif
 
 static int init_l = 0;
 
 static void init_additional_settings(chain_type *ct);
 
-static inline void get_chain_data(proxy_data * pd, unsigned int *proxy_count, chain_type * ct);
+static inline void get_chain_data(chain_type * ct);
 
-static void manual_socks5_env(proxy_data * pd, unsigned int *proxy_count, chain_type * ct);
+static void manual_socks5_env(chain_type * ct);
 
 static int is_dns_port(unsigned short port);
 
+static int route_direct_connect(int sock, const struct sockaddr *addr, socklen_t len, ip_type ip, int fake);
+
 static void create_tmp_proof_file();
 
+static void signal_launcher(void);
+
 static void* load_sym(char* symname, void* proxyfunc) {
 
 	void *funcptr = dlsym(RTLD_NEXT, symname);
@@ -105,24 +116,42 @@ static void* load_sym(char* symname, void* proxyfunc) {
 	return funcptr;
 }
 
-#define INIT() init_lib_wrapper(__FUNCTION__)
+/* the once flag is only taken until the first hook finished the init */
+#define INIT() do { if(!__atomic_load_n(&init_l, __ATOMIC_ACQUIRE)) init_lib_wrapper(__FUNCTION__); } while(0)
 
 #define SETUP_SYM(X) do { true_ ## X = load_sym( # X, X ); } while(0)
 
+/* everything that can wait until the first network call */
 static void do_init(void) {
 	MUTEX_INIT(&internal_ips_lock, NULL);
 	MUTEX_INIT(&hostdb_lock, NULL);
-    
+	MUTEX_INIT(&proxy_state_lock, NULL);
+
     //file to indicate that the injection is working
     char *env; env = getenv(PROXYBOUND_WORKING_INDICATOR_ENV_VAR);
 	if(env && *env == '1') proxybound_working_indicator = 1;
     if (proxybound_working_indicator) create_tmp_proof_file();
     
-    /* check for simple SOCKS5 proxy setup */
-	manual_socks5_env(proxybound_pd, &proxybound_proxy_count, &proxybound_ct);
-    
-	/* read the config file */
-	get_chain_data(proxybound_pd, &proxybound_proxy_count, &proxybound_ct);
+	init_additional_settings(&proxybound_ct);
+	trace_init();
+	record_init();
+
+	/* a parent already compiled the config, mapping it is all we need */
+	if(snapshot_load()) {
+		/* check for simple SOCKS5 proxy setup */
+		manual_socks5_env(&proxybound_ct);
+
+		/* read the config file */
+		get_chain_data(&proxybound_ct);
+
+		if(proxy_table_finish() || route_compile() || (*proxybound_probe_file && rank_load(proxybound_probe_file)))
+			exit(1);
+
+		/* prebuild the credentials and share the result with our children */
+		snapshot_publish();
+	}
+	proxybound_got_chain_data = 1;
+
 
 	proxybound_write_log(LOG_PREFIX "DLL init\n");
 	
@@ -137,22 +166,26 @@ static void do_init(void) {
 	SETUP_SYM(sendto);
 	SETUP_SYM(sendmsg);
 	SETUP_SYM(bind);
+	if(!true_close)
+		SETUP_SYM(close);
 	
-	init_l = 1;
+	__atomic_store_n(&init_l, 1, __ATOMIC_RELEASE);
 }
 
 static void init_lib_wrapper(const char* caller) {
 #ifndef DEBUG
 	(void) caller;
 #endif
-#ifndef THREAD_SAFE
-	if(init_l) return;
 	PDEBUG("proxybound: %s called from %s\n", __FUNCTION__,  caller);
-	do_init();
-#else
-	if(!init_l) PDEBUG("proxybound: %s called from %s\n", __FUNCTION__,  caller);
 	pthread_once(&init_once, do_init);
-#endif
+}
+
+/* `proxybound probe` loads the dll and calls this, the table comes from
+   the same config parsing as for a proxified program */
+int proxybound_probe(unsigned int trials, unsigned int concurrency, unsigned int timeout_ms, const char *out) {
+	INIT();
+	return probe_run(trials, concurrency, timeout_ms ? timeout_ms : (unsigned int) tcp_connect_time_out,
+			 out ? out : proxybound_probe_file);
 }
 
 static void create_tmp_proof_file() {
@@ -162,17 +195,50 @@ static void create_tmp_proof_file() {
     fflush(fp);fclose(fp);
 }
 
-/* if we use gcc >= 3, we can instruct the dynamic loader 
- * to call init_lib at link time. otherwise it gets loaded
- * lazily, which has the disadvantage that there's a potential
- * race condition if 2 threads call it before init_l is set 
- * and PTHREAD support was disabled */
-#if __GNUC__ > 2
+/* the launcher waits on the read end of a pipe, the write end is only meant
+ * for the first process, so don't leak it into the descendants */
+static void signal_launcher(void) {
+	char *env = getenv(PROXYBOUND_READY_FD_ENV_VAR);
+	int fd;
+	if(!env)
+		return;
+	fd = atoi(env);
+	unsetenv(PROXYBOUND_READY_FD_ENV_VAR);
+	if(fd <= 2 || fcntl(fd, F_GETFD) == -1)
+		return;
+	if(write(fd, "1", 1) != 1)
+		PDEBUG("proxybound: can't signal launcher on fd %d\n", fd);
+	close(fd);
+}
+
+/* only what can not wait for the first hook runs before main(): the
+ * launcher is waiting for us and the seccomp filter has to be in place
+ * before the program creates its first socket, and the config snapshot
+ * memfd is set up while environ can still be changed safely. config parsing
+ * and symbol lookup are left to INIT(), processes that never touch the
+ * network don't pay for them */
 __attribute__((constructor))
 static void gcc_init(void) {
-	INIT();
+	char *env;
+
+    //tell the launcher that the injection is working
+    signal_launcher();
+	snapshot_reserve();
+
+	env = getenv(PROXYBOUND_SECCOMP_ENV_VAR);
+	if(!env || *env != '1')
+		return;
+	env = getenv(PROXYBOUND_ALLOW_LEAKS_ENV_VAR);
+	if(env && *env == '1')
+		return;
+	env = getenv(PROXYBOUND_ALLOW_DNS_ENV_VAR);
+
+	/* let the kernel refuse udp/raw sockets, the hooks can then skip their per call checks */
+	if(proxybound_install_seccomp(env && *env == '1'))
+		proxybound_log(PB_LOG_WARN, LOG_PREFIX "seccomp filter unavailable, using userspace checks only\n");
+	else
+		proxybound_seccomp = 1;
 }
-#endif
 
 static void init_additional_settings(chain_type *ct) {
 	char *env;
@@ -195,9 +261,9 @@ static void init_additional_settings(chain_type *ct) {
 }
 
 /* get configuration from config file */
-static void get_chain_data(proxy_data * pd, unsigned int *proxy_count, chain_type * ct) {
-	int count = 0, port_n = 0, list = 0;
-	char buff[1024], type[1024], host[1024], user[1024];
+static void get_chain_data(chain_type * ct) {
+	int list = 0;
+	char buff[1024], user[1024], path[1024];
 	char *env;
 	char local_in_addr_port[32];
 	char local_in_addr[32], local_in_port[32], local_netmask[32];
@@ -216,39 +282,85 @@ static void get_chain_data(proxy_data * pd, unsigned int *proxy_count, chain_typ
 		if(buff[0] != '\n' && buff[strspn(buff, " ")] != '#') {
 			/* proxylist has to come last */
 			if(list) {
-				if(count >= MAX_CHAIN)
-					break;
-				
-				memset(&pd[count], 0, sizeof(proxy_data));
-
-				pd[count].ps = PLAY_STATE;
-				port_n = 0;
-
-				sscanf(buff, "%s %s %d %s %s", type, host, &port_n, pd[count].user, pd[count].pass);
-
-				pd[count].ip.as_int = (uint32_t) inet_addr(host);
-				pd[count].port = htons((unsigned short) port_n);
-
-				if(!strcmp(type, "http")) {
-					pd[count].pt = HTTP_TYPE;
-				} else if(!strcmp(type, "socks4")) {
-					pd[count].pt = SOCKS4_TYPE;
-				} else if(!strcmp(type, "socks5")) {
-					pd[count].pt = SOCKS5_TYPE;
+				if(sscanf(buff, " [ProxyGroup %31[^]]]", path) == 1) {
+					if(proxy_table_group(path) == -1) {
+						fprintf(stderr, "ProxyGroup: too many groups or name too long: %s\n", path);
+						exit(1);
+					}
+				} else if(strstr(buff, "[ProxyList]")) {
+					proxy_table_group("ProxyList");
+				} else if(strstr(buff, "proxy_list_file")) {
+					if(sscanf(buff, "%s %1023s", user, path) < 2 || proxy_table_load_list(path)) {
+						fprintf(stderr, "proxy_list_file: cannot read %s\n", path);
+						exit(1);
+					}
 				} else
-					continue;
-
-				if(pd[count].ip.as_int && port_n && pd[count].ip.as_int != (uint32_t) - 1)
-					count++;
+					proxy_table_add_line(buff, strcspn(buff, "\n"));
 			} else {
 				if(strstr(buff, "[ProxyList]")) {
 					list = 1;
+				} else if(sscanf(buff, " [ProxyGroup %31[^]]]", path) == 1) {
+					list = 1;
+					if(proxy_table_group(path) == -1) {
+						fprintf(stderr, "ProxyGroup: too many groups or name too long: %s\n", path);
+						exit(1);
+					}
+				} else if(!strncmp(buff + strspn(buff, " \t"), "route", 5)) {
+					if(route_parse(buff)) {
+						fprintf(stderr, "route: invalid rule: %s", buff);
+						exit(1);
+					}
+				} else if(strstr(buff, "proxy_list_file")) {
+					if(sscanf(buff, "%s %1023s", user, path) < 2 || proxy_table_load_list(path)) {
+						fprintf(stderr, "proxy_list_file: cannot read %s\n", path);
+						exit(1);
+					}
+				} else if(strstr(buff, "probe_file")) {
+					sscanf(buff, "%s %1023s", user, proxybound_probe_file);
 				} else if(strstr(buff, "random_chain")) {
 					*ct = RANDOM_TYPE;
 				} else if(strstr(buff, "strict_chain")) {
 					*ct = STRICT_TYPE;
 				} else if(strstr(buff, "dynamic_chain")) {
 					*ct = DYNAMIC_TYPE;
+				} else if(strstr(buff, "round_robin_chain")) {
+					*ct = ROUND_ROBIN_TYPE;
+				} else if(strstr(buff, "hash_chain")) {
+					*ct = HASH_TYPE;
+				} else if(strstr(buff, "health_check_interval")) {
+					sscanf(buff, "%s %u", user, &health_check_interval);
+				} else if(strstr(buff, "health_check_concurrency")) {
+					sscanf(buff, "%s %u", user, &health_check_concurrency);
+				} else if(strstr(buff, "health_check_timeout")) {
+					sscanf(buff, "%s %u", user, &health_check_timeout);
+				} else if(strstr(buff, "proxy_max_inflight")) {
+					sscanf(buff, "%s %u", user, &proxy_max_inflight);
+					if(proxy_max_inflight > LIMIT_MAX)
+						proxy_max_inflight = LIMIT_MAX;
+				} else if(strstr(buff, "proxy_max_conns")) {
+					sscanf(buff, "%s %u", user, &proxy_max_conns);
+					if(proxy_max_conns > LIMIT_MAX)
+						proxy_max_conns = LIMIT_MAX;
+				} else if(strstr(buff, "proxy_queue_timeout")) {
+					sscanf(buff, "%s %u", user, &proxy_queue_timeout);
+				} else if(strstr(buff, "proxy_limits_shared")) {
+					proxy_limits_shared = 1;
+				} else if(strstr(buff, "latency_order")) {
+					sscanf(buff, "%s %u", user, &proxybound_latency_order);
+				} else if(strstr(buff, "chain_retries")) {
+					sscanf(buff, "%s %u", user, &proxybound_chain_retries);
+				} else if(strstr(buff, "chain_retry_budget")) {
+					sscanf(buff, "%s %u", user, &proxybound_retry_budget);
+				} else if(strstr(buff, "chain_retry_backoff_max")) {
+					sscanf(buff, "%s %u", user, &proxybound_retry_backoff_max);
+				} else if(strstr(buff, "chain_retry_backoff")) {
+					sscanf(buff, "%s %u", user, &proxybound_retry_backoff);
+				} else if(strstr(buff, "adaptive_timeout_floor")) {
+					sscanf(buff, "%s %u", user, &proxy_timeout_floor);
+				} else if(strstr(buff, "adaptive_timeouts")) {
+					sscanf(buff, "%s %u", user, &proxy_timeout_k);
+				} else if(strstr(buff, "sticky_ttl")) {
+					sscanf(buff, "%s %u", user, &proxybound_sticky_ttl);
 				} else if(strstr(buff, "tcp_read_time_out")) {
 					sscanf(buff, "%s %d", user, &tcp_read_time_out);
 				} else if(strstr(buff, "tcp_connect_time_out")) {
@@ -316,11 +428,10 @@ static void get_chain_data(proxy_data * pd, unsigned int *proxy_count, chain_typ
 		}
 	}
 	fclose(file);
-	*proxy_count = count;
 	proxybound_got_chain_data = 1;
 }
 
-static void manual_socks5_env(proxy_data *pd, unsigned int *proxy_count, chain_type *ct) {
+static void manual_socks5_env(chain_type *ct) {
 	char *port_string;
     char *host_string;
 
@@ -337,18 +448,14 @@ static void manual_socks5_env(proxy_data *pd, unsigned int *proxy_count, chain_t
     if(!host_string)
         host_string = "127.0.0.1";
 
-	memset(pd, 0, sizeof(proxy_data));
-
-	pd[0].ps = PLAY_STATE;
-	pd[0].ip.as_int = (uint32_t) inet_addr(host_string);
-	pd[0].port = htons((unsigned short) strtol(port_string, NULL, 0));
-	pd[0].pt = SOCKS5_TYPE;
+	ip_type ip;
+	ip.as_int = (uint32_t) inet_addr(host_string);
+	proxy_table_push(ip, htons((unsigned short) strtol(port_string, NULL, 0)), SOCKS5_TYPE, "", "");
 	proxybound_max_chain = 1;
 
 	if(getenv(PROXYBOUND_FORCE_DNS_ENV_VAR) && (*getenv(PROXYBOUND_FORCE_DNS_ENV_VAR) == '1'))
 		proxybound_resolver = 1;
 
-	*proxy_count = 1;
 	proxybound_got_chain_data = 1;
 }
 
@@ -401,15 +508,17 @@ static int is_dns_port(unsigned short port) {
 
 /**************************************************************************************************************************************************************/
 
-int connect(int sock, const struct sockaddr *addr, socklen_t len) {    
+static int hooked_connect(int sock, const struct sockaddr *addr, socklen_t len) {
     PDEBUG("\n\n\n\n\n\n\n\n\n\n\n\n...CONNECT........................................................................................................... \n\n");
 
+    INIT();
+
     if (true_connect == NULL) {
         PDEBUG("violation: connect: rejecting, unresolved symbol: connect\n");
         errno = ECONNREFUSED; return -1;
     }
     
-    int socktype = 0, flags = 0, ret = 0;
+    int socktype = 0, flags = 0, ret = 0, err;
     socklen_t optlen = 0;
     ip_type dest_ip;
     char ip[256];
@@ -417,9 +526,14 @@ int connect(int sock, const struct sockaddr *addr, socklen_t len) {
     unsigned short port;
     size_t i;
     int remote_dns_connect = 0;
-    INIT();
-    optlen = sizeof(socktype);
-    getsockopt(sock, SOL_SOCKET, SO_TYPE, &socktype, &optlen);    
+    const route_rule *route;
+    //With the seccomp filter only stream inet sockets can exist
+    if (proxybound_seccomp && !proxybound_allow_dns) {
+        socktype = SOCK_STREAM;
+    } else {
+        optlen = sizeof(socktype);
+        getsockopt(sock, SOL_SOCKET, SO_TYPE, &socktype, &optlen);
+    }
     
     if (!socktype) {
         PDEBUG("violation: connect: allowing, no socket_type\n");
@@ -486,17 +600,145 @@ int connect(int sock, const struct sockaddr *addr, socklen_t len) {
 	flags = fcntl(sock, F_GETFL, 0);
 	if(flags & O_NONBLOCK) {fcntl(sock, F_SETFL, !O_NONBLOCK);}
 	dest_ip.as_int = SOCKADDR(*addr);
-	ret = connect_proxy_chain(sock, dest_ip, SOCKPORT(*addr), proxybound_pd, proxybound_proxy_count, proxybound_ct, proxybound_max_chain);
+	route = route_lookup(dest_ip, port, remote_dns_connect ? string_from_internal_ip(dest_ip) : NULL);
+	if(route && route->group == ROUTE_DIRECT) {
+		fcntl(sock, F_SETFL, flags);
+		return route_direct_connect(sock, addr, len, dest_ip, remote_dns_connect);
+	}
+	ret = connect_proxy_chain(sock, dest_ip, SOCKPORT(*addr), route ? route->group : 0,
+				  route && route->chain_type != -1 ? (chain_type) route->chain_type : proxybound_ct,
+				  route && route->max_chain ? route->max_chain : proxybound_max_chain);
 
+	err = errno;
 	fcntl(sock, F_SETFL, flags);
-	if(ret != SUCCESS) errno = ECONNREFUSED;
+	errno = err;  // connect_proxy_chain tells exhausted retries from a refused target
+	return ret;
+}
+
+/* a direct route for a name we handed out a fake ip for, resolved for real */
+static int route_direct_connect(int sock, const struct sockaddr *addr, socklen_t len, ip_type ip, int fake) {
+	struct addrinfo hints, *res;
+	struct sockaddr_in sin;
+	char *name;
+
+	if(!fake)
+		return true_connect(sock, addr, len);
+	if(!(name = string_from_internal_ip(ip))) {
+		errno = ECONNREFUSED;
+		return -1;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if(true_getaddrinfo(name, NULL, &hints, &res)) {
+		errno = ECONNREFUSED;
+		return -1;
+	}
+	memcpy(&sin, res->ai_addr, sizeof(sin));
+	true_freeaddrinfo(res);
+	sin.sin_port = ((const struct sockaddr_in *) addr)->sin_port;
+	return true_connect(sock, (struct sockaddr *) &sin, sizeof(sin));
+}
+
+int connect(int sock, const struct sockaddr *addr, socklen_t len) {
+	uint64_t start;
+	int ret;
+
+	INIT();
+	health_start();
+	if(!record_enabled)
+		return hooked_connect(sock, addr, len);
+	start = record_now_ns();
+	ret = hooked_connect(sock, addr, len);
+	record_connect(start, addr, ret);
+	return ret;
+}
+
+/* ends the connections counted against the proxy limits. close() comes
+   before any init too, so the real one is looked up on first use */
+int close(int fd) {
+	close_t real = __atomic_load_n(&true_close, __ATOMIC_ACQUIRE);
+	if(!real) {
+		real = load_sym("close", close);
+		__atomic_store_n(&true_close, real, __ATOMIC_RELEASE);
+	}
+	limit_close(fd);
+	return real(fd);
+}
+
+/* the other ways a program closes a socket it connected through us */
+int dup2(int oldfd, int newfd) {
+	static int (*true_dup2)(int, int);
+	int (*real)(int, int) = __atomic_load_n(&true_dup2, __ATOMIC_ACQUIRE);
+	int ret;
+	if(!real) {
+		real = load_sym("dup2", dup2);
+		__atomic_store_n(&true_dup2, real, __ATOMIC_RELEASE);
+	}
+	if((ret = real(oldfd, newfd)) != -1 && oldfd != newfd)
+		limit_close(newfd);
+	return ret;
+}
+
+int dup3(int oldfd, int newfd, int flags) {
+	static int (*true_dup3)(int, int, int);
+	int (*real)(int, int, int) = __atomic_load_n(&true_dup3, __ATOMIC_ACQUIRE);
+	int ret;
+	if(!real) {
+		real = load_sym("dup3", dup3);
+		__atomic_store_n(&true_dup3, real, __ATOMIC_RELEASE);
+	}
+	if((ret = real(oldfd, newfd, flags)) != -1)
+		limit_close(newfd);
+	return ret;
+}
+
+#ifdef SYS_close_range
+# ifndef CLOSE_RANGE_CLOEXEC
+#  define CLOSE_RANGE_CLOEXEC (1U << 2)
+# endif
+/* not in every libc, the syscall does without them */
+static int sys_close_range(unsigned int first, unsigned int last, int flags) {
+	return syscall(SYS_close_range, first, last, flags);
+}
+
+static void sys_closefrom(int lowfd) {
+	syscall(SYS_close_range, lowfd, ~0U, 0);
+}
+
+int close_range(unsigned int first, unsigned int last, int flags) {
+	static int (*true_close_range)(unsigned int, unsigned int, int);
+	int (*real)(unsigned int, unsigned int, int) = __atomic_load_n(&true_close_range, __ATOMIC_ACQUIRE);
+	int ret;
+	if(!real) {
+		if(!(real = dlsym(RTLD_NEXT, "close_range")))
+			real = sys_close_range;
+		__atomic_store_n(&true_close_range, real, __ATOMIC_RELEASE);
+	}
+	if((ret = real(first, last, flags)) != -1 && !(flags & CLOSE_RANGE_CLOEXEC))
+		limit_close_range(first, last);
 	return ret;
 }
 
+void closefrom(int lowfd) {
+	static void (*true_closefrom)(int);
+	void (*real)(int) = __atomic_load_n(&true_closefrom, __ATOMIC_ACQUIRE);
+	if(!real) {
+		if(!(real = dlsym(RTLD_NEXT, "closefrom")))
+			real = sys_closefrom;
+		__atomic_store_n(&true_closefrom, real, __ATOMIC_RELEASE);
+	}
+	limit_close_range(lowfd, ~0U);
+	real(lowfd);
+}
+#endif
+
 //int connect(int sock, const struct sockaddr *addr, socklen_t len)
 int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
     PDEBUG("bind: got a bind request ------------------------\n");
     
+    INIT();
+
     if (true_bind == NULL) {
         PDEBUG("violation: bind: rejecting, unresolved symbol: bind\n");
         errno = EFAULT; return -1;
@@ -509,6 +751,12 @@ int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
     unsigned short port;
     size_t i;
     int remote_dns_bind = 0;
+
+    //Kernel already refuses udp/raw sockets, nothing to check
+    if (proxybound_seccomp && !proxybound_allow_dns) {
+        return true_bind(sockfd, addr, addrlen);
+    }
+
     optlen = sizeof(socktype);
     getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &socktype, &optlen);
     
@@ -598,6 +846,7 @@ int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 
 ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags) {
     PDEBUG("sendmsg: got sendmsg request --------------------\n");
+    INIT();
     return true_sendmsg(sockfd, msg, flags);
     
     if (true_sendmsg == NULL) {
@@ -691,18 +940,25 @@ ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags) {
 ssize_t sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen) {  
     PDEBUG("sendto: got sendto request ----------------------\n");
     
+    INIT();
+
     if (true_sendto == NULL) {
         PDEBUG("violation: sendto: rejecting, unresolved symbol: sendto\n");
         errno = EFAULT; return -1;        
     }    
     
+    //Kernel already refuses udp/raw sockets, nothing to check
+    if (proxybound_seccomp && !proxybound_allow_dns) {
+        return true_sendto(sockfd, buf, len, flags, dest_addr, addrlen);
+    }
+    
     int sock_type = -1;
     unsigned int sock_type_len = sizeof(sock_type);
     getsockopt(sockfd, SOL_SOCKET, SO_TYPE, (void *) &sock_type, &sock_type_len); //get the type of the socket
     
     if (!sock_type) {
         PDEBUG("violation: sendto: allowing, no socket_type\n");
-        return true_sendto(sockfd, buf, len, flags, *dest_addr, addrlen);
+        return true_sendto(sockfd, buf, len, flags, dest_addr, addrlen);
     }
     
     struct sockaddr_in *connaddr;
@@ -712,12 +968,12 @@ ssize_t sendto(int sockfd, const void *buf, size_t len, int flags, const struct
         PDEBUG("violation: sendto: null dest_addr\n");        
         //send(sockfd, buf, len, flags) = sendto(sockfd, buf, len, flags, NULL, 0)
         //send require connect on the first place... 
-        return true_sendto(sockfd, buf, len, flags, *dest_addr, addrlen);
+        return true_sendto(sockfd, buf, len, flags, dest_addr, addrlen);
     }
     
     if ((connaddr->sin_family != AF_INET) && (connaddr->sin_family != AF_INET6)) {
         PDEBUG("sendto: allowing non inet socket\n");
-        return true_sendto(sockfd, buf, len, flags, *dest_addr, addrlen);
+        return true_sendto(sockfd, buf, len, flags, dest_addr, addrlen);
     }
     
     //Block unsupported sock
@@ -745,25 +1001,25 @@ ssize_t sendto(int sockfd, const void *buf, size_t len, int flags, const struct
         //Allow local
         if ((ip[0] == '1') && (ip[1] == '2') && (ip[2] == '7') && (ip[3] == '.')) {
             PDEBUG("sendto: allowing local 127.0.0.1\n");
-            return true_sendto(sockfd, buf, len, flags, *dest_addr, addrlen);
+            return true_sendto(sockfd, buf, len, flags, dest_addr, addrlen);
         }
         
         //Blocking the connection
         if (proxybound_allow_leak) {
             PDEBUG("sendto: allowing udp/unsupported sendto()\n"); 
-             return true_sendto(sockfd, buf, len, flags, *dest_addr, addrlen);
+             return true_sendto(sockfd, buf, len, flags, dest_addr, addrlen);
         } else {
             //if (port < 0) {PDEBUG("violation: sendto: rejecting null port\n"); errno = EFAULT; return -1;}
-            //if ((proxybound_allow_dns) && (is_dns_port(port))) {return true_sendto(sockfd, buf, len, flags, *dest_addr, addrlen);} 
+            //if ((proxybound_allow_dns) && (is_dns_port(port))) {return true_sendto(sockfd, buf, len, flags, dest_addr, addrlen);} 
             PDEBUG("sendto: rejecting.\n");
             errno = EFAULT; return -1;
         }
     } else {
-        return true_sendto(sockfd, buf, len, flags, *dest_addr, addrlen);
+        return true_sendto(sockfd, buf, len, flags, dest_addr, addrlen);
     }    
     
     if (proxybound_allow_leak) {
-        return true_sendto(sockfd, buf, len, flags, *dest_addr, addrlen);
+        return true_sendto(sockfd, buf, len, flags, dest_addr, addrlen);
     }
     
     PDEBUG("sendto: rejecting.\n");
@@ -775,6 +1031,8 @@ ssize_t send(int sockfd, const void *buf, size_t len, int flags) {
     //The send() call may be used only when the socket is in a connected state (so that the intended recipient is known)
     //To avoid any hack this is watched for leak too
     
+    INIT();
+
     /* If the real connect doesn't exist, we're stuffed */
     if (true_send == NULL) {
         PDEBUG("violation: send: rejecting, unresolved symbol: send\n");
@@ -835,31 +1093,47 @@ static struct gethostbyname_data ghbndata;
 struct hostent *gethostbyname(const char *name) {
     PDEBUG("gethostbyname: got gethostbyname request --------\n");
     
+	struct hostent *he;
+	uint64_t start = 0;
+
 	INIT();
 
 	PDEBUG("gethostbyname: gethostbyname: %s\n", name);
 
+	if(record_enabled)
+		start = record_now_ns();
 	if(proxybound_resolver)
-		return proxy_gethostbyname(name, &ghbndata);
+		he = proxy_gethostbyname(name, &ghbndata);
 	else
-		return true_gethostbyname(name);
+		he = true_gethostbyname(name);
+	if(record_enabled)
+		record_resolve(start, name, he && he->h_addr_list[0] ? *(uint32_t *) he->h_addr_list[0] : 0, he ? 0 : -1);
 
-	return NULL;
+	return he;
 }
 
 int getaddrinfo(const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res) {
     PDEBUG("getaddrinfo: got getaddrinfo request ------------\n");
     
 	int ret = 0;
+	uint64_t start = 0;
+	struct addrinfo *ai;
 
 	INIT();
 
 	PDEBUG("getaddrinfo: %s %s\n", node, service);
 
+	if(record_enabled)
+		start = record_now_ns();
 	if(proxybound_resolver)
 		ret = proxy_getaddrinfo(node, service, hints, res);
 	else
 		ret = true_getaddrinfo(node, service, hints, res);
+	if(record_enabled) {
+		for(ai = ret ? NULL : *res; ai && ai->ai_family != AF_INET; ai = ai->ai_next)
+			;
+		record_resolve(start, node, ai ? ((struct sockaddr_in *) ai->ai_addr)->sin_addr.s_addr : 0, ret);
+	}
 
 	return ret;
 }
@@ -0,0 +1,429 @@
+/* per proxy admission limits (proxy_max_inflight, proxy_max_conns in the
+   config): at most max_inflight chains handshaking through a proxy at once
+   and at most max_conns connections through it, handshakes included. a
+   connection counts until the socket it was made for is closed with
+   close(), dup2()/dup3() over it, close_range() or closefrom(). those run
+   in signal handlers too, so they take no lock: they mark the fd closed in
+   a byte per fd and the next admission under the lock (or a queued waiter,
+   which looks every LIMIT_POLL_MS) ends the connection. closes we don't
+   see (fclose() of an fdopen()ed socket, raw syscalls) are found when a
+   proxy is full: a tracked fd that is gone or refers to another file by
+   then ends its connection.
+
+   a connect that finds a proxy full waits in the proxy's queue, first come
+   first served, for proxy_queue_timeout ms. chain types with a choice skip
+   full proxies instead and only queue when every candidate is full, see
+   admit_hop() in core.c.
+
+   with proxy_limits_shared the limits hold for all processes of the user:
+   every slot is a byte of a shared memory file, taken with a posix record
+   lock, which the kernel drops when the process dies. proxies are mapped
+   to the file by a hash of address, port and type, so two proxies sharing
+   a bucket share their limits. queue order only holds within a process,
+   waiters poll for the slots the other processes free. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "core.h"
+#include "common.h"
+
+#define LIMIT_SHARED_BUCKETS 65536
+#define LIMIT_POLL_MS 10  // waiters look for closed fds and the other processes' slots this often
+#define LIMIT_MAX_FDS (1U << 20)  // fds above aren't tracked, their connections end at once
+
+enum { FD_FREE, FD_LIMITED, FD_CLOSED };
+
+extern int tcp_connect_time_out;
+
+unsigned int proxy_max_inflight;
+unsigned int proxy_max_conns;
+unsigned int proxy_queue_timeout;
+int proxy_limits_shared;
+
+typedef struct limit_waiter {
+	struct limit_waiter *next;
+	pthread_cond_t cond;
+} limit_waiter;
+
+typedef struct {
+	uint32_t inflight, conns;  // of this process, conns includes inflight
+	limit_waiter *head, *tail;
+	uint8_t *held;  // shared: slot bytes this process has locked, inflight ones first
+} proxy_limit;
+
+typedef struct {
+	limit_hold *hold;
+	unsigned int n;
+	dev_t dev;  // of the socket, the number may have been reused
+	ino_t ino;
+} limit_fd;
+
+static proxy_limit *limits;
+static limit_fd *fds;  // under limit_lock
+static unsigned int fd_capa, fd_used;
+/* FD_* per fd, read and marked by the close hooks without the lock. sized
+   once to the fd limit so it never moves under them */
+static uint8_t *fd_state;
+static unsigned int fd_state_capa;
+static unsigned int fd_closed;  // FD_CLOSED marks not handled yet
+static int shared_fd = -1;
+static int atfork_done;
+static pthread_mutex_t limit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* under limit_lock */
+static int limits_get(void) {
+	char name[64];
+	struct rlimit rl;
+	void *map;
+	if(limits)
+		return 0;
+	if(!(limits = calloc(proxybound_proxy_count, sizeof(*limits))))
+		return -1;
+	if(!fd_state) {
+		/* untouched pages cost nothing, a fd limit of 1M is 1MB of address space */
+		fd_state_capa = getrlimit(RLIMIT_NOFILE, &rl) || rl.rlim_max > LIMIT_MAX_FDS ? LIMIT_MAX_FDS
+											: (unsigned int) rl.rlim_max;
+		map = mmap(NULL, fd_state_capa, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(map == MAP_FAILED)
+			fd_state_capa = 0;
+		else
+			__atomic_store_n(&fd_state, map, __ATOMIC_RELEASE);
+	}
+	if(proxy_limits_shared && shared_fd == -1) {
+		snprintf(name, sizeof(name), "/proxybound-limits-%u", (unsigned) getuid());
+		if((shared_fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1)
+			proxybound_log(PB_LOG_WARN, LOG_PREFIX "limits: %s: %s, not shared\n", name, strerror(errno));
+	}
+	return 0;
+}
+
+static off_t slot_offset(const proxy_data *pd, int conns, unsigned int slot) {
+	uint64_t h = ((uint64_t) pd->ip.as_int << 24 | (uint64_t) pd->port << 8 | pd->pt) * 0x9E3779B97F4A7C15ULL;
+	return ((off_t) (h >> 48) % LIMIT_SHARED_BUCKETS * 2 + conns) * 65536 + slot;
+}
+
+static int slot_lock(off_t off, short type) {
+	struct flock fl;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = off;
+	fl.l_len = 1;
+	return fcntl(shared_fd, F_SETLK, &fl);
+}
+
+/* a shared slot of one kind nobody holds, -1 when they're all taken */
+static int shared_take(uint32_t i, int conns, unsigned int max) {
+	proxy_limit *l = &limits[i];
+	unsigned int s, base = conns ? proxy_max_inflight : 0;
+	if(!l->held && !(l->held = calloc((proxy_max_inflight + proxy_max_conns + 7) / 8, 1)))
+		return -1;
+	for(s = 0; s < max; s++) {
+		if(l->held[(base + s) / 8] & (1 << (base + s) % 8))
+			continue;
+		if(!slot_lock(slot_offset(&proxybound_pd[i], conns, s), F_WRLCK)) {
+			l->held[(base + s) / 8] |= 1 << (base + s) % 8;
+			return s;
+		}
+	}
+	return -1;
+}
+
+static void shared_drop(uint32_t i, int conns, int slot) {
+	proxy_limit *l = &limits[i];
+	unsigned int bit = (conns ? proxy_max_inflight : 0) + slot;
+	if(slot < 0 || !l->held)
+		return;
+	slot_lock(slot_offset(&proxybound_pd[i], conns, slot), F_UNLCK);
+	l->held[bit / 8] &= ~(1 << bit % 8);
+}
+
+/* under limit_lock: take the slots of a proxy if it has room */
+static int try_take(uint32_t i, limit_hold *h) {
+	proxy_limit *l = &limits[i];
+	h->idx = i;
+	h->inflight_slot = h->conn_slot = -1;
+	if(proxy_max_inflight && l->inflight >= proxy_max_inflight)
+		return -1;
+	if(proxy_max_conns && l->conns >= proxy_max_conns)
+		return -1;
+	if(shared_fd != -1) {
+		if(proxy_max_inflight && (h->inflight_slot = shared_take(i, 0, proxy_max_inflight)) == -1)
+			return -1;
+		if(proxy_max_conns && (h->conn_slot = shared_take(i, 1, proxy_max_conns)) == -1) {
+			shared_drop(i, 0, h->inflight_slot);
+			h->inflight_slot = -1;
+			return -1;
+		}
+	}
+	l->inflight++;
+	l->conns++;
+	return 0;
+}
+
+/* under limit_lock: the first waiter of a proxy may have room now */
+static void wake(uint32_t i) {
+	if(limits[i].head)
+		pthread_cond_signal(&limits[i].head->cond);
+}
+
+static void dequeue(proxy_limit *l, limit_waiter *w) {
+	limit_waiter **pp;
+	for(pp = &l->head; *pp; pp = &(*pp)->next)
+		if(*pp == w) {
+			*pp = w->next;
+			if(l->tail == w)
+				l->tail = NULL;
+			break;
+		}
+	if(!l->tail)
+		for(l->tail = l->head; l->tail && l->tail->next; l->tail = l->tail->next)
+			;
+}
+
+static void fd_release(int fd);
+
+/* under limit_lock: end the connections of the fds the close hooks marked */
+static void reap(void) {
+	unsigned int fd;
+	if(!__atomic_exchange_n(&fd_closed, 0, __ATOMIC_ACQ_REL))
+		return;
+	for(fd = 0; fd < fd_capa; fd++)
+		if(__atomic_load_n(&fd_state[fd], __ATOMIC_RELAXED) == FD_CLOSED) {
+			if(fds[fd].n)
+				fd_release(fd);
+			else
+				__atomic_store_n(&fd_state[fd], FD_FREE, __ATOMIC_RELAXED);
+		}
+}
+
+/* under limit_lock: end the connections of sockets that were closed
+   behind our back. 0 when none was found */
+static int sweep(void) {
+	struct stat st;
+	unsigned int fd;
+	int found = 0;
+	for(fd = 0; fd < fd_capa && __atomic_load_n(&fd_used, __ATOMIC_RELAXED); fd++)
+		if(fds[fd].n && (fstat(fd, &st) || st.st_dev != fds[fd].dev || st.st_ino != fds[fd].ino)) {
+			PDEBUG("limits: fd %u was closed behind our back\n", fd);
+			fd_release(fd);
+			found = 1;
+		}
+	return found;
+}
+
+static void atfork_child(void) {
+	/* the locks of the parent aren't ours and its waiters don't exist here */
+	pthread_mutex_init(&limit_lock, NULL);
+	limits = NULL;
+	fds = NULL;
+	fd_capa = fd_used = fd_closed = 0;
+	if(fd_state)
+		munmap(fd_state, fd_state_capa);
+	fd_state = NULL;
+	fd_state_capa = 0;
+}
+
+/* admission to a proxy, 0 with the slots in h. wait: queue for up to
+   proxy_queue_timeout ms (tcp_connect_time_out when 0), else fail if full
+   or if others are queued already */
+int limit_admit(proxy_data *pd, int wait, limit_hold *h) {
+	uint32_t i = pd - proxybound_pd;
+	proxy_limit *l;
+	limit_waiter w;
+	pthread_condattr_t attr;
+	struct timespec now, until, tick;
+	unsigned int ms;
+	int ret = -1;
+
+	pthread_mutex_lock(&limit_lock);
+	if(!atfork_done) {
+		pthread_atfork(NULL, NULL, atfork_child);
+		atfork_done = 1;
+	}
+	if(limits_get())
+		goto out;
+	reap();
+	l = &limits[i];
+	if(!l->head && (!try_take(i, h) || (sweep() && !try_take(i, h)))) {
+		ret = 0;
+		goto out;
+	}
+	if(!wait)
+		goto out;
+
+	ms = proxy_queue_timeout ? proxy_queue_timeout : (unsigned int) tcp_connect_time_out;
+	clock_gettime(CLOCK_MONOTONIC, &until);
+	until.tv_sec += ms / 1000;
+	until.tv_nsec += (ms % 1000) * 1000000L;
+	if(until.tv_nsec >= 1000000000L) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000L;
+	}
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&w.cond, &attr);
+	pthread_condattr_destroy(&attr);
+	w.next = NULL;
+	if(l->tail)
+		l->tail->next = &w;
+	else
+		l->head = &w;
+	l->tail = &w;
+	PDEBUG("limits: queued for proxy %u\n", i);
+	for(;;) {
+		reap();
+		if(l->head == &w && !try_take(i, h)) {
+			ret = 0;
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(now.tv_sec > until.tv_sec || (now.tv_sec == until.tv_sec && now.tv_nsec >= until.tv_nsec))
+			break;
+		tick = until;
+		if(l->head == &w) {
+			/* closed fds and slots of other processes free up without a signal */
+			now.tv_nsec += LIMIT_POLL_MS * 1000000L;
+			if(now.tv_nsec >= 1000000000L) {
+				now.tv_sec++;
+				now.tv_nsec -= 1000000000L;
+			}
+			if(now.tv_sec < tick.tv_sec || (now.tv_sec == tick.tv_sec && now.tv_nsec < tick.tv_nsec))
+				tick = now;
+		}
+		pthread_cond_timedwait(&w.cond, &limit_lock, &tick);
+	}
+	dequeue(l, &w);
+	pthread_cond_destroy(&w.cond);
+	wake(i);  // the next one may fit as well, or gets its turn after a timeout
+	out:
+	pthread_mutex_unlock(&limit_lock);
+	return ret;
+}
+
+/* under limit_lock */
+static void release(limit_hold *h, int established) {
+	proxy_limit *l = &limits[h->idx];
+	if(!established) {
+		l->inflight--;
+		shared_drop(h->idx, 0, h->inflight_slot);
+		h->inflight_slot = -1;
+	}
+	l->conns--;
+	shared_drop(h->idx, 1, h->conn_slot);
+	wake(h->idx);
+}
+
+/* the chain failed or went another way */
+void limit_release(limit_hold *h, unsigned int n) {
+	unsigned int k;
+	if(!n)
+		return;
+	pthread_mutex_lock(&limit_lock);
+	for(k = 0; k < n; k++)
+		release(&h[k], 0);
+	pthread_mutex_unlock(&limit_lock);
+}
+
+/* under limit_lock */
+static void fd_release(int fd) {
+	limit_fd *f = &fds[fd];
+	unsigned int k;
+	for(k = 0; k < f->n; k++)
+		release(&f->hold[k], 1);
+	free(f->hold);
+	f->hold = NULL;
+	f->n = 0;
+	__atomic_store_n(&fd_state[fd], FD_FREE, __ATOMIC_RELAXED);
+	__atomic_store_n(&fd_used, fd_used - 1, __ATOMIC_RELAXED);
+}
+
+/* the chain is up on fd: its handshakes are done, its connections count
+   until close(fd) */
+void limit_established(int fd, const limit_hold *h, unsigned int n) {
+	limit_hold *copy = NULL;
+	struct stat st;
+	unsigned int k;
+
+	if(!n)
+		return;
+	pthread_mutex_lock(&limit_lock);
+	/* fd may be the number of a socket closed since */
+	reap();
+	for(k = 0; k < n; k++) {
+		limits[h[k].idx].inflight--;
+		shared_drop(h[k].idx, 0, h[k].inflight_slot);
+		wake(h[k].idx);
+	}
+	if(fd >= 0 && (unsigned int) fd >= fd_capa && (unsigned int) fd < fd_state_capa) {
+		unsigned int capa = fd_capa ? fd_capa : 64;
+		limit_fd *grown;
+		while(capa <= (unsigned int) fd)
+			capa *= 2;
+		if(capa > fd_state_capa)
+			capa = fd_state_capa;
+		if((grown = realloc(fds, capa * sizeof(*fds)))) {
+			memset(grown + fd_capa, 0, (capa - fd_capa) * sizeof(*fds));
+			fds = grown;
+			__atomic_store_n(&fd_capa, capa, __ATOMIC_RELAXED);
+		}
+	}
+	if(fd >= 0 && (unsigned int) fd < fd_capa && !fstat(fd, &st) && (copy = malloc(n * sizeof(*copy)))) {
+		/* closed behind our back (fclose, dup2 over it), that one is over */
+		if(fds[fd].n)
+			fd_release(fd);
+		memcpy(copy, h, n * sizeof(*copy));
+		for(k = 0; k < n; k++)
+			copy[k].inflight_slot = -1;
+		fds[fd].hold = copy;
+		fds[fd].n = n;
+		fds[fd].dev = st.st_dev;
+		fds[fd].ino = st.st_ino;
+		__atomic_store_n(&fd_state[fd], FD_LIMITED, __ATOMIC_RELEASE);
+		__atomic_store_n(&fd_used, fd_used + 1, __ATOMIC_RELAXED);
+	} else {
+		/* can't track it, don't let it block the proxies forever */
+		for(k = 0; k < n; k++) {
+			limit_hold done = h[k];
+			done.inflight_slot = -1;
+			release(&done, 1);
+		}
+	}
+	pthread_mutex_unlock(&limit_lock);
+}
+
+/* mark a tracked fd closed, atomics only: the close hooks may run in a
+   signal handler that interrupted a holder of limit_lock */
+static void mark_closed(uint8_t *state, unsigned int fd) {
+	uint8_t expected = FD_LIMITED;
+	if(__atomic_load_n(&state[fd], __ATOMIC_RELAXED) == FD_LIMITED &&
+	   __atomic_compare_exchange_n(&state[fd], &expected, FD_CLOSED, 0, __ATOMIC_RELEASE,
+				       __ATOMIC_RELAXED))
+		__atomic_fetch_add(&fd_closed, 1, __ATOMIC_RELEASE);
+}
+
+/* from the close() hook, a load for fds without a limited connection */
+void limit_close(int fd) {
+	uint8_t *state = __atomic_load_n(&fd_state, __ATOMIC_ACQUIRE);
+	if(state && fd >= 0 && (unsigned int) fd < fd_state_capa)
+		mark_closed(state, fd);
+}
+
+/* from the close_range() and closefrom() hooks */
+void limit_close_range(unsigned int first, unsigned int last) {
+	uint8_t *state = __atomic_load_n(&fd_state, __ATOMIC_ACQUIRE);
+	unsigned int fd, capa = __atomic_load_n(&fd_capa, __ATOMIC_RELAXED);  // tracked fds are below
+	if(!state)
+		return;
+	for(fd = first; fd < capa && fd <= last; fd++)
+		mark_closed(state, fd);
+}
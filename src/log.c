@@ -0,0 +1,386 @@
+/* asynchronous logger.
+   every thread formats its records into its own single producer ring, a
+   background thread drains all rings to the sink selected with
+   PROXYBOUND_LOG (stderr, file:/path or unix:/path for a datagram socket).
+   a full ring drops records instead of blocking the caller, the drops are
+   reported by the drain thread. it sleeps on a futex until a writer wakes
+   it. a line longer than a slot continues in the next slots, one longer
+   than LOG_LINE_MAX is cut and ends with "...[truncated]". stderr keeps the plain messages, file and
+   unix sinks get a timestamp, the level, pid and tid in front of each line. */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include "core.h"
+#include "common.h"
+
+#ifdef __linux__
+#include <linux/futex.h>
+#endif
+
+#define LOG_RING_SLOTS 128
+#define LOG_RECORD_SIZE 256
+#define LOG_OUT_SIZE (16 * 1024)
+#define LOG_LINE_MAX 2048
+
+extern int proxybound_quiet_mode;
+
+struct log_record {
+	unsigned long long ts_ns;
+	unsigned short len;
+	unsigned char level;
+	char text[LOG_RECORD_SIZE - sizeof(unsigned long long) - 4];
+};
+
+struct log_ring {
+	struct log_ring *next;
+	int owned;
+	int tid;
+	unsigned int head;      // only written by the owner thread
+	unsigned int tail;      // only written by the drain side
+	unsigned int dropped;
+	int line_start;
+	struct log_record rec[LOG_RING_SLOTS];
+};
+
+static const char *level_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+static struct log_ring *rings;
+static __thread struct log_ring *my_ring;
+static pthread_key_t ring_key;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static int log_threshold = PB_LOG_INFO;
+static int sink_fd = 2;
+static int sink_structured;
+static int drainer_state;      // 0 not started, 1 running, 2 unavailable
+static int drainer_sleeping;
+static unsigned int log_seq;
+
+static void log_wake(void) {
+	__atomic_fetch_add(&log_seq, 1, __ATOMIC_SEQ_CST);
+	if(!__atomic_load_n(&drainer_sleeping, __ATOMIC_SEQ_CST))
+		return;
+#ifdef __linux__
+	syscall(SYS_futex, &log_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+}
+
+static void log_wait(unsigned int seen) {
+#ifdef __linux__
+	syscall(SYS_futex, &log_seq, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+#else
+	struct timespec ts = { 0, 20 * 1000000L };
+	(void) seen;
+	nanosleep(&ts, NULL);
+#endif
+}
+
+static void sink_write(const char *buf, size_t len) {
+	ssize_t n;
+	if(sink_structured == 2) {  // datagram socket, one write per batch of lines
+		if(write(sink_fd, buf, len) == -1)
+			PDEBUG("log: dropped %zu bytes: %s\n", len, strerror(errno));
+		return;
+	}
+	while(len) {
+		n = write(sink_fd, buf, len);
+		if(n <= 0) {
+			if(n == -1 && errno == EINTR)
+				continue;
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/* caller holds drain_lock */
+static void drain_locked(void) {
+	static char out[LOG_OUT_SIZE];
+	struct log_ring *r;
+	struct log_record *rec;
+	unsigned int t, h, dropped;
+	size_t pos = 0;
+	int n;
+
+	for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		t = r->tail;
+		h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for(; t != h; t++) {
+			rec = &r->rec[t % LOG_RING_SLOTS];
+			if(pos + LOG_RECORD_SIZE + 96 > sizeof(out)) {
+				sink_write(out, pos);
+				pos = 0;
+			}
+			if(sink_structured && r->line_start) {
+				n = snprintf(out + pos, sizeof(out) - pos, "%llu.%06llu %s %d/%d ",
+					     rec->ts_ns / 1000000000ULL, (rec->ts_ns % 1000000000ULL) / 1000,
+					     level_names[rec->level], (int) getpid(), r->tid);
+				pos += n;
+			}
+			memcpy(out + pos, rec->text, rec->len);
+			pos += rec->len;
+			r->line_start = rec->len && rec->text[rec->len - 1] == '\n';
+		}
+		__atomic_store_n(&r->tail, t, __ATOMIC_RELEASE);
+		if((dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED))) {
+			n = snprintf(out + pos, sizeof(out) - pos, LOG_PREFIX "%u log records dropped\n", dropped);
+			pos += n;
+			r->line_start = 1;
+		}
+	}
+	if(pos)
+		sink_write(out, pos);
+}
+
+static void *drain_thread(void *arg) {
+	unsigned int seen;
+	(void) arg;
+	for(;;) {
+		seen = __atomic_load_n(&log_seq, __ATOMIC_ACQUIRE);
+		pthread_mutex_lock(&drain_lock);
+		drain_locked();
+		pthread_mutex_unlock(&drain_lock);
+		__atomic_store_n(&drainer_sleeping, 1, __ATOMIC_SEQ_CST);
+		if(seen == __atomic_load_n(&log_seq, __ATOMIC_SEQ_CST))
+			log_wait(seen);
+		__atomic_store_n(&drainer_sleeping, 0, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static void start_drainer(void) {
+	sigset_t all, old;
+	pthread_attr_t attr;
+	pthread_t t;
+	int expected = 0;
+
+	if(!__atomic_compare_exchange_n(&drainer_state, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return;
+	/* the application's signals must not be delivered to our thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if(pthread_create(&t, &attr, drain_thread, NULL))
+		__atomic_store_n(&drainer_state, 2, __ATOMIC_RELEASE);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void proxybound_log_flush(void) {
+	pthread_mutex_lock(&drain_lock);
+	drain_locked();
+	pthread_mutex_unlock(&drain_lock);
+}
+
+/* a fork() child only inherits the forking thread, flush before so nothing
+ * gets written twice, then forget the other threads and the drain thread */
+static void atfork_prepare(void) {
+	pthread_mutex_lock(&drain_lock);
+	drain_locked();
+}
+
+static void atfork_parent(void) {
+	pthread_mutex_unlock(&drain_lock);
+}
+
+static void atfork_child(void) {
+	struct log_ring *r;
+	pthread_mutex_init(&drain_lock, NULL);
+	for(r = rings; r; r = r->next)
+		if(r != my_ring) {
+			r->tail = r->head;
+			r->owned = 0;
+		}
+	if(my_ring)
+		my_ring->tid = (int) syscall(SYS_gettid);
+	drainer_state = 0;
+	drainer_sleeping = 0;
+}
+
+static void ring_release(void *arg) {
+	struct log_ring *r = arg;
+	__atomic_store_n(&r->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void log_init(void) {
+	char *env;
+	struct sockaddr_un sun;
+	int fd;
+
+	env = getenv(PROXYBOUND_LOG_LEVEL_ENV_VAR);
+	if(env) {
+		if(!strcmp(env, "error"))
+			log_threshold = PB_LOG_ERROR;
+		else if(!strcmp(env, "warn"))
+			log_threshold = PB_LOG_WARN;
+		else if(!strcmp(env, "info"))
+			log_threshold = PB_LOG_INFO;
+		else if(!strcmp(env, "debug"))
+			log_threshold = PB_LOG_DEBUG;
+	}
+
+	env = getenv(PROXYBOUND_LOG_ENV_VAR);
+	if(env && !strncmp(env, "file:", 5)) {
+		fd = open(env + 5, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+		if(fd != -1) {
+			sink_fd = fd;
+			sink_structured = 1;
+		}
+	} else if(env && !strncmp(env, "unix:", 5) && strlen(env + 5) < sizeof(sun.sun_path)) {
+		connect_t real_connect = (connect_t) dlsym(RTLD_NEXT, "connect");
+		fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, env + 5);
+		/* our connect() hook would recurse into the init */
+		if(fd != -1 && real_connect && !real_connect(fd, (struct sockaddr *) &sun, sizeof(sun))) {
+			sink_fd = fd;
+			sink_structured = 2;
+		} else if(fd != -1)
+			close(fd);
+	}
+
+	pthread_key_create(&ring_key, ring_release);
+	pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+	atexit(proxybound_log_flush);
+}
+
+static struct log_ring *get_ring(void) {
+	struct log_ring *r;
+	int expected;
+
+	if(my_ring)
+		return my_ring;
+	/* reuse the ring of a thread that is gone */
+	for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		expected = 0;
+		if(__atomic_compare_exchange_n(&r->owned, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			break;
+	}
+	if(!r) {
+		if(!(r = calloc(1, sizeof(*r))))
+			return NULL;
+		r->owned = 1;
+		r->line_start = 1;
+		r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&rings, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+	r->tid = (int) syscall(SYS_gettid);
+	pthread_setspecific(ring_key, r);
+	my_ring = r;
+	return r;
+}
+
+/* a line that doesn't fit one slot, spread over as many as it needs. the
+   drain thread only puts the prefix in front of the first one */
+static int log_record_long(struct log_ring *r, unsigned int h, int n, const char *fmt, va_list ap) {
+	static const char cut[] = "...[truncated]\n";
+	const size_t text = sizeof(r->rec[0].text);
+	char line[LOG_LINE_MAX];
+	unsigned int slots, i;
+	size_t len;
+
+	if(n >= (int) sizeof(line)) {
+		len = sizeof(line) - (sizeof(cut) - 1);
+		vsnprintf(line, len + 1, fmt, ap);
+		memcpy(line + len, cut, sizeof(cut) - 1);
+		n = sizeof(line);
+	} else
+		vsnprintf(line, sizeof(line), fmt, ap);
+	slots = (n + text - 1) / text;
+	if(h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) + slots > LOG_RING_SLOTS)
+		return -1;
+	for(i = 0; i < slots; i++) {
+		struct log_record *rec = &r->rec[(h + i) % LOG_RING_SLOTS];
+		len = n - i * text < text ? n - i * text : text;
+		rec->ts_ns = r->rec[h % LOG_RING_SLOTS].ts_ns;
+		rec->level = r->rec[h % LOG_RING_SLOTS].level;
+		memcpy(rec->text, line + i * text, len);
+		rec->len = len;
+	}
+	return slots;
+}
+
+static void log_record(int level, const char *fmt, va_list ap) {
+	struct log_ring *r;
+	struct log_record *rec;
+	struct timespec ts;
+	unsigned int h;
+	va_list aq;
+	int n;
+
+	if(!(r = get_ring()))
+		return;
+	h = r->head;
+	if(h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS)
+		goto drop;
+	rec = &r->rec[h % LOG_RING_SLOTS];
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec->ts_ns = (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec->level = level;
+	va_copy(aq, ap);
+	n = vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+	if(n < 0)
+		n = 0;
+	if(n < (int) sizeof(rec->text)) {
+		rec->len = n;
+		n = 1;
+	} else
+		n = log_record_long(r, h, n, fmt, aq);
+	va_end(aq);
+	if(n < 0)
+		goto drop;
+	__atomic_store_n(&r->head, h + n, __ATOMIC_RELEASE);
+
+	if(__atomic_load_n(&drainer_state, __ATOMIC_ACQUIRE) == 0)
+		start_drainer();
+	if(__atomic_load_n(&drainer_state, __ATOMIC_ACQUIRE) == 2)
+		proxybound_log_flush();
+	else
+		log_wake();
+	return;
+	drop:
+	__atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+	log_wake();
+}
+
+void proxybound_log(log_level level, const char *fmt, ...) {
+	va_list ap;
+
+	if(proxybound_quiet_mode)
+		return;
+	pthread_once(&log_once, log_init);
+	if((int) level > log_threshold)
+		return;
+	va_start(ap, fmt);
+	log_record(level, fmt, ap);
+	va_end(ap);
+}
+
+void proxybound_write_log(char *str, ...) {
+	va_list ap;
+
+	if(proxybound_quiet_mode)
+		return;
+	pthread_once(&log_once, log_init);
+	if(PB_LOG_INFO > log_threshold)
+		return;
+	va_start(ap, str);
+	log_record(PB_LOG_INFO, str, ap);
+	va_end(ap);
+}
@@ -22,9 +22,19 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/wait.h>
-#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
 #include "common.h"
 
+#ifdef __linux__
+#include <sys/syscall.h>
+/* P_PIDFD, not in every libc's idtype_t yet */
+# define PIDFD_WAITID 3
+#endif
+
+/* milliseconds the dll gets to report that it's loaded */
+#define INJECTION_TIMEOUT 2000
+
 
 static char appVersion[5] = "5.60\n";
 
@@ -47,9 +57,15 @@ static int usage(char **argv) {
     printf("https://github.com/Intika-Linux-Proxy/Proxybound\n");
     printf("\nUsage:\n");
 	printf("%s -q -f config_file command-or-app arguments\n", argv[0]);
+	printf("%s stats [-f config_file] [-1] [--json]\t show per proxy metrics of a config\n", argv[0]);
+	printf("%s probe [-f config_file] [-n trials] [-c concurrency] [-t timeout_ms] [-o file]\n"
+	       "\t measure every proxy and write the ranking (probe_file) that orders dynamic chains and weights random ones\n",
+	       argv[0]);
     printf("\nOptions:\n");
 	printf("-q \t makes proxybound quiet, this overrides the config setting\n");
     printf("-f \t allows to manually specify a configfile to use\n");
+    printf("--supervise \t intercept connect() with seccomp instead of LD_PRELOAD (static binaries)\n");
+    printf("--cgroup \t redirect tcp of a new cgroup to a local relay with bpf (root only)\n");
     printf("-v \t or --version, disaplay application version\n");
     printf("\nExample:\n");
     printf("proxybound telnet somehost.com\n");
@@ -59,9 +75,16 @@ static int usage(char **argv) {
     printf("- PROXYBOUND_SOCKS5_HOST:       Specify unique socks 5 proxy to use (default not used)\n");
     printf("- PROXYBOUND_SOCKS5_PORT:       Socks 5 port (default not used)\n");
     printf("- PROXYBOUND_FORCE_DNS:         Force dns resolv requests through (1 or 0, default 1)\n");
+    printf("- PROXYBOUND_TRACE_FILE:        Write a chrome trace of every connect phase to <value>.<pid>.json (default not used)\n");
+    printf("- PROXYBOUND_RECORD:            Record resolver calls and connects, no payload, to <value>.<pid>.pbr for tests/bench_replay (default not used)\n");
     printf("- PROXYBOUND_ALLOW_DNS:         Allow direct dns, allow udp port 53 and 853 (1 or 0, default 0)\n");
     printf("- PROXYBOUND_ALLOW_LEAKS:       Allow/Block unproxyfied protocols 'UDP/ICMP/RAW', blocked by default (1 or 0, default 0)\n");
     printf("- PROXYBOUND_WORKING_INDICATOR: Create '/tmp/proxybound.tmp' when dll is working as intended (1 or 0, default 0)\n");  
+    printf("- PROXYBOUND_SECCOMP:           Block udp/raw sockets and io_uring in kernel with a seccomp filter (1 or 0, default 0)\n");
+    printf("- PROXYBOUND_LOG:               Log sink, stderr, file:/path or unix:/path of a datagram socket (default stderr)\n");
+    printf("- PROXYBOUND_LOG_LEVEL:         Log level, error, warn, info or debug (default info)\n");
+    printf("- PROXYBOUND_METRICS:           Record per proxy metrics in shared memory for 'stats' (1 or 0, default 1)\n");
+    printf("- PROXYBOUND_LOCK_STATS:        Also count mutex acquisitions and waits for 'stats' (1 or 0, default 0)\n");
     printf("\nMore help:\n");
     printf("More help is available in README.md file https://github.com/Intika-Linux-Proxy/Proxybound\n\n");
 	return EXIT_FAILURE;
@@ -86,50 +109,124 @@ static void set_own_dir(const char *argv0) {
 	}
 }
 
-static int file_exist(const char * filename){
-    if (access( filename, F_OK ) != -1 ) {
-        return 1;
-    } else {
-        return 0;
-    }
+/* the first directory with the dll, its path in buf */
+static const char *find_dll(const char *argv0, char *buf, size_t bufsize) {
+	size_t i;
+
+	set_own_dir(argv0);
+	for(i = 0; dll_dirs[i]; i++) {
+		snprintf(buf, bufsize, "%s/%s", dll_dirs[i], dll_name);
+		if(access(buf, R_OK) != -1)
+			return dll_dirs[i];
+	}
+	return NULL;
 }
 
-static void wait_timer() {
-    //Wait 2 sec     
-    int msec = 0, trigger = 2000; /* 10ms */
-    clock_t before = clock();
-
-    do {
-        clock_t difference = clock() - before;
-        msec = difference * 1000 / CLOCKS_PER_SEC;
-        //iterations++;
-    } while ( msec < trigger );
-    //printf("Time taken %d seconds %d milliseconds (%d iterations)\n", msec/1000, msec%1000, iterations);
+typedef int (*probe_t)(unsigned int, unsigned int, unsigned int, const char *);
+
+/* proxybound probe [-f config] [-n trials] [-c concurrency] [-t timeout_ms] [-o file] */
+static int probe_main(int argc, char **argv) {
+	unsigned int trials = 3, concurrency = 64, timeout = 0;
+	char *path = NULL, *out = NULL;
+	char buf[256], pbuf[256];
+	probe_t probe;
+	int i;
+
+	for(i = 2; i < argc; i++) {
+		if(i + 1 >= argc)
+			return usage(argv);
+		if(!strcmp(argv[i], "-f"))
+			path = argv[++i];
+		else if(!strcmp(argv[i], "-n"))
+			trials = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-c"))
+			concurrency = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-t"))
+			timeout = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-o"))
+			out = argv[++i];
+		else
+			return usage(argv);
+	}
+	path = get_config_path(path, pbuf, sizeof(pbuf));
+	setenv(PROXYBOUND_CONF_FILE_ENV_VAR, path, 1);
+	setenv(PROXYBOUND_QUIET_MODE_ENV_VAR, "1", 1);
+	if(!find_dll(argv[0], buf, sizeof(buf))) {
+		fprintf(stderr, "couldnt locate %s\n", dll_name);
+		return EXIT_FAILURE;
+	}
+	if(!(probe = (probe_t) load_dll_sym(buf, "proxybound_probe")))
+		return EXIT_FAILURE;
+	return probe(trials, concurrency, timeout, out);
 }
 
-static int check_injection() {
-    if (file_exist("/tmp/proxybound.tmp")) {
-        //File already exist we can not do a lot
-        remove("/tmp/proxybound.tmp");
-        fprintf(stderr, LOG_PREFIX "injected dll loaded\n");
-        return 1;
-    } else {
-        wait_timer();
-        if (file_exist("/tmp/proxybound.tmp")) {
-            remove("/tmp/proxybound.tmp");
-            fprintf(stderr, LOG_PREFIX "injected dll loaded\n");
-            return 1;
-        } 
-        else {
-            kill(child_pid,SIGKILL);
-            perror("Proxybound can't be injected, it's not compatible with this application");
-            return -1;
-        }
-    }
-    return -1;
+static void forward_signal(int sig) {
+	if(child_pid > 0)
+		kill(child_pid, sig);
+}
+
+static int open_child_pidfd(void) {
+#if defined(__linux__) && defined(SYS_pidfd_open)
+	return syscall(SYS_pidfd_open, child_pid, 0);
+#else
+	return -1;
+#endif
+}
+
+/* the dll writes one byte to PROXYBOUND_READY_FD from its constructor, wait
+   for it (or for the child to die) instead of polling a file in /tmp */
+static int wait_injection(int ready_fd, int pidfd) {
+	struct pollfd pfd[2];
+	int nfds = 1, ret;
+	char c;
+
+	pfd[0].fd = ready_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = pidfd;
+	pfd[1].events = POLLIN;
+	if(pidfd != -1)
+		nfds = 2;
+
+	do {
+		ret = poll(pfd, nfds, INJECTION_TIMEOUT);
+	} while(ret == -1 && errno == EINTR);
+
+	if(ret > 0 && (pfd[0].revents & POLLIN) && read(ready_fd, &c, 1) == 1)
+		return 1;
+	/* child already gone (exec failure...), just report its status */
+	if(ret > 0 && (pfd[1].revents & POLLIN || pfd[0].revents & POLLHUP))
+		return 0;
+
+	kill(child_pid, SIGKILL);
+	fprintf(stderr, LOG_PREFIX "Proxybound can't be injected, it's not compatible with this application\n");
+	return -1;
 }
 
-#define MAX_COMMANDLINE_FLAGS 2
+static int wait_child(int pidfd) {
+	int status = 0;
+#if defined(__linux__) && defined(PIDFD_WAITID)
+	siginfo_t info;
+	if(pidfd != -1) {
+		memset(&info, 0, sizeof(info));
+		while(waitid((idtype_t) PIDFD_WAITID, pidfd, &info, WEXITED) == -1)
+			if(errno != EINTR)
+				goto fallback;
+		if(info.si_code == CLD_EXITED)
+			return info.si_status;
+		return 128 + info.si_status;
+	}
+	fallback:
+#endif
+	(void) pidfd;
+	while(waitpid(child_pid, &status, 0) == -1)
+		if(errno != EINTR)
+			return EXIT_FAILURE;
+	if(WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
+
+#define MAX_COMMANDLINE_FLAGS 4
 
 int main(int argc, char *argv[]) {
 	char *path = NULL;
@@ -137,20 +234,34 @@ int main(int argc, char *argv[]) {
 	char pbuf[256];
 	int start_argv = 1;
 	int quiet = 0;
+	int supervise = 0;
+	int cgroup = 0;
+	int ready[2], pidfd, ret;
 	size_t i;
 	const char *prefix = NULL;
 
-    if (argc != 2 || !strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
+    if (argc < 2 || !strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
         return usage(argv);
     }
     
-    if (argc != 2 || !strcmp(argv[1], "-v") || !strcmp(argv[1], "--version")) {
+    if (!strcmp(argv[1], "-v") || !strcmp(argv[1], "--version")) {
         return version(argv);
     }
+
+	if(!strcmp(argv[1], "stats"))
+		return stats_run(argc - 1, &argv[1]);
+	if(!strcmp(argv[1], "probe"))
+		return probe_main(argc, argv);
     
 	for(i = 0; i < MAX_COMMANDLINE_FLAGS; i++) {
 		if(start_argv < argc && argv[start_argv][0] == '-') {
-			if(argv[start_argv][1] == 'q') {
+			if(!strcmp(argv[start_argv], "--supervise")) {
+				supervise = 1;
+				start_argv++;
+			} else if(!strcmp(argv[start_argv], "--cgroup")) {
+				cgroup = 1;
+				start_argv++;
+			} else if(argv[start_argv][1] == 'q') {
 				quiet = 1;
 				start_argv++;
 			} else if(argv[start_argv][1] == 'f') {
@@ -161,7 +272,8 @@ int main(int argc, char *argv[]) {
 					return usage(argv);
 
 				start_argv += 2;
-			}
+			} else
+				return usage(argv);
 		} else
 			break;
 	}
@@ -177,30 +289,28 @@ int main(int argc, char *argv[]) {
 
 	/* Set PROXYBOUND_CONF_FILE to get proxybound lib to use new config file. */
 	setenv(PROXYBOUND_CONF_FILE_ENV_VAR, path, 1);
-    
-    setenv(PROXYBOUND_WORKING_INDICATOR_ENV_VAR, "1", 1);
 
 	if(quiet)
 		setenv(PROXYBOUND_QUIET_MODE_ENV_VAR, "1", 1);
 
 
 	// search DLL
-	set_own_dir(argv[0]);
-	i = 0;
-
-	while(dll_dirs[i]) {
-		snprintf(buf, sizeof(buf), "%s/%s", dll_dirs[i], dll_name);
-		if(access(buf, R_OK) != -1) {
-			prefix = dll_dirs[i];
-			break;
-		}
-		i++;
-	}
-
-	if(!prefix) {
+	if(!(prefix = find_dll(argv[0], buf, sizeof(buf)))) {
 		fprintf(stderr, "couldnt locate %s\n", dll_name);
 		return EXIT_FAILURE;
 	}
+
+	if(supervise) {
+		if(!quiet)
+			fprintf(stderr, LOG_PREFIX "supervising with %s/%s\n", prefix, dll_name);
+		return supervise_run(buf, &argv[start_argv]);
+	}
+	if(cgroup) {
+		if(!quiet)
+			fprintf(stderr, LOG_PREFIX "relaying cgroup connects with %s/%s\n", prefix, dll_name);
+		return cgroup_run(buf, &argv[start_argv]);
+	}
+
 	if(!quiet)
 		fprintf(stderr, LOG_PREFIX "preloading %s/%s\n", prefix, dll_name);
     
@@ -213,21 +323,43 @@ int main(int argc, char *argv[]) {
 	putenv("DYLD_FORCE_FLAT_NAMESPACE=1");
 #endif
     
-    //Running child process ************************************************************
-	//execvp(argv[start_argv], &argv[start_argv]);
-    child_pid = fork();
-    if(child_pid == 0){ 
-        //Child process injected application
-        execvp(argv[start_argv], &argv[start_argv]);
-        exit(0);
-    } else {
-        //Parent code
-    }
-    
-    if (check_injection())
-        return 0;
-    else {
-	    perror("Proxybound can't load process....");
-	    return EXIT_FAILURE;
-    }
+	if(pipe(ready) == -1) {
+		perror("pipe");
+		return EXIT_FAILURE;
+	}
+	fcntl(ready[0], F_SETFD, FD_CLOEXEC);
+	snprintf(pbuf, sizeof(pbuf), "%d", ready[1]);
+	setenv(PROXYBOUND_READY_FD_ENV_VAR, pbuf, 1);
+
+	child_pid = fork();
+	if(child_pid == -1) {
+		perror("fork");
+		return EXIT_FAILURE;
+	}
+	if(child_pid == 0) {
+		//Child process injected application
+		execvp(argv[start_argv], &argv[start_argv]);
+		perror(argv[start_argv]);
+		_exit(127);
+	}
+	close(ready[1]);
+	pidfd = open_child_pidfd();
+
+	signal(SIGINT, SIG_IGN);
+	signal(SIGQUIT, SIG_IGN);
+	signal(SIGTERM, forward_signal);
+	signal(SIGHUP, forward_signal);
+
+	ret = wait_injection(ready[0], pidfd);
+	close(ready[0]);
+	if(ret == 1 && !quiet)
+		fprintf(stderr, LOG_PREFIX "injected dll loaded\n");
+	if(ret == -1) {
+		wait_child(pidfd);
+		ret = EXIT_FAILURE;
+	} else
+		ret = wait_child(pidfd);
+	if(pidfd != -1)
+		close(pidfd);
+	return ret;
 }
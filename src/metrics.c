@@ -0,0 +1,253 @@
+/* per proxy and per chain type counters in shared memory, see metrics.h.
+   the segment is mapped on the first chain, updates are lock free atomic
+   adds so concurrent connects of any process never wait on each other.
+   PROXYBOUND_METRICS=0 disables it. the mutex counters are only kept with
+   PROXYBOUND_LOCK_STATS=1, on every lock they would turn the shared
+   segment into a contention point of their own. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "core.h"
+#include "common.h"
+#include "metrics.h"
+
+static metrics_segment *seg;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+#ifdef THREAD_SAFE
+static int lock_stats = -1;  // -1 until PROXYBOUND_LOCK_STATS was read
+#endif
+
+#define ADD(x, v) __atomic_fetch_add(&(x), (v), __ATOMIC_RELAXED)
+
+/* identifies the proxy list, a segment is only shared by processes that
+   index it with the same table */
+static uint64_t metrics_list_id(void) {
+	uint64_t h = 14695981039346656037ULL, key;
+	unsigned int i;
+	for(i = 0; i < proxybound_proxy_count; i++) {
+		key = metrics_proxy_key(proxybound_pd[i].ip.as_int, proxybound_pd[i].port, proxybound_pd[i].pt);
+		h = metrics_fnv(h, &key, sizeof(key));
+	}
+	return h;
+}
+
+/* the creator sizes and fills the segment before it publishes the magic */
+static void *metrics_create(int fd, uint32_t magic, uint32_t version, uint64_t id, size_t size,
+			    void (*init)(void *, const char *), const char *source) {
+	metrics_list_header *h;
+
+	if(ftruncate(fd, size))
+		return NULL;
+	h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(h == MAP_FAILED)
+		return NULL;
+	h->version = version;
+	h->nproxies = proxybound_proxy_count;
+	h->list_id = id;
+	if(init)
+		init(h, source);
+	__atomic_store_n(&h->magic, magic, __ATOMIC_RELEASE);
+	return h;
+}
+
+/* map the segment of another process if it was made for our proxy list.
+   -1 when it has to be replaced */
+static int metrics_attach(int fd, uint32_t magic, uint32_t version, uint64_t id, size_t size, void **out) {
+	metrics_list_header *h;
+	struct stat st;
+	int tries;
+
+	/* the creator is between shm_open() and publishing the magic */
+	for(tries = 0; tries < 100; tries++) {
+		if(fstat(fd, &st))
+			return 0;
+		if((size_t) st.st_size >= sizeof(*h)) {
+			h = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if(h == MAP_FAILED)
+				return 0;
+			if(__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) == magic) {
+				if((size_t) st.st_size == size && h->version == version && h->list_id == id &&
+				   h->nproxies == proxybound_proxy_count) {
+					*out = h;
+					return 0;
+				}
+				munmap(h, st.st_size);
+				return -1;
+			}
+			munmap(h, st.st_size);
+		}
+		usleep(1000);
+	}
+	/* its creator died half way */
+	return -1;
+}
+
+/* the segment of kind for the config and proxy list of the process, NULL
+   when there is none to be had. init fills a new one after its header */
+void *metrics_map_list(const char *kind, uint32_t magic, uint32_t version, size_t size,
+		       void (*init)(void *, const char *)) {
+	char name[64], source[METRICS_SOURCE];
+	void *map = NULL;
+	uint64_t id;
+	int fd, tries;
+
+	metrics_source(getenv(PROXYBOUND_CONF_FILE_ENV_VAR), source, sizeof(source));
+	metrics_shm_name(name, sizeof(name), source, kind);
+	id = metrics_list_id();
+	/* a few rounds in case processes of two lists replace each other */
+	for(tries = 0; tries < 4 && !map; tries++) {
+		if((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) != -1) {
+			if(!(map = metrics_create(fd, magic, version, id, size, init, source)))
+				shm_unlink(name);
+			close(fd);
+			break;
+		}
+		if(errno != EEXIST)
+			break;
+		if((fd = shm_open(name, O_RDWR | O_CLOEXEC, 0)) == -1)
+			continue;
+		if(metrics_attach(fd, magic, version, id, size, &map))
+			shm_unlink(name);
+		close(fd);
+	}
+	return map;
+}
+
+static void metrics_fill(void *map, const char *source) {
+	snprintf(((metrics_segment *) map)->source, METRICS_SOURCE, "%s", source);
+}
+
+static void metrics_init(void) {
+	char *env = getenv(PROXYBOUND_METRICS_ENV_VAR);
+
+	if(env && *env == '0')
+		return;
+	seg = metrics_map_list("metrics", METRICS_MAGIC, METRICS_VERSION, metrics_size(proxybound_proxy_count),
+			       metrics_fill);
+}
+
+static metrics_segment *metrics_get(void) {
+	/* sized after the proxy table, nothing to count before it's loaded */
+	if(!proxybound_proxy_count)
+		return NULL;
+	pthread_once(&metrics_once, metrics_init);
+	return seg;
+}
+
+/* the slot of a proxy of the table, the proxy's index in it. the key
+   marks it used for `proxybound stats`, the pages of the proxies that
+   never connect stay untouched */
+static metrics_proxy *metrics_slot(proxy_data *pd) {
+	metrics_segment *s = metrics_get();
+	metrics_proxy *mp;
+	if(!s)
+		return NULL;
+	if(pd < proxybound_pd || pd >= proxybound_pd + s->h.nproxies) {
+		ADD(s->dropped, 1);
+		return NULL;
+	}
+	mp = &s->proxy[pd - proxybound_pd];
+	if(!__atomic_load_n(&mp->key, __ATOMIC_RELAXED))
+		__atomic_store_n(&mp->key, metrics_proxy_key(pd->ip.as_int, pd->port, pd->pt), __ATOMIC_RELAXED);
+	return mp;
+}
+
+static void hist_add(metrics_hist *hist, uint64_t us) {
+	unsigned int b = us ? 64 - __builtin_clzll(us) : 0;
+	if(b >= METRICS_BUCKETS)
+		b = METRICS_BUCKETS - 1;
+	ADD(hist->count, 1);
+	ADD(hist->sum_us, us);
+	ADD(hist->bucket[b], 1);
+}
+
+uint64_t metrics_now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void metrics_proxy_connect(proxy_data *pd, uint64_t us, int ok) {
+	metrics_proxy *mp = metrics_slot(pd);
+	if(!mp)
+		return;
+	if(ok) {
+		ADD(mp->connects, 1);
+		hist_add(&mp->connect_time, us);
+	} else
+		ADD(mp->connect_fail, 1);
+}
+
+void metrics_proxy_handshake(proxy_data *pd, uint64_t us, int retcode) {
+	metrics_proxy *mp = metrics_slot(pd);
+	if(!mp)
+		return;
+	switch (retcode) {
+		case SUCCESS:
+			ADD(mp->handshakes, 1);
+			hist_add(&mp->handshake_time, us);
+			break;
+		case BLOCKED:
+			ADD(mp->blocked, 1);
+			break;
+		default:
+			ADD(mp->socket_error, 1);
+			break;
+	}
+}
+
+void metrics_chain_retry(chain_type ct) {
+	metrics_segment *s = metrics_get();
+	if(s && (unsigned) ct < METRICS_CHAIN_TYPES)
+		ADD(s->chain[ct].retries, 1);
+}
+
+void metrics_chain_done(chain_type ct, uint64_t us, int ok) {
+	metrics_segment *s = metrics_get();
+	if(!s || (unsigned) ct >= METRICS_CHAIN_TYPES)
+		return;
+	ADD(s->chain[ct].attempts, 1);
+	if(ok) {
+		ADD(s->chain[ct].success, 1);
+		hist_add(&s->chain[ct].total_time, us);
+	} else
+		ADD(s->chain[ct].fail, 1);
+}
+
+#ifdef THREAD_SAFE
+/* pthread_mutex_lock() that counts how often and how long it waited */
+void metrics_mutex_lock(pthread_mutex_t *m) {
+	int id = m == &hostdb_lock ? METRICS_LOCK_HOSTDB :
+		 m == &proxy_state_lock ? METRICS_LOCK_PROXY_STATE : METRICS_LOCK_INTERNAL_IPS;
+	int on = __atomic_load_n(&lock_stats, __ATOMIC_RELAXED);
+	metrics_segment *s;
+	uint64_t start;
+
+	if(on < 0) {
+		char *env = getenv(PROXYBOUND_LOCK_STATS_ENV_VAR);
+		__atomic_store_n(&lock_stats, on = env && *env == '1', __ATOMIC_RELAXED);
+	}
+	if(!on) {
+		pthread_mutex_lock(m);
+		return;
+	}
+	if(!pthread_mutex_trylock(m)) {
+		if((s = metrics_get()))
+			ADD(s->lock[id].acquired, 1);
+		return;
+	}
+	start = metrics_now_us();
+	pthread_mutex_lock(m);
+	if((s = metrics_get())) {
+		ADD(s->lock[id].acquired, 1);
+		ADD(s->lock[id].contended, 1);
+		ADD(s->lock[id].wait_us, metrics_now_us() - start);
+	}
+}
+#endif
@@ -0,0 +1,125 @@
+/* layout of the shared memory metrics and health segments.
+   written by the dll with relaxed atomics, read by `proxybound stats`.
+   the processes of a user that run the same config share one of each,
+   named after the config (metrics_shm_name()). they hold one slot per
+   line of the proxy list, indexed like the proxy table, so lookups are
+   O(1) and no proxy goes without. a process that finds the segment of
+   another proxy list under the name replaces it, so edited configs and
+   rotated lists don't pile up. latency histograms use log2 microsecond
+   buckets: bucket i counts samples below 2^i us (bucket 0: below 1us). */
+
+#ifndef __METRICS_HEADER
+#define __METRICS_HEADER
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define METRICS_MAGIC 0x31534d50U  // "PMS1"
+#define METRICS_HEALTH_MAGIC 0x31484250U  // "PBH1"
+#define METRICS_VERSION 7
+#define METRICS_SOURCE 256
+#define METRICS_BUCKETS 32
+#define METRICS_CHAIN_TYPES 5
+#define METRICS_LOCKS 3
+
+/* the mutexes of the dll, see MUTEX_LOCK in core.h */
+enum {
+	METRICS_LOCK_INTERNAL_IPS,
+	METRICS_LOCK_HOSTDB,
+	METRICS_LOCK_PROXY_STATE,
+};
+
+typedef struct {
+	uint64_t count;
+	uint64_t sum_us;
+	uint64_t bucket[METRICS_BUCKETS];
+} metrics_hist;
+
+typedef struct {
+	uint64_t key;  // 0 until the proxy is used, see metrics_proxy_key()
+	uint64_t connects;
+	uint64_t connect_fail;
+	uint64_t handshakes;
+	uint64_t blocked;
+	uint64_t socket_error;
+	metrics_hist connect_time;
+	metrics_hist handshake_time;
+} metrics_proxy;
+
+typedef struct {
+	uint64_t attempts;
+	uint64_t success;
+	uint64_t fail;
+	uint64_t retries;
+	metrics_hist total_time;
+} metrics_chain;
+
+typedef struct {
+	uint64_t acquired;
+	uint64_t contended;  // acquisitions that had to wait
+	uint64_t wait_us;
+} metrics_lock;
+
+/* the start of every segment made for a proxy list, see metrics_map_list() */
+typedef struct {
+	uint32_t magic;  // stored last by the creator
+	uint32_t version;
+	uint32_t nproxies;  // entries of the table that follows
+	uint32_t pad;
+	uint64_t list_id;  // hash of the keys of the proxy list, in table order
+} metrics_list_header;
+
+typedef struct {
+	metrics_list_header h;
+	uint64_t dropped;  // samples of proxies without a slot
+	char source[METRICS_SOURCE];  // the config path, see metrics_source()
+	metrics_chain chain[METRICS_CHAIN_TYPES];  // indexed by chain_type
+	metrics_lock lock[METRICS_LOCKS];
+	metrics_proxy proxy[];
+} metrics_segment;
+
+#define metrics_size(nproxies) (sizeof(metrics_segment) + (size_t) (nproxies) * sizeof(metrics_proxy))
+
+/* the last verdict of a health checker of any process, see health.c.
+   a segment of its own so that it's shared with PROXYBOUND_METRICS=0 too */
+typedef struct {
+	uint64_t key;  // see metrics_proxy_key()
+	uint64_t checked_us;  // CLOCK_MONOTONIC of the last probe, 0 for none
+	uint32_t down;
+	uint32_t rtt_us;  // connect and handshake of the last good probe
+} metrics_health;
+
+typedef struct {
+	metrics_list_header h;
+	metrics_health proxy[];
+} metrics_health_table;
+
+#define metrics_health_size(nproxies) \
+	(sizeof(metrics_health_table) + (size_t) (nproxies) * sizeof(metrics_health))
+
+/* ip and port in network order */
+#define metrics_proxy_key(ip, port, type) \
+	((uint64_t) (ip) | (uint64_t) (port) << 32 | (uint64_t) ((type) + 1) << 48)
+#define metrics_key_ip(key) ((uint32_t) (key))
+#define metrics_key_port(key) ((uint16_t) ((key) >> 32))
+#define metrics_key_type(key) ((int) ((key) >> 48) - 1)
+
+static inline uint64_t metrics_fnv(uint64_t h, const void *p, size_t len) {
+	const unsigned char *c = p;
+	while(len--) {
+		h ^= *c++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/* source is the config path, or "socks5 host:port" for PROXYBOUND_SOCKS5_PORT.
+   kind is "metrics" or "health" */
+static inline void metrics_shm_name(char *buf, size_t bufsize, const char *source, const char *kind) {
+	uint64_t h = metrics_fnv(14695981039346656037ULL, source, strlen(source));
+	snprintf(buf, bufsize, "/proxybound-%u-%016llx.%s", (unsigned) getuid(), (unsigned long long) h, kind);
+}
+
+#endif
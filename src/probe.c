@@ -0,0 +1,160 @@
+/* `proxybound probe`: measures every proxy of the table over a number of
+   trials, concurrency proxies at a time, with the health checker's probes
+   (tcp connect plus a no-op handshake of the proxy's type), and writes the
+   ranking file rank_load() reads (probe_file in the config). runs inside
+   the dll, loaded by the launcher, so the config is parsed the same way.
+
+   the weight of a proxy is its success rate times best_rtt / rtt, where
+   rtt is its median connect plus handshake time and best_rtt the lowest
+   of all proxies that answered, scaled to 1..65535. 0 for a proxy that
+   never answered. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "core.h"
+#include "common.h"
+
+#define PROBE_MAX_TRIALS 16
+#define PROBE_MAX_CONCURRENCY 256
+#define PROBE_SHOW 20
+
+typedef struct {
+	uint32_t idx;
+	uint16_t ok;
+	uint16_t weight;
+	uint32_t connect_us, handshake_us;  // medians of the good trials
+} probe_stat;
+
+static const char *probe_type_names[] = { "http", "socks4", "socks5" };
+
+static int cmp_u32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static int cmp_weight(const void *a, const void *b) {
+	const probe_stat *x = a, *y = b;
+	if(x->weight != y->weight)
+		return x->weight > y->weight ? -1 : 1;
+	return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+static uint32_t median(uint32_t *v, unsigned int n) {
+	if(!n)
+		return 0;
+	qsort(v, n, sizeof(*v), cmp_u32);
+	return v[n / 2];
+}
+
+static int probe_write(const char *out, const probe_stat *st, unsigned int count, unsigned int trials) {
+	char tmp[4096], ip_buf[16];
+	unsigned int i;
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", out, (int) getpid());
+	if(!(f = fopen(tmp, "w")))
+		return -1;
+	fprintf(f, "# proxybound probe: type ip port trials ok connect_us handshake_us weight\n");
+	for(i = 0; i < count; i++) {
+		proxy_data *pd = &proxybound_pd[st[i].idx];
+		pc_stringfromipv4(&pd->ip.octet[0], ip_buf);
+		fprintf(f, "%s %s %u %u %u %u %u %u\n", probe_type_names[pd->pt], ip_buf, ntohs(pd->port), trials,
+			st[i].ok, st[i].connect_us, st[i].handshake_us, st[i].weight);
+	}
+	if(fclose(f) || rename(tmp, out)) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+int probe_run(unsigned int trials, unsigned int concurrency, unsigned int timeout_ms, const char *out) {
+	unsigned int count = proxybound_proxy_count, i, t, n, alive = 0;
+	uint32_t *conn, *hs, batch[PROBE_MAX_CONCURRENCY], best = 0;
+	proxy_probe_result res[PROBE_MAX_CONCURRENCY];
+	probe_stat *st;
+	char ip_buf[16];
+
+	if(!out || !*out) {
+		fprintf(stderr, "probe: no output file, set probe_file in the config or use -o\n");
+		return 1;
+	}
+	if(!count) {
+		fprintf(stderr, "probe: no proxies in the config\n");
+		return 1;
+	}
+	trials = trials < 1 ? 1 : trials > PROBE_MAX_TRIALS ? PROBE_MAX_TRIALS : trials;
+	concurrency = concurrency < 1 ? 1 : concurrency > PROBE_MAX_CONCURRENCY ? PROBE_MAX_CONCURRENCY : concurrency;
+	st = calloc(count, sizeof(*st));
+	conn = malloc((size_t) count * trials * sizeof(*conn));
+	hs = malloc((size_t) count * trials * sizeof(*hs));
+	if(!st || !conn || !hs) {
+		fprintf(stderr, "probe: out of memory\n");
+		free(st);
+		free(conn);
+		free(hs);
+		return 1;
+	}
+
+	/* trial by trial, so the samples of a proxy are spread over the run */
+	for(t = 0; t < trials; t++) {
+		for(i = 0; i < count; i += n) {
+			unsigned int k;
+			n = count - i < concurrency ? count - i : concurrency;
+			for(k = 0; k < n; k++)
+				batch[k] = i + k;
+			proxy_probe_batch(batch, n, timeout_ms, res);
+			for(k = 0; k < n; k++) {
+				probe_stat *s = &st[i + k];
+				if(!res[k].ok)
+					continue;
+				conn[(size_t) (i + k) * trials + s->ok] = res[k].connect_us;
+				hs[(size_t) (i + k) * trials + s->ok] = res[k].handshake_us;
+				s->ok++;
+			}
+		}
+	}
+
+	for(i = 0; i < count; i++) {
+		probe_stat *s = &st[i];
+		s->idx = i;
+		s->connect_us = median(conn + (size_t) i * trials, s->ok);
+		s->handshake_us = median(hs + (size_t) i * trials, s->ok);
+		if(s->ok && (!alive++ || s->connect_us + s->handshake_us < best))
+			best = s->connect_us + s->handshake_us;
+	}
+	for(i = 0; i < count; i++) {
+		probe_stat *s = &st[i];
+		double w;
+		if(!s->ok)
+			continue;  // weight 0, never answered
+		w = 65535.0 * s->ok / trials * (best + 1) / (s->connect_us + s->handshake_us + 1);
+		s->weight = w < 1 ? 1 : w > 65535 ? 65535 : (uint16_t) w;
+	}
+	free(conn);
+	free(hs);
+	qsort(st, count, sizeof(*st), cmp_weight);
+
+	printf("%-22s %-6s %7s %10s %10s %7s\n", "PROXY", "TYPE", "OK", "CONN ms", "HS ms", "WEIGHT");
+	for(i = 0; i < count && i < PROBE_SHOW; i++) {
+		proxy_data *pd = &proxybound_pd[st[i].idx];
+		char name[32];
+		pc_stringfromipv4(&pd->ip.octet[0], ip_buf);
+		snprintf(name, sizeof(name), "%s:%u", ip_buf, ntohs(pd->port));
+		printf("%-22s %-6s %4u/%-2u %10.2f %10.2f %7u\n", name, probe_type_names[pd->pt], st[i].ok, trials,
+		       st[i].connect_us / 1000.0, st[i].handshake_us / 1000.0, st[i].weight);
+	}
+	if(count > PROBE_SHOW)
+		printf("... %u more\n", count - PROBE_SHOW);
+	if(probe_write(out, st, count, trials)) {
+		perror(out);
+		free(st);
+		return 1;
+	}
+	printf("%u of %u proxies answered, ranking written to %s\n", alive, count, out);
+	free(st);
+	return 0;
+}
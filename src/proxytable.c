@@ -0,0 +1,441 @@
+/* the proxy table: a dense array of small proxy_data entries (address,
+   port, type, state) and a pool with the prebuilt handshake credentials
+   they point into. identical credentials are stored once, which is the
+   common case for large lists of one provider. the table grows as needed,
+   entries come from [ProxyList], [ProxyGroup] sections, proxy_list_file or
+   a snapshot. proxies in PLAY_STATE and in BUSY_STATE are also kept in one
+   index set per group and state, so counting, releasing and random picks
+   don't walk the table. the sets of a group live in the range of the
+   group in alive_idx and busy_idx. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "core.h"
+#include "common.h"
+
+typedef struct {
+	uint32_t off;
+	uint32_t len;
+	uint32_t hash;
+} pool_entry;
+
+static const unsigned char empty_pool[1];
+
+proxy_data *proxybound_pd;
+unsigned int proxybound_proxy_count;
+const unsigned char *proxybound_auth_pool = empty_pool;
+proxy_group proxybound_groups[MAX_PROXY_GROUPS] = { { .name = "ProxyList" } };
+unsigned int proxybound_group_count = 1;
+
+static unsigned int pd_capa;
+static unsigned char *pool;
+static size_t pool_len, pool_capa;
+static pool_entry *intern;  // open addressing, len 0 marks a free slot
+static size_t intern_count, intern_capa;
+static unsigned int cur_group;
+static uint32_t *alive_idx, *busy_idx;  // under proxy_state_lock
+static uint32_t *set_pos;  // position of every proxy in the set of its state
+static unsigned int sets_capa;
+
+static uint32_t pool_hash(const unsigned char *p, size_t len) {
+	uint32_t h = 2166136261U;
+	while(len--) {
+		h ^= *p++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static int intern_grow(void) {
+	size_t capa = intern_capa ? intern_capa * 2 : 64, i, j;
+	pool_entry *n = calloc(capa, sizeof(*n));
+	if(!n)
+		return -1;
+	for(i = 0; i < intern_capa; i++) {
+		if(!intern[i].len)
+			continue;
+		for(j = intern[i].hash & (capa - 1); n[j].len; j = (j + 1) & (capa - 1))
+			;
+		n[j] = intern[i];
+	}
+	free(intern);
+	intern = n;
+	intern_capa = capa;
+	return 0;
+}
+
+/* offset of the credentials in the pool, added if they are new */
+static int64_t pool_intern(const unsigned char *auth, size_t len) {
+	uint32_t hash = pool_hash(auth, len);
+	size_t i;
+
+	if(!len)
+		return 0;
+	if((intern_count + 1) * 2 > intern_capa && intern_grow())
+		return -1;
+	for(i = hash & (intern_capa - 1); intern[i].len; i = (i + 1) & (intern_capa - 1))
+		if(intern[i].hash == hash && intern[i].len == len && !memcmp(pool + intern[i].off, auth, len))
+			return intern[i].off;
+	if(pool_len + len > pool_capa) {
+		size_t capa = pool_capa ? pool_capa * 2 : 4096;
+		unsigned char *n;
+		while(capa < pool_len + len)
+			capa *= 2;
+		if(!(n = realloc(pool, capa)))
+			return -1;
+		pool = n;
+		pool_capa = capa;
+		proxybound_auth_pool = pool;
+	}
+	memcpy(pool + pool_len, auth, len);
+	intern[i].off = pool_len;
+	intern[i].len = len;
+	intern[i].hash = hash;
+	intern_count++;
+	pool_len += len;
+	return intern[i].off;
+}
+
+static int sets_reserve(unsigned int capa) {
+	uint32_t *n;
+	if(capa <= sets_capa)
+		return 0;
+	if(!(n = realloc(alive_idx, capa * sizeof(*n))))
+		return -1;
+	alive_idx = n;
+	if(!(n = realloc(busy_idx, capa * sizeof(*n))))
+		return -1;
+	busy_idx = n;
+	if(!(n = realloc(set_pos, capa * sizeof(*n))))
+		return -1;
+	set_pos = n;
+	sets_capa = capa;
+	return 0;
+}
+
+/* the set of a state within the group of proxy i, 0 for untracked states */
+static int set_of(uint32_t i, int ps, uint32_t **idx, uint32_t **count) {
+	proxy_group *g = &proxybound_groups[proxybound_pd[i].group];
+	if(ps == PLAY_STATE) {
+		*idx = alive_idx + g->first;
+		*count = &g->alive;
+	} else if(ps == BUSY_STATE) {
+		*idx = busy_idx + g->first;
+		*count = &g->busy;
+	} else
+		return 0;
+	return 1;
+}
+
+static void set_add(uint32_t i, int ps) {
+	uint32_t *idx, *count;
+	if(!set_of(i, ps, &idx, &count))
+		return;
+	set_pos[i] = *count;
+	idx[(*count)++] = i;
+}
+
+/* swap remove, the last member takes the place of the removed one */
+static void set_remove(uint32_t i, int ps) {
+	uint32_t *idx, *count, last;
+	if(!set_of(i, ps, &idx, &count))
+		return;
+	last = idx[--(*count)];
+	idx[set_pos[i]] = last;
+	set_pos[last] = set_pos[i];
+}
+
+/* a health check or `proxybound probe` found it dead */
+static int known_dead(uint32_t i) {
+	return proxy_health_down(i) || (proxybound_weight && !proxybound_weight[i]);
+}
+
+/* all proxies of a group alive again, its sets rebuilt from scratch.
+   the ones known dead stay down, unless that is all of them: then the
+   verdict isn't worth more than a try */
+static void group_reset(proxy_group *g) {
+	uint32_t i;
+	g->alive = g->busy = 0;
+	for(i = g->first; i < g->first + g->count; i++) {
+		proxybound_pd[i].ps = known_dead(i) ? DOWN_STATE : PLAY_STATE;
+		set_add(i, proxybound_pd[i].ps);
+	}
+	if(g->alive)
+		return;
+	for(i = g->first; i < g->first + g->count; i++) {
+		proxybound_pd[i].ps = PLAY_STATE;
+		set_add(i, PLAY_STATE);
+	}
+}
+
+void proxy_set_state(proxy_data *pd, proxy_state ps) {
+	/* the chain target is a proxy_data outside of the table */
+	if(pd < proxybound_pd || pd >= proxybound_pd + proxybound_proxy_count) {
+		pd->ps = ps;
+		return;
+	}
+	MUTEX_LOCK(&proxy_state_lock);
+	if(pd->ps != ps) {
+		set_remove(pd - proxybound_pd, pd->ps);
+		set_add(pd - proxybound_pd, ps);
+		pd->ps = ps;
+	}
+	MUTEX_UNLOCK(&proxy_state_lock);
+}
+
+/* busy proxies back to PLAY_STATE, returns the number of alive ones */
+unsigned int proxy_release_busy(unsigned int group) {
+	proxy_group *g = &proxybound_groups[group];
+	unsigned int alive;
+	MUTEX_LOCK(&proxy_state_lock);
+	while(g->busy) {
+		uint32_t i = busy_idx[g->first + --g->busy];
+		proxybound_pd[i].ps = PLAY_STATE;
+		set_add(i, PLAY_STATE);
+	}
+	alive = g->alive;
+	MUTEX_UNLOCK(&proxy_state_lock);
+	return alive;
+}
+
+void proxy_release_all(unsigned int group) {
+	MUTEX_LOCK(&proxy_state_lock);
+	group_reset(&proxybound_groups[group]);
+	MUTEX_UNLOCK(&proxy_state_lock);
+}
+
+/* with probe weights: rejection sampling over the alive set, a candidate
+   is taken with probability weight / 65536. after RANK_TRIES rejections
+   the best candidate seen is used */
+#define RANK_TRIES 16
+
+static uint32_t weighted_alive(proxy_group *g) {
+	uint32_t i, best = alive_idx[g->first + get_rand_int(g->alive)];
+	unsigned int t;
+	for(t = 0, i = best; t < RANK_TRIES; t++, i = alive_idx[g->first + get_rand_int(g->alive)]) {
+		if(get_rand_int(65536) < proxybound_weight[i])
+			return i;
+		if(proxybound_weight[i] > proxybound_weight[best])
+			best = i;
+	}
+	return best;
+}
+
+proxy_data *proxy_random_alive(unsigned int group) {
+	proxy_group *g = &proxybound_groups[group];
+	proxy_data *pd = NULL;
+	MUTEX_LOCK(&proxy_state_lock);
+	if(g->alive)
+		pd = &proxybound_pd[proxybound_weight ? weighted_alive(g) : alive_idx[g->first + get_rand_int(g->alive)]];
+	MUTEX_UNLOCK(&proxy_state_lock);
+	return pd;
+}
+
+int proxy_group_find(const char *name) {
+	unsigned int g;
+	for(g = 0; g < proxybound_group_count; g++)
+		if(!strcmp(proxybound_groups[g].name, name))
+			return g;
+	return -1;
+}
+
+/* select the group following proxies go to, created on first use */
+int proxy_table_group(const char *name) {
+	int g = proxy_group_find(name);
+	if(g == -1) {
+		if(proxybound_group_count == MAX_PROXY_GROUPS || strlen(name) >= sizeof(proxybound_groups[0].name))
+			return -1;
+		g = proxybound_group_count++;
+		memset(&proxybound_groups[g], 0, sizeof(proxybound_groups[g]));
+		strcpy(proxybound_groups[g].name, name);
+	}
+	cur_group = g;
+	return g;
+}
+
+/* group ranges from the group of every entry, the table has to be sorted */
+static void groups_index(void) {
+	unsigned int g, i;
+	for(g = 0; g < proxybound_group_count; g++)
+		proxybound_groups[g].first = proxybound_groups[g].count = 0;
+	for(i = proxybound_proxy_count; i--;) {
+		proxy_group *grp = &proxybound_groups[proxybound_pd[i].group];
+		grp->first = i;
+		grp->count++;
+	}
+	for(g = 0; g < proxybound_group_count; g++)
+		group_reset(&proxybound_groups[g]);
+}
+
+/* after parsing: groups made contiguous (stable, a group's proxies keep
+   their order) and the index sets built */
+int proxy_table_finish(void) {
+	unsigned int start[MAX_PROXY_GROUPS] = { 0 }, g, i;
+	proxy_data *sorted;
+
+	if(sets_reserve(proxybound_proxy_count ? proxybound_proxy_count : 1))
+		return -1;
+	if(proxybound_group_count > 1) {
+		if(!(sorted = malloc((proxybound_proxy_count ? proxybound_proxy_count : 1) * sizeof(*sorted))))
+			return -1;
+		for(i = 0; i < proxybound_proxy_count; i++)
+			start[proxybound_pd[i].group]++;
+		for(g = 0, i = 0; g < proxybound_group_count; g++) {
+			unsigned int n = start[g];
+			start[g] = i;
+			i += n;
+		}
+		for(i = 0; i < proxybound_proxy_count; i++)
+			sorted[start[proxybound_pd[i].group]++] = proxybound_pd[i];
+		free(proxybound_pd);
+		proxybound_pd = sorted;
+		pd_capa = proxybound_proxy_count;
+	}
+	groups_index();
+	return 0;
+}
+
+int proxy_table_push(ip_type ip, unsigned short port, proxy_type pt, const char *user, const char *pass) {
+	unsigned char auth[MAX_AUTH_SIZE];
+	proxy_data *pd;
+	int64_t off;
+	int len;
+
+	if(proxybound_proxy_count == pd_capa) {
+		unsigned int capa = pd_capa ? pd_capa * 2 : 16;
+		if(!(pd = realloc(proxybound_pd, capa * sizeof(*pd))))
+			return -1;
+		proxybound_pd = pd;
+		pd_capa = capa;
+	}
+	pd = &proxybound_pd[proxybound_proxy_count];
+	memset(pd, 0, sizeof(*pd));
+	pd->ip = ip;
+	pd->port = port;
+	pd->pt = pt;
+	pd->ps = PLAY_STATE;
+	pd->group = cur_group;
+	pd->auth_off = PROXY_AUTH_INVALID;
+	if((len = proxy_build_auth(pt, user, pass, auth, sizeof(auth))) >= 0) {
+		if((off = pool_intern(auth, len)) == -1)
+			return -1;
+		pd->auth_off = off;
+		pd->auth_len = len;
+	}
+	proxybound_proxy_count++;
+	return 0;
+}
+
+/* next blank separated word of at most 255 chars, "" at the end */
+static const char *next_word(const char **p, const char *end, char *out) {
+	size_t n = 0;
+	while(*p < end && (**p == ' ' || **p == '\t' || **p == '\r'))
+		(*p)++;
+	while(*p < end && **p != ' ' && **p != '\t' && **p != '\r' && **p != '\n') {
+		if(n < 255)
+			out[n++] = **p;
+		(*p)++;
+	}
+	out[n] = 0;
+	return out;
+}
+
+/* "type host port [user pass] [connect_timeout=MS] [read_timeout=MS]",
+   lines that don't parse are skipped */
+int proxy_table_add_line(const char *line, size_t len) {
+	char type[256], host[256], port[256], user[256] = "", pass[256] = "", word[256];
+	const char *p = line, *end = line + len;
+	unsigned int connect_ms = 0, read_ms = 0, words = 0;
+	proxy_type pt;
+	ip_type ip;
+	int port_n;
+
+	next_word(&p, end, type);
+	next_word(&p, end, host);
+	next_word(&p, end, port);
+	while(*next_word(&p, end, word)) {
+		if(sscanf(word, "connect_timeout=%u", &connect_ms) == 1 || sscanf(word, "read_timeout=%u", &read_ms) == 1)
+			continue;
+		if(words < 2)
+			strcpy(words++ ? pass : user, word);
+	}
+
+	if(!strcmp(type, "http"))
+		pt = HTTP_TYPE;
+	else if(!strcmp(type, "socks4"))
+		pt = SOCKS4_TYPE;
+	else if(!strcmp(type, "socks5"))
+		pt = SOCKS5_TYPE;
+	else
+		return -1;
+	ip.as_int = (uint32_t) inet_addr(host);
+	port_n = atoi(port);
+	if(!ip.as_int || !port_n || ip.as_int == (uint32_t) - 1 || connect_ms > 65535 || read_ms > 65535)
+		return -1;
+	if(proxy_table_push(ip, htons((unsigned short) port_n), pt, user, pass))
+		return -1;
+	proxybound_pd[proxybound_proxy_count - 1].connect_ms = connect_ms;
+	proxybound_pd[proxybound_proxy_count - 1].read_ms = read_ms;
+	return 0;
+}
+
+/* a file with one [ProxyList] line per proxy, comments and blank lines
+   allowed. mapped instead of read, lists can be large */
+int proxy_table_load_list(const char *path) {
+	const char *map, *p, *end, *nl;
+	struct stat st;
+	int fd;
+
+	if((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 || fstat(fd, &st)) {
+		if(fd != -1)
+			close(fd);
+		return -1;
+	}
+	if(!st.st_size) {
+		close(fd);
+		return 0;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return -1;
+	madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
+	for(p = map, end = map + st.st_size; p < end; p = nl + 1) {
+		if(!(nl = memchr(p, '\n', end - p)))
+			nl = end;
+		p += strspn(p, " \t");
+		if(p < nl && *p != '#' && *p != '\r')
+			proxy_table_add_line(p, nl - p);
+	}
+	munmap((void *) map, st.st_size);
+	PDEBUG("proxy_table: %u proxies after %s\n", proxybound_proxy_count, path);
+	return 0;
+}
+
+/* replace the table, used for snapshots. the pool is not copied, the
+   groups have to be set up already and the table sorted by group */
+int proxy_table_adopt(proxy_data *pd, unsigned int count, const unsigned char *auth_pool) {
+	if(sets_reserve(count ? count : 1))
+		return -1;
+	free(proxybound_pd);
+	free(pool);
+	free(intern);
+	pool = NULL;
+	intern = NULL;
+	pool_len = pool_capa = intern_count = intern_capa = 0;
+	proxybound_pd = pd;
+	proxybound_proxy_count = pd_capa = count;
+	proxybound_auth_pool = auth_pool ? auth_pool : empty_pool;
+	groups_index();
+	return 0;
+}
+
+size_t proxy_table_pool_size(void) {
+	return pool_len;
+}
@@ -0,0 +1,141 @@
+/* proxy ranking from the file `proxybound probe` writes (probe_file in the
+   config): one line per proxy with its measured success rate, connect and
+   handshake times and a weight of 0..65535 derived from them. at init the
+   weights are matched to the table; dynamic_chain then walks each group
+   best first (proxybound_rank) and random_chain prefers proxies in
+   proportion to their weight. proxies with weight 0 never answered the
+   probe and start out down. proxies the file doesn't know get
+   RANK_WEIGHT_UNKNOWN, so a fresh entry is neither first nor last. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "core.h"
+#include "common.h"
+
+const uint32_t *proxybound_rank;
+const uint16_t *proxybound_weight;
+
+static uint32_t *owned_rank;
+static uint16_t *owned_weight;
+
+static uint32_t proxy_key_hash(uint32_t ip, uint16_t port, unsigned char pt) {
+	uint64_t x = ((uint64_t) ip << 24 | (uint64_t) port << 8 | pt) * 0x9E3779B97F4A7C15ULL;
+	return (uint32_t) (x >> 32);
+}
+
+static int same_proxy(const proxy_data *pd, uint32_t ip, uint16_t port, unsigned char pt) {
+	return pd->ip.as_int == ip && pd->port == port && pd->pt == pt;
+}
+
+/* weights are sorted descending, the table order breaks ties */
+static const uint16_t *sort_weight;
+
+static int cmp_rank(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	if(sort_weight[x] != sort_weight[y])
+		return sort_weight[x] > sort_weight[y] ? -1 : 1;
+	return x < y ? -1 : x > y;
+}
+
+static void rank_free(void) {
+	free(owned_rank);
+	free(owned_weight);
+	owned_rank = NULL;
+	owned_weight = NULL;
+	proxybound_rank = NULL;
+	proxybound_weight = NULL;
+}
+
+/* the alive sets start without the proxies that never answered */
+static void rank_reset_groups(void) {
+	unsigned int g;
+	for(g = 0; g < proxybound_group_count; g++)
+		proxy_release_all(g);
+}
+
+/* match the probe file to the table, which has to be sorted by group.
+   a missing file is not an error, the table just stays unranked */
+int rank_load(const char *path) {
+	char line[512], type[16], host[64];
+	unsigned int port, trials, ok, conn, hs, weight, g;
+	uint32_t *map, *rank, i, mask, h;
+	uint16_t *w;
+	proxy_type pt;
+	ip_type ip;
+	size_t capa = 64;
+	FILE *f;
+
+	rank_free();
+	if(!proxybound_proxy_count || !(f = fopen(path, "r")))
+		return 0;
+	while(capa < proxybound_proxy_count * 2)
+		capa *= 2;
+	mask = capa - 1;
+	map = calloc(capa, sizeof(*map));  // index + 1, 0 for a free slot
+	w = malloc(proxybound_proxy_count * sizeof(*w));
+	rank = malloc(proxybound_proxy_count * sizeof(*rank));
+	if(!map || !w || !rank) {
+		free(map);
+		free(w);
+		free(rank);
+		fclose(f);
+		return -1;
+	}
+	/* one map slot per distinct proxy, the same one may be listed with
+	   other credentials or in several groups. rank[] holds the table index
+	   of its first entry until the weights are spread */
+	for(i = 0; i < proxybound_proxy_count; i++) {
+		proxy_data *pd = &proxybound_pd[i];
+		w[i] = RANK_WEIGHT_UNKNOWN;
+		for(h = proxy_key_hash(pd->ip.as_int, pd->port, pd->pt) & mask;
+		    map[h] && !same_proxy(&proxybound_pd[map[h] - 1], pd->ip.as_int, pd->port, pd->pt); h = (h + 1) & mask)
+			;
+		if(!map[h])
+			map[h] = i + 1;
+		rank[i] = map[h] - 1;
+	}
+	while(fgets(line, sizeof(line), f)) {
+		if(line[0] == '#' ||
+		   sscanf(line, "%15s %63s %u %u %u %u %u %u", type, host, &port, &trials, &ok, &conn, &hs, &weight) != 8)
+			continue;
+		if(!strcmp(type, "http"))
+			pt = HTTP_TYPE;
+		else if(!strcmp(type, "socks4"))
+			pt = SOCKS4_TYPE;
+		else if(!strcmp(type, "socks5"))
+			pt = SOCKS5_TYPE;
+		else
+			continue;
+		if(inet_pton(AF_INET, host, &ip.as_int) != 1 || port > 65535)
+			continue;
+		for(h = proxy_key_hash(ip.as_int, htons(port), pt) & mask;
+		    map[h] && !same_proxy(&proxybound_pd[map[h] - 1], ip.as_int, htons(port), pt); h = (h + 1) & mask)
+			;
+		if(map[h])
+			w[map[h] - 1] = weight > 65535 ? 65535 : weight;
+	}
+	fclose(f);
+	free(map);
+	for(i = 0; i < proxybound_proxy_count; i++) {
+		w[i] = w[rank[i]];
+		rank[i] = i;
+	}
+	sort_weight = w;
+	for(g = 0; g < proxybound_group_count; g++)
+		qsort(rank + proxybound_groups[g].first, proxybound_groups[g].count, sizeof(*rank), cmp_rank);
+	proxybound_rank = owned_rank = rank;
+	proxybound_weight = owned_weight = w;
+	rank_reset_groups();
+	PDEBUG("rank: %u proxies ranked from %s\n", proxybound_proxy_count, path);
+	return 0;
+}
+
+/* point at a snapshot's arrays, NULL for an unranked table */
+void rank_adopt(const uint32_t *rank, const uint16_t *weight) {
+	rank_free();
+	proxybound_rank = rank;
+	proxybound_weight = weight;
+	rank_reset_groups();
+}
@@ -0,0 +1,116 @@
+/* connect() and resolver recording, see record.h.
+   every event is a single O_APPEND write, so threads don't need to
+   coordinate and a crash loses at most the event being written. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "core.h"
+#include "common.h"
+#include "record.h"
+
+extern unsigned int remote_dns_subnet;
+extern char *string_from_internal_ip(ip_type internalip);
+
+int record_enabled;
+
+static const char *record_prefix;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static int record_fd = -1;
+static pid_t record_pid;
+static uint64_t record_base;
+
+uint64_t record_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void record_init(void) {
+	record_prefix = getenv(PROXYBOUND_RECORD_ENV_VAR);
+	record_enabled = record_prefix && *record_prefix;
+	record_base = record_now_ns();
+}
+
+/* a forked child gets a file of its own */
+static int record_open(void) {
+	record_header hdr;
+	struct timespec ts;
+	struct stat st;
+	char path[512];
+	pid_t pid = getpid();
+	int fd;
+
+	pthread_mutex_lock(&record_lock);
+	if(record_fd == -1 || record_pid != pid) {
+		if(record_fd != -1)
+			close(record_fd);
+		snprintf(path, sizeof(path), "%s.%d.pbr", record_prefix, (int) pid);
+		record_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		record_pid = pid;
+		if(record_fd != -1 && !fstat(record_fd, &st) && !st.st_size) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			hdr.magic = RECORD_MAGIC;
+			hdr.version = RECORD_VERSION;
+			hdr.start_unix_ns = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec - (record_now_ns() - record_base);
+			if(write(record_fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+				PDEBUG("record: can't write %s\n", path);
+		}
+	}
+	fd = record_fd;
+	pthread_mutex_unlock(&record_lock);
+	return fd;
+}
+
+static void record_event_write(int type, uint64_t start, uint32_t ip, uint16_t port, int ret, int err,
+			       const char *name) {
+	char buf[sizeof(record_event) + 255];
+	record_event *ev = (record_event *) buf;
+	uint64_t end = record_now_ns();
+	size_t len = name ? strlen(name) : 0;
+	int fd;
+
+	if((fd = record_open()) == -1)
+		return;
+	memset(ev, 0, sizeof(*ev));
+	ev->type = type;
+	ev->name_len = len > 255 ? 255 : len;
+	ev->port = port;
+	ev->tid = (uint32_t) syscall(SYS_gettid);
+	ev->ts_ns = start - record_base;
+	ev->dur_us = (uint32_t) ((end - start) / 1000);
+	ev->result = ret;
+	ev->err = err;
+	ev->ip = ip;
+	memcpy(buf + sizeof(*ev), name, ev->name_len);
+	if(write(fd, buf, sizeof(*ev) + ev->name_len) != (ssize_t) (sizeof(*ev) + ev->name_len))
+		PDEBUG("record: short write\n");
+}
+
+void record_connect(uint64_t start_ns, const struct sockaddr *addr, int ret) {
+	const struct sockaddr_in *sin = (const struct sockaddr_in *) addr;
+	int err = errno;
+	ip_type ip;
+
+	if(!addr || sin->sin_family != AF_INET)
+		return;
+	ip.as_int = sin->sin_addr.s_addr;
+	record_event_write(RECORD_CONNECT, start_ns, ip.as_int, sin->sin_port, ret, ret ? err : 0,
+			   ip.octet[0] == remote_dns_subnet ? string_from_internal_ip(ip) : NULL);
+	errno = err;
+}
+
+void record_resolve(uint64_t start_ns, const char *name, uint32_t ip, int ret) {
+	int err = errno;
+	if(name)
+		record_event_write(RECORD_RESOLVE, start_ns, ip, 0, ret, 0, name);
+	errno = err;
+}
@@ -0,0 +1,46 @@
+/* binary recording of resolver calls and connect() attempts, no payload.
+   with PROXYBOUND_RECORD set every process appends to
+   <PROXYBOUND_RECORD>.<pid>.pbr: a record_header followed by record_event
+   entries, each directly followed by name_len bytes of host name (not
+   terminated). replay them with tests/bench_replay. */
+
+#ifndef __RECORD_HEADER
+#define __RECORD_HEADER
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define RECORD_MAGIC 0x31524250U  // "PBR1"
+#define RECORD_VERSION 1
+
+enum record_type {
+	RECORD_RESOLVE = 1,  // name: the query, ip: first answer
+	RECORD_CONNECT = 2,  // name: host behind a fake ip, if any
+};
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t start_unix_ns;  // wall clock time of ts_ns 0
+} record_header;
+
+typedef struct {
+	uint8_t type;
+	uint8_t name_len;
+	uint16_t port;    // network order
+	uint32_t tid;
+	uint64_t ts_ns;   // call start, monotonic since start_unix_ns
+	uint32_t dur_us;
+	int32_t result;   // return value of the call
+	int32_t err;      // errno after a failed connect
+	uint32_t ip;      // network order
+} record_event;
+
+extern int record_enabled;
+
+void record_init(void);
+uint64_t record_now_ns(void);
+void record_connect(uint64_t start_ns, const struct sockaddr *addr, int ret);
+void record_resolve(uint64_t start_ns, const char *name, uint32_t ip, int ret);
+
+#endif
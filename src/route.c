@@ -0,0 +1,313 @@
+/* routing rules: which proxy group and chain type a connection uses, or
+   whether it goes direct. rules are compiled once at init:
+   - domain rules (matched against the name behind a fake ip) into a trie
+     of reversed labels, "example.com" covers example.com and *.example.com
+   - cidr rules into a binary trie for longest prefix match
+   - port rules (single ports or ranges) are checked in config order
+   the most specific domain rule wins, then the longest cidr prefix, then
+   the first port rule; connections no rule matches use [ProxyList]. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+#include "core.h"
+#include "common.h"
+
+typedef struct {
+	uint32_t hash;
+	uint32_t child;    // index + 1 of the first child, 0 for none
+	uint32_t sibling;  // index + 1 of the next child of the parent
+	int32_t rule;      // -1 for none
+	uint32_t len;
+	char *label;
+} domain_node;
+
+typedef struct {
+	uint32_t child[2];  // index + 1, 0 for none
+	int32_t rule;
+} cidr_node;
+
+route_rule *proxybound_routes;
+unsigned int proxybound_route_count;
+
+static domain_node *dnodes;
+static unsigned int dnode_count, dnode_capa;
+static cidr_node *cnodes;
+static unsigned int cnode_count, cnode_capa;
+static int *port_rules;
+static unsigned int port_rule_count;
+
+static uint32_t label_hash(const char *p, size_t len) {
+	uint32_t h = 2166136261U;
+	while(len--) {
+		h ^= (unsigned char) tolower((unsigned char) *p++);
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static int dnode_new(void) {
+	if(dnode_count == dnode_capa) {
+		unsigned int capa = dnode_capa ? dnode_capa * 2 : 64;
+		domain_node *n = realloc(dnodes, capa * sizeof(*n));
+		if(!n)
+			return -1;
+		dnodes = n;
+		dnode_capa = capa;
+	}
+	memset(&dnodes[dnode_count], 0, sizeof(*dnodes));
+	dnodes[dnode_count].rule = -1;
+	return dnode_count++;
+}
+
+/* child of node with this label, or -1 */
+static int dnode_child(int node, const char *label, size_t len, uint32_t hash) {
+	uint32_t c;
+	for(c = dnodes[node].child; c; c = dnodes[c - 1].sibling)
+		if(dnodes[c - 1].hash == hash && dnodes[c - 1].len == len && !strncasecmp(dnodes[c - 1].label, label, len))
+			return c - 1;
+	return -1;
+}
+
+static int domain_insert(const char *domain, int rule) {
+	const char *end = domain + strlen(domain), *dot;
+	int node = 0, c;
+
+	while(end > domain && end[-1] == '.')
+		end--;
+	while(*domain == '.')
+		domain++;
+	while(end > domain) {
+		uint32_t hash;
+		size_t len;
+		for(dot = end; dot > domain && dot[-1] != '.'; dot--)
+			;
+		len = end - dot;
+		hash = label_hash(dot, len);
+		if((c = dnode_child(node, dot, len, hash)) == -1) {
+			if((c = dnode_new()) == -1 || !(dnodes[c].label = strndup(dot, len)))
+				return -1;
+			dnodes[c].hash = hash;
+			dnodes[c].len = len;
+			dnodes[c].sibling = dnodes[node].child;
+			dnodes[node].child = c + 1;
+		}
+		node = c;
+		end = dot > domain ? dot - 1 : dot;
+	}
+	if(dnodes[node].rule == -1)
+		dnodes[node].rule = rule;
+	return 0;
+}
+
+static int domain_lookup(const char *name) {
+	const char *end = name + strlen(name), *dot;
+	int node = 0, rule = dnodes[0].rule;
+
+	while(end > name && end[-1] == '.')
+		end--;
+	while(end > name) {
+		for(dot = end; dot > name && dot[-1] != '.'; dot--)
+			;
+		if((node = dnode_child(node, dot, end - dot, label_hash(dot, end - dot))) == -1)
+			break;
+		if(dnodes[node].rule != -1)
+			rule = dnodes[node].rule;
+		end = dot > name ? dot - 1 : dot;
+	}
+	return rule;
+}
+
+static int cnode_new(void) {
+	if(cnode_count == cnode_capa) {
+		unsigned int capa = cnode_capa ? cnode_capa * 2 : 64;
+		cidr_node *n = realloc(cnodes, capa * sizeof(*n));
+		if(!n)
+			return -1;
+		cnodes = n;
+		cnode_capa = capa;
+	}
+	memset(&cnodes[cnode_count], 0, sizeof(*cnodes));
+	cnodes[cnode_count].rule = -1;
+	return cnode_count++;
+}
+
+static int cidr_insert(uint32_t addr, unsigned int prefix_len, int rule) {
+	uint32_t a = ntohl(addr);
+	unsigned int bit;
+	int node = 0, c;
+
+	for(bit = 0; bit < prefix_len; bit++) {
+		int b = (a >> (31 - bit)) & 1;
+		if(!cnodes[node].child[b]) {
+			if((c = cnode_new()) == -1)
+				return -1;
+			cnodes[node].child[b] = c + 1;
+		}
+		node = cnodes[node].child[b] - 1;
+	}
+	if(cnodes[node].rule == -1)
+		cnodes[node].rule = rule;
+	return 0;
+}
+
+static int cidr_lookup(uint32_t addr) {
+	uint32_t a = ntohl(addr), c;
+	unsigned int bit;
+	int node = 0, rule = cnodes[0].rule;
+
+	for(bit = 0; bit < 32 && (c = cnodes[node].child[(a >> (31 - bit)) & 1]); bit++) {
+		node = c - 1;
+		if(cnodes[node].rule != -1)
+			rule = cnodes[node].rule;
+	}
+	return rule;
+}
+
+static int route_add(const route_rule *r) {
+	route_rule *n = realloc(proxybound_routes, (proxybound_route_count + 1) * sizeof(*n));
+	if(!n)
+		return -1;
+	proxybound_routes = n;
+	proxybound_routes[proxybound_route_count++] = *r;
+	return 0;
+}
+
+/* "route KIND MATCH TARGET [CHAIN [LEN]]", the target group is resolved
+   by route_compile() as groups may come later in the file */
+int route_parse(const char *line) {
+	char kind[32], match[256], target[64], chain[32];
+	unsigned int lo, hi, len = 0;
+	char addr[32];
+	route_rule r;
+	int n, m;
+
+	memset(&r, 0, sizeof(r));
+	r.chain_type = -1;
+	n = sscanf(line, "%*s %31s %255s %63s %31s %u", kind, match, target, chain, &len);
+	if(n < 3)
+		return -1;
+	if(!strcmp(kind, "domain")) {
+		r.kind = ROUTE_DOMAIN;
+		snprintf(r.domain, sizeof(r.domain), "%s", match);
+	} else if(!strcmp(kind, "cidr")) {
+		r.kind = ROUTE_CIDR;
+		r.prefix_len = 32;
+		if(sscanf(match, "%31[^/]/%u", addr, &lo) < 1)
+			return -1;
+		if(strchr(match, '/')) {
+			if(lo > 32)
+				return -1;
+			r.prefix_len = lo;
+		}
+		if(inet_pton(AF_INET, addr, &r.addr) != 1)
+			return -1;
+		if(r.prefix_len < 32)
+			r.addr &= htonl(r.prefix_len ? 0xffffffffU << (32 - r.prefix_len) : 0);
+	} else if(!strcmp(kind, "port")) {
+		r.kind = ROUTE_PORT;
+		m = sscanf(match, "%u-%u", &lo, &hi);
+		if(m < 1 || lo > 65535)
+			return -1;
+		if(m < 2)
+			hi = lo;
+		if(hi < lo || hi > 65535)
+			return -1;
+		r.port_lo = lo;
+		r.port_hi = hi;
+	} else
+		return -1;
+	if(strlen(target) >= sizeof(r.group_name))
+		return -1;
+	strcpy(r.group_name, target);
+	if(n >= 4) {
+		if(!strcmp(chain, "strict_chain"))
+			r.chain_type = STRICT_TYPE;
+		else if(!strcmp(chain, "dynamic_chain"))
+			r.chain_type = DYNAMIC_TYPE;
+		else if(!strcmp(chain, "random_chain"))
+			r.chain_type = RANDOM_TYPE;
+		else if(!strcmp(chain, "round_robin_chain"))
+			r.chain_type = ROUND_ROBIN_TYPE;
+		else if(!strcmp(chain, "hash_chain"))
+			r.chain_type = HASH_TYPE;
+		else
+			return -1;
+		r.max_chain = len;
+	}
+	return route_add(&r);
+}
+
+/* resolves the target groups and builds the lookup structures */
+int route_compile(void) {
+	unsigned int i;
+
+	for(i = 1; i < dnode_count; i++)
+		free(dnodes[i].label);
+	dnode_count = cnode_count = port_rule_count = 0;
+	free(port_rules);
+	port_rules = NULL;
+	if(!proxybound_route_count)
+		return 0;
+	if(dnode_new() == -1 || cnode_new() == -1 || !(port_rules = malloc(proxybound_route_count * sizeof(*port_rules))))
+		return -1;
+	for(i = 0; i < proxybound_route_count; i++) {
+		route_rule *r = &proxybound_routes[i];
+		if(!strcmp(r->group_name, "direct"))
+			r->group = ROUTE_DIRECT;
+		else if((r->group = proxy_group_find(r->group_name)) == -1) {
+			fprintf(stderr, "route: unknown proxy group %s\n", r->group_name);
+			return -1;
+		}
+		switch(r->kind) {
+			case ROUTE_DOMAIN:
+				if(domain_insert(r->domain, i))
+					return -1;
+				break;
+			case ROUTE_CIDR:
+				if(cidr_insert(r->addr, r->prefix_len, i))
+					return -1;
+				break;
+			case ROUTE_PORT:
+				port_rules[port_rule_count++] = i;
+				break;
+		}
+	}
+	PDEBUG("route: %u rules, %u domain nodes, %u cidr nodes\n", proxybound_route_count, dnode_count, cnode_count);
+	return 0;
+}
+
+/* replace the rules, used for snapshots */
+int route_adopt(const route_rule *rules, unsigned int count) {
+	route_rule *n = NULL;
+	if(count && !(n = malloc(count * sizeof(*n))))
+		return -1;
+	if(count)
+		memcpy(n, rules, count * sizeof(*n));
+	free(proxybound_routes);
+	proxybound_routes = n;
+	proxybound_route_count = count;
+	return route_compile();
+}
+
+/* name is the host behind a fake ip, NULL for a real address.
+   NULL when no rule matches */
+const route_rule *route_lookup(ip_type ip, unsigned short port, const char *name) {
+	unsigned int i;
+	int rule;
+
+	if(!proxybound_route_count)
+		return NULL;
+	if(name && (rule = domain_lookup(name)) != -1)
+		return &proxybound_routes[rule];
+	if(!name && (rule = cidr_lookup(ip.as_int)) != -1)
+		return &proxybound_routes[rule];
+	for(i = 0; i < port_rule_count; i++) {
+		const route_rule *r = &proxybound_routes[port_rules[i]];
+		if(port >= r->port_lo && port <= r->port_hi)
+			return r;
+	}
+	return NULL;
+}
@@ -0,0 +1,134 @@
+/* kernel enforced leak blocking.
+   installs a seccomp-bpf filter that refuses the creation of non stream inet
+   sockets (udp, raw, packet) and io_uring instances, so the no-leak policy also
+   holds for raw syscall(), statically linked helpers and io_uring users.
+   the filter is inherited by every child and survives execve.
+   the supervisor mode of the launcher uses a second filter that hands every
+   connect() of the child over to the launcher through a notification fd. */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include "core.h"
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <linux/audit.h>
+
+#if defined(__x86_64__)
+# define SECCOMP_AUDIT_ARCH AUDIT_ARCH_X86_64
+#elif defined(__aarch64__)
+# define SECCOMP_AUDIT_ARCH AUDIT_ARCH_AARCH64
+#elif defined(__riscv) && __riscv_xlen == 64
+# define SECCOMP_AUDIT_ARCH AUDIT_ARCH_RISCV64
+#endif
+#endif
+
+#ifndef SOCK_TYPE_MASK
+# define SOCK_TYPE_MASK 0xf
+#endif
+
+#define SC_ARG_LO(n) (offsetof(struct seccomp_data, args[n]))
+#define SC_DENY(e) BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | ((e) & SECCOMP_RET_DATA))
+#define SC_ALLOW BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW)
+
+/* x32 syscalls pass the x86_64 arch check with their own numbers, which
+   would slip past every JEQ on nr. refuse them right after loading nr */
+#ifdef __x86_64__
+# ifndef __X32_SYSCALL_BIT
+#  define __X32_SYSCALL_BIT 0x40000000
+# endif
+# define SC_NO_X32 \
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, __X32_SYSCALL_BIT, 0, 1), \
+	SC_DENY(ENOSYS),
+#else
+# define SC_NO_X32
+#endif
+
+#if defined(SECCOMP_AUDIT_ARCH) && defined(__NR_socket)
+
+int proxybound_install_seccomp(int allow_dns) {
+	/* with PROXYBOUND_ALLOW_DNS udp sockets must be creatable, the port
+	   check for them stays in the sendto/bind hooks since bpf can not
+	   dereference the sockaddr pointer */
+	unsigned int dgram_action = allow_dns ? SECCOMP_RET_ALLOW : SECCOMP_RET_ERRNO | EACCES;
+	struct sock_filter filter[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SECCOMP_AUDIT_ARCH, 1, 0),
+		SC_DENY(EACCES),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+		SC_NO_X32
+#ifdef __NR_io_uring_setup
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_io_uring_setup, 0, 1),
+		SC_DENY(ENOSYS),
+#endif
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_socket, 1, 0),
+		SC_ALLOW,
+		/* socket(domain, type, protocol) */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SC_ARG_LO(0)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AF_PACKET, 0, 1),
+		SC_DENY(EACCES),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AF_INET, 2, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AF_INET6, 1, 0),
+		SC_ALLOW,
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SC_ARG_LO(1)),
+		BPF_STMT(BPF_ALU | BPF_AND | BPF_K, SOCK_TYPE_MASK),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SOCK_STREAM, 0, 1),
+		SC_ALLOW,
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SOCK_DGRAM, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, dgram_action),
+		SC_DENY(EACCES),
+	};
+	struct sock_fprog prog = {
+		.len = (unsigned short) (sizeof(filter) / sizeof(filter[0])),
+		.filter = filter,
+	};
+
+	if(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0))
+		return -1;
+	if(prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog, 0, 0))
+		return -1;
+	PDEBUG("seccomp: leak filter installed (allow_dns=%d)\n", allow_dns);
+	return 0;
+}
+
+int proxybound_install_connect_notifier(void) {
+	struct sock_filter filter[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SECCOMP_AUDIT_ARCH, 1, 0),
+		SC_DENY(EACCES),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+		SC_NO_X32
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_connect, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_USER_NOTIF),
+		SC_ALLOW,
+	};
+	struct sock_fprog prog = {
+		.len = (unsigned short) (sizeof(filter) / sizeof(filter[0])),
+		.filter = filter,
+	};
+
+	if(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0))
+		return -1;
+	return syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, SECCOMP_FILTER_FLAG_NEW_LISTENER, &prog);
+}
+
+#else
+
+int proxybound_install_seccomp(int allow_dns) {
+	(void) allow_dns;
+	errno = ENOSYS;
+	return -1;
+}
+
+int proxybound_install_connect_notifier(void) {
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif
@@ -0,0 +1,426 @@
+/* compiled config snapshot.
+   the first process that parses the config compiles it into a flat,
+   position independent image (proxies with prebuilt handshake credentials,
+   localnet table, timeouts...) stored in a sealed memfd that is inherited by
+   its descendants through PROXYBOUND_SNAPSHOT_FD. a child then only has to
+   validate and mmap it instead of searching and parsing the config file.
+
+   the memfd is created empty by the constructor of the first process of a
+   tree, environ can't be changed safely later on. the first process of the
+   tree that needs the config fills and seals it under a record lock, so a
+   build tree whose root never connects still parses the config once. */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "core.h"
+#include "common.h"
+
+#define SNAPSHOT_MAGIC 0x31534250U  // "PBS1"
+#define SNAPSHOT_VERSION 9
+#define SNAPSHOT_QUIET 1
+#define SNAPSHOT_RESOLVER 2
+#define SNAPSHOT_LIMITS_SHARED 4
+#define SNAPSHOT_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+#define SNAPSHOT_MEMFD_NAME "proxybound-config"
+
+extern int tcp_read_time_out;
+extern int tcp_connect_time_out;
+extern unsigned int remote_dns_subnet;
+extern chain_type proxybound_ct;
+extern unsigned int proxybound_max_chain;
+extern unsigned int proxybound_sticky_ttl;
+extern unsigned int proxybound_chain_retries;
+extern unsigned int proxybound_retry_budget;
+extern unsigned int proxybound_retry_backoff;
+extern unsigned int proxybound_retry_backoff_max;
+extern int proxybound_quiet_mode;
+extern int proxybound_resolver;
+extern localaddr_arg localnet_addr[MAX_LOCALNET];
+extern size_t num_localnet_addr;
+
+struct snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t checksum;  // of everything behind this field
+	char source[512];   // config file and socks5 env the image was built from
+	int32_t chain_type;
+	uint32_t max_chain;
+	int32_t read_timeout;
+	int32_t connect_timeout;
+	uint32_t remote_dns_subnet;
+	uint32_t flags;
+	uint32_t proxy_count;
+	uint32_t localnet_count;
+	uint32_t proxies_off;
+	uint32_t localnet_off;
+	uint32_t auth_off;
+	uint32_t group_count;
+	uint32_t groups_off;
+	uint32_t route_count;
+	uint32_t routes_off;
+	uint32_t sticky_ttl;
+	uint32_t health_interval;
+	uint32_t health_concurrency;
+	uint32_t health_timeout;
+	uint32_t rank_off;  // 0 for an unranked table
+	uint32_t weight_off;
+	uint32_t latency_order;
+	uint32_t max_inflight;
+	uint32_t max_conns;
+	uint32_t queue_timeout;
+	uint32_t chain_retries;
+	uint32_t retry_budget;
+	uint32_t retry_backoff;
+	uint32_t retry_backoff_max;
+	uint32_t timeout_k;
+	uint32_t timeout_floor;
+};
+
+struct snapshot_proxy {
+	uint32_t ip;
+	uint16_t port;
+	uint8_t pt;
+	uint8_t auth_ok;
+	uint32_t auth_off;
+	uint32_t auth_len;
+	uint16_t group;
+	uint16_t connect_ms;
+	uint16_t read_ms;
+	uint16_t pad;
+};
+
+static uint32_t snapshot_checksum(const unsigned char *p, size_t len) {
+	uint32_t h = 2166136261U;
+	while(len--) {
+		h ^= *p++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static void snapshot_source(char *buf, size_t bufsize) {
+	char *conf = getenv(PROXYBOUND_CONF_FILE_ENV_VAR);
+	char *host = getenv(PROXYBOUND_SOCKS5_HOST_ENV_VAR);
+	char *port = getenv(PROXYBOUND_SOCKS5_PORT_ENV_VAR);
+	snprintf(buf, bufsize, "%s|%s|%s", conf ? conf : "", host ? host : "", port ? port : "");
+}
+
+static int snapshot_valid(const unsigned char *img, size_t size) {
+	const struct snapshot_header *h = (const void *) img;
+	const struct snapshot_proxy *sp;
+	char source[sizeof(h->source)];
+	unsigned int i;
+
+	if(size < sizeof(*h) || h->magic != SNAPSHOT_MAGIC || h->version != SNAPSHOT_VERSION || h->size != size)
+		return 0;
+	if(h->checksum != snapshot_checksum(img + 16, size - 16))
+		return 0;
+	if(h->localnet_count > MAX_LOCALNET || !h->group_count || h->group_count > MAX_PROXY_GROUPS ||
+	   h->proxies_off + (uint64_t) h->proxy_count * sizeof(struct snapshot_proxy) > size ||
+	   h->localnet_off + (uint64_t) h->localnet_count * sizeof(localaddr_arg) > size || h->auth_off > size ||
+	   h->groups_off + (uint64_t) h->group_count * sizeof(proxy_group) > size ||
+	   h->routes_off + (uint64_t) h->route_count * sizeof(route_rule) > size ||
+	   h->rank_off + (uint64_t) h->proxy_count * sizeof(uint32_t) > size ||
+	   h->weight_off + (uint64_t) h->proxy_count * sizeof(uint16_t) > size || !h->rank_off != !h->weight_off)
+		return 0;
+	/* the table has to be sorted by group */
+	sp = (const void *) (img + h->proxies_off);
+	for(i = 0; i < h->proxy_count; i++)
+		if(sp[i].group >= h->group_count || (i && sp[i].group < sp[i - 1].group))
+			return 0;
+	/* and a ranking may only reorder proxies within their group */
+	if(h->rank_off) {
+		const uint32_t *rank = (const void *) (img + h->rank_off);
+		for(i = 0; i < h->proxy_count; i++)
+			if(rank[i] >= h->proxy_count || sp[rank[i]].group != sp[i].group)
+				return 0;
+	}
+	snapshot_source(source, sizeof(source));
+	return !strncmp(source, h->source, sizeof(source));
+}
+
+/* point the globals at an image, only called on validated images.
+   the proxy table is copied, the credentials stay in the image */
+static int snapshot_apply(const unsigned char *img) {
+	const struct snapshot_header *h = (const void *) img;
+	const struct snapshot_proxy *sp = (const void *) (img + h->proxies_off);
+	proxy_data *table;
+	unsigned int i;
+
+	if(!(table = malloc((h->proxy_count ? h->proxy_count : 1) * sizeof(*table))))
+		return -1;
+
+	proxybound_ct = (chain_type) h->chain_type;
+	proxybound_max_chain = h->max_chain;
+	proxybound_sticky_ttl = h->sticky_ttl;
+	proxybound_latency_order = h->latency_order;
+	proxy_max_inflight = h->max_inflight;
+	proxy_max_conns = h->max_conns;
+	proxy_queue_timeout = h->queue_timeout;
+	proxybound_chain_retries = h->chain_retries;
+	proxybound_retry_budget = h->retry_budget;
+	proxybound_retry_backoff = h->retry_backoff;
+	proxybound_retry_backoff_max = h->retry_backoff_max;
+	proxy_timeout_k = h->timeout_k;
+	proxy_timeout_floor = h->timeout_floor;
+	proxy_limits_shared = !!(h->flags & SNAPSHOT_LIMITS_SHARED);
+	health_check_interval = h->health_interval;
+	health_check_concurrency = h->health_concurrency;
+	health_check_timeout = h->health_timeout;
+	tcp_read_time_out = h->read_timeout;
+	tcp_connect_time_out = h->connect_timeout;
+	remote_dns_subnet = h->remote_dns_subnet;
+	if(h->flags & SNAPSHOT_QUIET)
+		proxybound_quiet_mode = 1;
+	proxybound_resolver = !!(h->flags & SNAPSHOT_RESOLVER);
+
+	for(i = 0; i < h->proxy_count; i++) {
+		proxy_data *pd = &table[i];
+		memset(pd, 0, sizeof(*pd));
+		pd->ip.as_int = sp[i].ip;
+		pd->port = sp[i].port;
+		pd->pt = sp[i].pt;
+		pd->ps = PLAY_STATE;
+		pd->group = sp[i].group;
+		pd->connect_ms = sp[i].connect_ms;
+		pd->read_ms = sp[i].read_ms;
+		pd->auth_off = PROXY_AUTH_INVALID;
+		if(sp[i].auth_ok && h->auth_off + sp[i].auth_off + (uint64_t) sp[i].auth_len <= h->size) {
+			pd->auth_off = sp[i].auth_off;
+			pd->auth_len = sp[i].auth_len;
+		}
+	}
+	memcpy(proxybound_groups, img + h->groups_off, h->group_count * sizeof(proxy_group));
+	proxybound_group_count = h->group_count;
+	for(i = 0; i < h->group_count; i++)
+		proxybound_groups[i].name[sizeof(proxybound_groups[i].name) - 1] = 0;
+	if(route_adopt((const void *) (img + h->routes_off), h->route_count) ||
+	   proxy_table_adopt(table, h->proxy_count, img + h->auth_off)) {
+		free(table);
+		return -1;
+	}
+	if(h->rank_off)
+		rank_adopt((const void *) (img + h->rank_off), (const void *) (img + h->weight_off));
+	else
+		rank_adopt(NULL, NULL);
+	memcpy(localnet_addr, img + h->localnet_off, h->localnet_count * sizeof(localaddr_arg));
+	num_localnet_addr = h->localnet_count;
+	return 0;
+}
+
+/* returns 0 when the config could be taken from an inherited snapshot */
+#if defined(__linux__) && defined(F_GET_SEALS) && defined(MFD_ALLOW_SEALING)
+
+static int fill_fd = -1;  // the empty memfd we hold the lock of, see snapshot_load()
+
+static int snapshot_lock(int fd, short type) {
+	struct flock fl;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_len = 1;
+	while(fcntl(fd, F_SETLKW, &fl) == -1)
+		if(errno != EINTR)
+			return -1;
+	return 0;
+}
+
+/* the number may have been reused for something else than our memfd */
+static int snapshot_memfd(int fd) {
+	char path[64], target[64];
+	ssize_t n;
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	if(fcntl(fd, F_GET_SEALS) == -1 || (n = readlink(path, target, sizeof(target) - 1)) <= 0)
+		return 0;
+	target[n] = 0;
+	return !strncmp(target, "/memfd:" SNAPSHOT_MEMFD_NAME " ", sizeof("/memfd:" SNAPSHOT_MEMFD_NAME));
+}
+
+/* from the constructor: keep an inherited memfd we can use, else start one
+   for our descendants. without an explicit config file a child could
+   resolve another one, then there's nothing to share */
+void snapshot_reserve(void) {
+	const struct snapshot_header *h = NULL;
+	char *env = getenv(PROXYBOUND_SNAPSHOT_FD_ENV_VAR), source[sizeof(h->source)], buf[16];
+	char theirs[sizeof(h->source)];
+	int fd;
+
+	if(!getenv(PROXYBOUND_CONF_FILE_ENV_VAR) && !getenv(PROXYBOUND_SOCKS5_PORT_ENV_VAR))
+		return;
+	if(env && snapshot_memfd(fd = atoi(env))) {
+		if(!(fcntl(fd, F_GET_SEALS) & F_SEAL_WRITE))
+			return;  // not filled yet, the source is checked on load
+		snapshot_source(source, sizeof(source));
+		if(pread(fd, theirs, sizeof(theirs), offsetof(struct snapshot_header, source)) == (ssize_t) sizeof(theirs) &&
+		   !strncmp(source, theirs, sizeof(source)))
+			return;
+	}
+	if((fd = memfd_create(SNAPSHOT_MEMFD_NAME, MFD_ALLOW_SEALING)) == -1)
+		return;
+	snprintf(buf, sizeof(buf), "%d", fd);
+	setenv(PROXYBOUND_SNAPSHOT_FD_ENV_VAR, buf, 1);
+}
+
+/* -1 when the config has to be parsed. if the memfd is still empty we keep
+   its lock until snapshot_publish() filled it */
+int snapshot_load(void) {
+	char *env = getenv(PROXYBOUND_SNAPSHOT_FD_ENV_VAR);
+	struct stat st;
+	void *img;
+	int fd, seals;
+
+	if(!env || !snapshot_memfd(fd = atoi(env)))
+		return -1;
+	if(!((seals = fcntl(fd, F_GET_SEALS)) & F_SEAL_WRITE)) {
+		if(snapshot_lock(fd, F_WRLCK))
+			return -1;
+		/* someone else may have filled it meanwhile */
+		if(!((seals = fcntl(fd, F_GET_SEALS)) & F_SEAL_WRITE)) {
+			fill_fd = fd;
+			return -1;
+		}
+		snapshot_lock(fd, F_UNLCK);
+	}
+	if((seals & SNAPSHOT_SEALS) != SNAPSHOT_SEALS || fstat(fd, &st) || st.st_size <= 0)
+		return -1;
+	img = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(img == MAP_FAILED)
+		return -1;
+	if(!snapshot_valid(img, st.st_size) || snapshot_apply(img)) {
+		munmap(img, st.st_size);
+		return -1;
+	}
+	PDEBUG("snapshot: loaded %u proxies from fd %d\n", proxybound_proxy_count, fd);
+	return 0;
+}
+
+#else
+
+void snapshot_reserve(void) {
+}
+
+int snapshot_load(void) {
+	return -1;
+}
+
+#endif
+
+static unsigned char *snapshot_compile(size_t *size) {
+	size_t auth_total = proxy_table_pool_size();
+	struct snapshot_header *h;
+	struct snapshot_proxy *sp;
+	unsigned char *img;
+	unsigned int i;
+
+	*size = sizeof(*h) + proxybound_proxy_count * sizeof(*sp) + num_localnet_addr * sizeof(localaddr_arg) +
+		proxybound_group_count * sizeof(proxy_group) + proxybound_route_count * sizeof(route_rule) + auth_total;
+	if(proxybound_rank)
+		*size += proxybound_proxy_count * (sizeof(uint32_t) + sizeof(uint16_t));
+	if(!(img = calloc(1, *size)))
+		return NULL;
+
+	h = (void *) img;
+	h->magic = SNAPSHOT_MAGIC;
+	h->version = SNAPSHOT_VERSION;
+	h->size = *size;
+	snapshot_source(h->source, sizeof(h->source));
+	h->chain_type = proxybound_ct;
+	h->max_chain = proxybound_max_chain;
+	h->sticky_ttl = proxybound_sticky_ttl;
+	h->latency_order = proxybound_latency_order;
+	h->max_inflight = proxy_max_inflight;
+	h->max_conns = proxy_max_conns;
+	h->queue_timeout = proxy_queue_timeout;
+	h->chain_retries = proxybound_chain_retries;
+	h->retry_budget = proxybound_retry_budget;
+	h->retry_backoff = proxybound_retry_backoff;
+	h->retry_backoff_max = proxybound_retry_backoff_max;
+	h->timeout_k = proxy_timeout_k;
+	h->timeout_floor = proxy_timeout_floor;
+	h->health_interval = health_check_interval;
+	h->health_concurrency = health_check_concurrency;
+	h->health_timeout = health_check_timeout;
+	h->read_timeout = tcp_read_time_out;
+	h->connect_timeout = tcp_connect_time_out;
+	h->remote_dns_subnet = remote_dns_subnet;
+	h->flags = (proxybound_quiet_mode ? SNAPSHOT_QUIET : 0) | (proxybound_resolver ? SNAPSHOT_RESOLVER : 0) |
+		   (proxy_limits_shared ? SNAPSHOT_LIMITS_SHARED : 0);
+	h->proxy_count = proxybound_proxy_count;
+	h->localnet_count = num_localnet_addr;
+	h->proxies_off = sizeof(*h);
+	h->localnet_off = h->proxies_off + proxybound_proxy_count * sizeof(*sp);
+	h->group_count = proxybound_group_count;
+	h->groups_off = h->localnet_off + num_localnet_addr * sizeof(localaddr_arg);
+	h->route_count = proxybound_route_count;
+	h->routes_off = h->groups_off + proxybound_group_count * sizeof(proxy_group);
+	h->auth_off = h->routes_off + proxybound_route_count * sizeof(route_rule);
+	if(proxybound_rank) {
+		/* the rank array has to stay aligned, it goes right after the routes */
+		h->rank_off = h->auth_off;
+		h->weight_off = h->rank_off + proxybound_proxy_count * sizeof(uint32_t);
+		h->auth_off = h->weight_off + proxybound_proxy_count * sizeof(uint16_t);
+		memcpy(img + h->rank_off, proxybound_rank, proxybound_proxy_count * sizeof(uint32_t));
+		memcpy(img + h->weight_off, proxybound_weight, proxybound_proxy_count * sizeof(uint16_t));
+	}
+
+	sp = (void *) (img + h->proxies_off);
+	for(i = 0; i < proxybound_proxy_count; i++) {
+		proxy_data *pd = &proxybound_pd[i];
+		sp[i].ip = pd->ip.as_int;
+		sp[i].port = pd->port;
+		sp[i].pt = pd->pt;
+		sp[i].auth_ok = pd->auth_off != PROXY_AUTH_INVALID;
+		sp[i].auth_off = sp[i].auth_ok ? pd->auth_off : 0;
+		sp[i].auth_len = sp[i].auth_ok ? pd->auth_len : 0;
+		sp[i].group = pd->group;
+		sp[i].connect_ms = pd->connect_ms;
+		sp[i].read_ms = pd->read_ms;
+	}
+	memcpy(img + h->groups_off, proxybound_groups, proxybound_group_count * sizeof(proxy_group));
+	if(proxybound_route_count)
+		memcpy(img + h->routes_off, proxybound_routes, proxybound_route_count * sizeof(route_rule));
+	memcpy(img + h->auth_off, proxybound_auth_pool, auth_total);
+	memcpy(img + h->localnet_off, localnet_addr, num_localnet_addr * sizeof(localaddr_arg));
+	h->checksum = snapshot_checksum(img + 16, *size - 16);
+	return img;
+}
+
+/* compile the parsed config, share it with the descendants and use it ourselves */
+void snapshot_publish(void) {
+	unsigned char *img;
+	size_t size;
+
+	if(!(img = snapshot_compile(&size))) {
+		proxybound_log(PB_LOG_ERROR, LOG_PREFIX "ERROR: OUT OF MEMORY!\n\n\n");
+		goto out;
+	}
+#if defined(__linux__) && defined(F_GET_SEALS) && defined(MFD_ALLOW_SEALING)
+	if(fill_fd != -1) {
+		void *map;
+		if(!ftruncate(fill_fd, size) && pwrite(fill_fd, img, size, 0) == (ssize_t) size &&
+		   !fcntl(fill_fd, F_ADD_SEALS, SNAPSHOT_SEALS | F_SEAL_SEAL) &&
+		   (map = mmap(NULL, size, PROT_READ, MAP_SHARED, fill_fd, 0)) != MAP_FAILED) {
+			free(img);
+			snapshot_apply(map);
+			goto out;
+		}
+	}
+#endif
+	if(snapshot_apply(img))
+		free(img);
+	out:
+#if defined(__linux__) && defined(F_GET_SEALS) && defined(MFD_ALLOW_SEALING)
+	if(fill_fd != -1)
+		snapshot_lock(fill_fd, F_UNLCK);
+	fill_fd = -1;
+#endif
+	return;
+}
@@ -0,0 +1,268 @@
+/* `proxybound stats`: reads the shared memory metrics segment of the dll
+   for a config, -f like the launcher or the one the launcher would use.
+   default is a live view refreshed every second, -1 prints once, --json
+   prints one json document per refresh (or once with -1). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "metrics.h"
+
+static const char *chain_names[METRICS_CHAIN_TYPES] = { "dynamic", "strict", "random", "round_robin", "hash" };
+static const char *lock_names[METRICS_LOCKS] = { "internal_ips", "hostdb", "proxy_state" };
+static const char *proxy_names[] = { "http", "socks4", "socks5" };
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+	(void) sig;
+	stop = 1;
+}
+
+/* copy the counters, the writers keep going while we read */
+static void snapshot(const metrics_segment *seg, metrics_segment *out) {
+	const uint64_t *src = (const uint64_t *) seg;
+	uint64_t *dst = (uint64_t *) out;
+	size_t i;
+	for(i = 0; i < metrics_size(seg->h.nproxies) / sizeof(uint64_t); i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+/* upper bound of the bucket holding the q-quantile, in milliseconds */
+static double hist_quantile(const metrics_hist *h, double q) {
+	uint64_t want, seen = 0;
+	int i;
+	if(!h->count)
+		return 0;
+	want = (uint64_t) (h->count * q);
+	if(want < 1)
+		want = 1;
+	for(i = 0; i < METRICS_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if(seen >= want)
+			return (double) (1ULL << i) / 1000.0;
+	}
+	return (double) (1ULL << (METRICS_BUCKETS - 1)) / 1000.0;
+}
+
+static double hist_mean(const metrics_hist *h) {
+	return h->count ? (double) h->sum_us / h->count / 1000.0 : 0;
+}
+
+static const char *proxy_name(uint64_t key, char *buf, size_t bufsize) {
+	struct in_addr in;
+	char ip[16];
+	in.s_addr = metrics_key_ip(key);
+	inet_ntop(AF_INET, &in, ip, sizeof(ip));
+	snprintf(buf, bufsize, "%s:%u", ip, (unsigned) ntohs(metrics_key_port(key)));
+	return buf;
+}
+
+static const char *type_name(uint64_t key) {
+	int t = metrics_key_type(key);
+	return t >= 0 && t < 3 ? proxy_names[t] : "?";
+}
+
+/* the health table of the segment's proxy list, NULL without one */
+static const metrics_health_table *health;
+
+/* the last verdict of a health checker, "-" when none ran */
+static const char *health_name(int i) {
+	if(!health || !__atomic_load_n(&health->proxy[i].checked_us, __ATOMIC_ACQUIRE))
+		return "-";
+	return __atomic_load_n(&health->proxy[i].down, __ATOMIC_RELAXED) ? "down" : "up";
+}
+
+/* the key of a proxy that connected or was checked, 0 for neither */
+static uint64_t proxy_key(const metrics_segment *s, int i) {
+	if(s->proxy[i].key)
+		return s->proxy[i].key;
+	return health ? __atomic_load_n(&health->proxy[i].key, __ATOMIC_RELAXED) : 0;
+}
+
+static const metrics_health_table *health_map(const char *source, const metrics_segment *seg) {
+	const metrics_health_table *ht;
+	char name[64];
+	struct stat st;
+	int fd;
+
+	metrics_shm_name(name, sizeof(name), source, "health");
+	if((fd = shm_open(name, O_RDONLY, 0)) == -1)
+		return NULL;
+	if(fstat(fd, &st) || (size_t) st.st_size != metrics_health_size(seg->h.nproxies) ||
+	   (ht = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		ht = NULL;
+	close(fd);
+	if(ht && (ht->h.magic != METRICS_HEALTH_MAGIC || ht->h.version != METRICS_VERSION ||
+		  ht->h.list_id != seg->h.list_id)) {
+		munmap((void *) ht, st.st_size);
+		ht = NULL;
+	}
+	return ht;
+}
+
+static void print_hist_json(const char *name, const metrics_hist *h) {
+	int i, last = -1;
+	printf("\"%s\":{\"count\":%llu,\"sum_us\":%llu,\"buckets_log2_us\":[", name,
+	       (unsigned long long) h->count, (unsigned long long) h->sum_us);
+	for(i = 0; i < METRICS_BUCKETS; i++)
+		if(h->bucket[i])
+			last = i;
+	for(i = 0; i <= last; i++)
+		printf("%s%llu", i ? "," : "", (unsigned long long) h->bucket[i]);
+	printf("]}");
+}
+
+static void print_json(const metrics_segment *s) {
+	char name[64];
+	int i, first = 1;
+
+	printf("{\"config\":\"%s\",\"proxies_dropped\":%llu,\"chains\":{", s->source, (unsigned long long) s->dropped);
+	for(i = 0; i < METRICS_CHAIN_TYPES; i++) {
+		const metrics_chain *c = &s->chain[i];
+		printf("%s\"%s\":{\"attempts\":%llu,\"success\":%llu,\"fail\":%llu,\"retries\":%llu,", i ? "," : "",
+		       chain_names[i], (unsigned long long) c->attempts, (unsigned long long) c->success,
+		       (unsigned long long) c->fail, (unsigned long long) c->retries);
+		print_hist_json("total_time", &c->total_time);
+		printf("}");
+	}
+	printf("},\"locks\":{");
+	for(i = 0; i < METRICS_LOCKS; i++)
+		printf("%s\"%s\":{\"acquired\":%llu,\"contended\":%llu,\"wait_us\":%llu}", i ? "," : "", lock_names[i],
+		       (unsigned long long) s->lock[i].acquired, (unsigned long long) s->lock[i].contended,
+		       (unsigned long long) s->lock[i].wait_us);
+	printf("},\"proxies\":[");
+	for(i = 0; i < (int) s->h.nproxies; i++) {
+		const metrics_proxy *p = &s->proxy[i];
+		uint64_t key = proxy_key(s, i);
+		if(!key)
+			continue;
+		printf("%s{\"proxy\":\"%s\",\"type\":\"%s\",\"connects\":%llu,\"connect_fail\":%llu,"
+		       "\"handshakes\":%llu,\"blocked\":%llu,\"socket_error\":%llu,\"health\":\"%s\",", first ? "" : ",",
+		       proxy_name(key, name, sizeof(name)), type_name(key),
+		       (unsigned long long) p->connects, (unsigned long long) p->connect_fail,
+		       (unsigned long long) p->handshakes, (unsigned long long) p->blocked,
+		       (unsigned long long) p->socket_error, health_name(i));
+		print_hist_json("connect_time", &p->connect_time);
+		printf(",");
+		print_hist_json("handshake_time", &p->handshake_time);
+		printf("}");
+		first = 0;
+	}
+	printf("]}\n");
+	fflush(stdout);
+}
+
+static void print_table(const metrics_segment *s, const metrics_segment *prev, int live) {
+	char name[64];
+	int i;
+
+	if(live)
+		printf("\033[H\033[2J");
+	printf("CONFIG %s, %u proxies", s->source, s->h.nproxies);
+	if(s->dropped)
+		printf(", %llu samples of proxies outside the list dropped", (unsigned long long) s->dropped);
+	printf("\n\n");
+	printf("%-11s %10s %10s %10s %8s %8s %10s %10s\n", "CHAIN", "ATTEMPTS", "OK", "FAIL", "RETRY", "OK/s",
+	       "MEAN ms", "P99 ms");
+	for(i = 0; i < METRICS_CHAIN_TYPES; i++) {
+		const metrics_chain *c = &s->chain[i];
+		if(!c->attempts)
+			continue;
+		printf("%-11s %10llu %10llu %10llu %8llu %8llu %10.2f %10.2f\n", chain_names[i],
+		       (unsigned long long) c->attempts, (unsigned long long) c->success,
+		       (unsigned long long) c->fail, (unsigned long long) c->retries,
+		       (unsigned long long) (c->success - prev->chain[i].success),
+		       hist_mean(&c->total_time), hist_quantile(&c->total_time, 0.99));
+	}
+	printf("\n%-14s %12s %12s %12s\n", "LOCK", "ACQUIRED", "CONTENDED", "WAIT ms");
+	for(i = 0; i < METRICS_LOCKS && !s->lock[i].acquired; i++)
+		;
+	if(i == METRICS_LOCKS)
+		printf("(not recorded, run with PROXYBOUND_LOCK_STATS=1)\n");
+	else for(i = 0; i < METRICS_LOCKS; i++)
+		printf("%-14s %12llu %12llu %12.2f\n", lock_names[i], (unsigned long long) s->lock[i].acquired,
+		       (unsigned long long) s->lock[i].contended, s->lock[i].wait_us / 1000.0);
+	printf("\n%-22s %-6s %-6s %9s %7s %6s %9s %7s %6s %9s %9s %9s %9s\n", "PROXY", "TYPE", "HEALTH", "CONNECTS",
+	       "CONN/s", "FAIL", "HANDSHAKE", "BLOCKED", "ERROR", "CONN p50", "CONN p99", "HS p50", "HS p99");
+	for(i = 0; i < (int) s->h.nproxies; i++) {
+		const metrics_proxy *p = &s->proxy[i];
+		uint64_t key = proxy_key(s, i);
+		if(!key)
+			continue;
+		printf("%-22s %-6s %-6s %9llu %7llu %6llu %9llu %7llu %6llu %9.2f %9.2f %9.2f %9.2f\n",
+		       proxy_name(key, name, sizeof(name)), type_name(key), health_name(i),
+		       (unsigned long long) p->connects,
+		       (unsigned long long) (p->connects - prev->proxy[i].connects),
+		       (unsigned long long) p->connect_fail, (unsigned long long) p->handshakes,
+		       (unsigned long long) p->blocked, (unsigned long long) p->socket_error,
+		       hist_quantile(&p->connect_time, 0.5), hist_quantile(&p->connect_time, 0.99),
+		       hist_quantile(&p->handshake_time, 0.5), hist_quantile(&p->handshake_time, 0.99));
+	}
+	fflush(stdout);
+}
+
+int stats_run(int argc, char **argv) {
+	metrics_segment *cur, *prev;
+	const metrics_segment *seg;
+	char name[64], source[METRICS_SOURCE], *conf = NULL;
+	struct stat st;
+	int i, fd, once = 0, json = 0;
+
+	for(i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "-1"))
+			once = 1;
+		else if(!strcmp(argv[i], "--json"))
+			json = 1;
+		else if(!strcmp(argv[i], "-f") && i + 1 < argc)
+			conf = argv[++i];
+		else {
+			fprintf(stderr, "usage: proxybound stats [-f config] [-1] [--json]\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	metrics_source(conf, source, sizeof(source));
+	metrics_shm_name(name, sizeof(name), source, "metrics");
+	fd = shm_open(name, O_RDONLY, 0);
+	if(fd == -1 || fstat(fd, &st) || (size_t) st.st_size < sizeof(metrics_segment)) {
+		fprintf(stderr, LOG_PREFIX "no metrics yet for %s (no proxied connect since boot, or PROXYBOUND_METRICS=0)\n",
+			source);
+		return EXIT_FAILURE;
+	}
+	seg = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(seg == MAP_FAILED || seg->h.magic != METRICS_MAGIC || seg->h.version != METRICS_VERSION ||
+	   metrics_size(seg->h.nproxies) != (size_t) st.st_size) {
+		fprintf(stderr, LOG_PREFIX "metrics segment %s has an unknown format\n", name);
+		return EXIT_FAILURE;
+	}
+	health = health_map(source, seg);
+	if(!(cur = malloc(st.st_size)) || !(prev = malloc(st.st_size)))
+		return EXIT_FAILURE;
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	snapshot(seg, prev);
+	for(;;) {
+		snapshot(seg, cur);
+		if(json)
+			print_json(cur);
+		else
+			print_table(cur, prev, !once);
+		if(once)
+			break;
+		memcpy(prev, cur, st.st_size);
+		sleep(1);
+		if(stop)
+			break;
+	}
+	return 0;
+}
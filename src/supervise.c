@@ -0,0 +1,388 @@
+/* supervisor mode of the launcher.
+   the child runs without LD_PRELOAD under a seccomp filter that turns every
+   connect() into a user notification. the launcher loads the dll itself,
+   lets its connect() hook build the proxy chain on a socket of its own and
+   injects that socket in place of the child's descriptor with
+   SECCOMP_IOCTL_NOTIF_ADDFD. this also covers static binaries (go tools...)
+   that ignore LD_PRELOAD. unix sockets are connected the same way, to our
+   copy of the address. the leak filter of PROXYBOUND_SECCOMP keeps udp and
+   raw sockets from being created at all. */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <sys/types.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include "core.h"
+#include "common.h"
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/seccomp.h>
+
+#ifdef RTLD_DEEPBIND
+# define SUPERVISE_DLOPEN_FLAGS RTLD_DEEPBIND
+#else
+# define SUPERVISE_DLOPEN_FLAGS 0
+#endif
+
+#ifndef PIDFD_THREAD
+# define PIDFD_THREAD O_EXCL
+#endif
+
+static connect_t chain_connect;
+static int notify_fd = -1;
+static int allow_leak;  // PROXYBOUND_ALLOW_LEAKS
+
+struct notif_job {
+	uint64_t id;
+	pid_t pid;
+	int fd;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+};
+
+static int send_fd(int sock, int fd) {
+	char c = 0;
+	struct iovec iov = { &c, 1 };
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} u;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = sizeof(u.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+static int recv_fd(int sock) {
+	char c;
+	int fd = -1;
+	struct iovec iov = { &c, 1 };
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} u;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = sizeof(u.buf);
+	if(recvmsg(sock, &msg, 0) != 1)
+		return -1;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if(!cmsg || cmsg->cmsg_type != SCM_RIGHTS)
+		return -1;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+/* notif.pid is a thread id, pidfd_getfd() wants a pidfd of its process */
+static int open_pidfd(pid_t tid) {
+	char path[64], line[128];
+	FILE *f;
+	pid_t tgid = 0;
+	int pfd;
+
+	if((pfd = syscall(SYS_pidfd_open, tid, PIDFD_THREAD)) != -1)
+		return pfd;
+	if((pfd = syscall(SYS_pidfd_open, tid, 0)) != -1)
+		return pfd;
+	snprintf(path, sizeof(path), "/proc/%d/status", (int) tid);
+	if(!(f = fopen(path, "r")))
+		return -1;
+	while(fgets(line, sizeof(line), f))
+		if(sscanf(line, "Tgid: %d", &tgid) == 1)
+			break;
+	fclose(f);
+	return tgid ? syscall(SYS_pidfd_open, tgid, 0) : -1;
+}
+
+static void respond(uint64_t id, int error) {
+	struct seccomp_notif_resp resp;
+	memset(&resp, 0, sizeof(resp));
+	resp.id = id;
+	resp.error = error ? -error : 0;
+	if(ioctl(notify_fd, SECCOMP_IOCTL_NOTIF_SEND, &resp) == -1)
+		PDEBUG("supervise: NOTIF_SEND failed: %s\n", strerror(errno));
+}
+
+/* a relative unix socket path is meant from the cwd of the child */
+static int unix_path(struct notif_job *job) {
+	struct sockaddr_un *sun = (struct sockaddr_un *) &job->addr;
+	size_t off = offsetof(struct sockaddr_un, sun_path), len;
+	char path[sizeof(sun->sun_path)];
+	int n;
+
+	if(job->addrlen <= off || !sun->sun_path[0] || sun->sun_path[0] == '/')
+		return 0;  // unnamed, abstract or absolute
+	len = strnlen(sun->sun_path, job->addrlen - off);
+	n = snprintf(path, sizeof(path), "/proc/%d/cwd/%.*s", (int) job->pid, (int) len, sun->sun_path);
+	if(n < 0 || (size_t) n >= sizeof(path))
+		return -1;
+	memcpy(sun->sun_path, path, n + 1);
+	job->addrlen = off + n + 1;
+	return 0;
+}
+
+/* runs in its own thread, chains can take seconds. the child only ever
+   gets an answer or a socket we connected with our copy of the address,
+   never a go ahead: it could change the address after we read it */
+static void *handle_connect(void *arg) {
+	struct notif_job *job = arg;
+	struct seccomp_notif_addfd addfd;
+	int pidfd, cfd, sock = -1;
+	int domain = 0, type = 0, flags = 0, err = 0;
+	socklen_t optlen;
+
+	if((pidfd = open_pidfd(job->pid)) == -1) {
+		err = EACCES;
+		goto out;
+	}
+	cfd = syscall(SYS_pidfd_getfd, pidfd, job->fd, 0);
+	close(pidfd);
+	if(cfd == -1) {
+		err = errno == EBADF ? EBADF : EACCES;
+		goto out;
+	}
+	optlen = sizeof(type);
+	if(getsockopt(cfd, SOL_SOCKET, SO_TYPE, &type, &optlen))
+		err = ENOTSOCK;
+	optlen = sizeof(domain);
+	getsockopt(cfd, SOL_SOCKET, SO_DOMAIN, &domain, &optlen);
+	flags = fcntl(cfd, F_GETFL);
+
+	if(err)
+		;
+	else if(domain == AF_UNIX) {
+		if(job->addr.ss_family != AF_UNIX)
+			err = EAFNOSUPPORT;
+		else if(unix_path(job))
+			err = ENAMETOOLONG;
+		else if((sock = socket(AF_UNIX, type, 0)) == -1)
+			err = errno;
+		else if(connect(sock, (struct sockaddr *) &job->addr, job->addrlen) == -1)
+			err = errno;
+	} else if((domain == AF_INET || domain == AF_INET6) && type == SOCK_STREAM) {
+		if((sock = socket(domain, type, 0)) == -1)
+			err = errno;
+		else if(chain_connect(sock, (struct sockaddr *) &job->addr, job->addrlen) == -1)
+			err = errno ? errno : ECONNREFUSED;
+	} else if((domain == AF_INET || domain == AF_INET6) && allow_leak) {
+		/* non stream sockets only exist with PROXYBOUND_ALLOW_LEAKS */
+		if(connect(cfd, (struct sockaddr *) &job->addr, job->addrlen) == -1)
+			err = errno;
+	} else
+		err = EACCES;
+	close(cfd);
+
+	if(!err && sock != -1) {
+		if(flags != -1)
+			fcntl(sock, F_SETFL, flags);
+		memset(&addfd, 0, sizeof(addfd));
+		addfd.id = job->id;
+		addfd.flags = SECCOMP_ADDFD_FLAG_SETFD;
+		addfd.srcfd = sock;
+		addfd.newfd = job->fd;
+		if(ioctl(notify_fd, SECCOMP_IOCTL_NOTIF_ADDFD, &addfd) == -1)
+			err = errno == ENOENT ? EINTR : errno;
+	}
+	out:
+	if(sock != -1)
+		close(sock);
+	respond(job->id, err);
+	free(job);
+	return NULL;
+}
+
+static void supervise_loop(void) {
+	struct seccomp_notif notif;
+	struct notif_job *job;
+	struct pollfd pfd;
+	struct iovec local, remote;
+	pthread_attr_t attr;
+	pthread_t tid;
+	ssize_t n;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pfd.fd = notify_fd;
+	pfd.events = POLLIN;
+
+	for(;;) {
+		pfd.revents = 0;
+		if(poll(&pfd, 1, -1) == -1) {
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		/* every task using the filter is gone */
+		if(pfd.revents & (POLLHUP | POLLERR | POLLNVAL))
+			break;
+
+		memset(&notif, 0, sizeof(notif));
+		if(ioctl(notify_fd, SECCOMP_IOCTL_NOTIF_RECV, &notif) == -1) {
+			if(errno == EINTR || errno == ENOENT)
+				continue;
+			break;
+		}
+		if(!(job = calloc(1, sizeof(*job)))) {
+			respond(notif.id, ENOMEM);
+			continue;
+		}
+		job->id = notif.id;
+		job->pid = notif.pid;
+		job->fd = (int) notif.data.args[0];
+		job->addrlen = (socklen_t) notif.data.args[2];
+		if(job->addrlen > sizeof(job->addr))
+			job->addrlen = sizeof(job->addr);
+
+		local.iov_base = &job->addr;
+		local.iov_len = job->addrlen;
+		remote.iov_base = (void *) (uintptr_t) notif.data.args[1];
+		remote.iov_len = job->addrlen;
+		n = process_vm_readv(notif.pid, &local, 1, &remote, 1, 0);
+
+		/* the target may have died or been replaced while we read its memory */
+		if(ioctl(notify_fd, SECCOMP_IOCTL_NOTIF_ID_VALID, &notif.id) == -1) {
+			free(job);
+			continue;
+		}
+		if(n != (ssize_t) job->addrlen || n < (ssize_t) sizeof(sa_family_t)) {
+			respond(notif.id, n == -1 || n < (ssize_t) sizeof(sa_family_t) ? EFAULT : EINVAL);
+			free(job);
+			continue;
+		}
+		if(pthread_create(&tid, &attr, handle_connect, job)) {
+			respond(notif.id, EAGAIN);
+			free(job);
+		}
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/* load the dll into the launcher and return one of its symbols */
+void *load_dll_sym(const char *dll_path, const char *name) {
+	void *handle, *sym;
+
+	/* deepbind makes the dll's references to connect() etc. resolve to its own
+	   hooks, like they do when preloaded, so load_sym() sees libc behind them */
+	if(!(handle = dlopen(dll_path, RTLD_NOW | RTLD_LOCAL | SUPERVISE_DLOPEN_FLAGS))) {
+		fprintf(stderr, LOG_PREFIX "can't load %s: %s\n", dll_path, dlerror());
+		return NULL;
+	}
+	if(!(sym = dlsym(handle, name)))
+		fprintf(stderr, LOG_PREFIX "%s missing in %s\n", name, dll_path);
+	return sym;
+}
+
+/* the dll's connect() hook, which builds the proxy chain from the dll's own
+   config */
+connect_t load_dll_connect(const char *dll_path) {
+	return (connect_t) load_dll_sym(dll_path, "connect");
+}
+
+int supervise_run(const char *dll_path, char **argv) {
+	int sv[2], status = 0;
+	char *env;
+	pid_t child;
+
+	if(!(chain_connect = load_dll_connect(dll_path)))
+		return EXIT_FAILURE;
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+		perror("socketpair");
+		return EXIT_FAILURE;
+	}
+
+	env = getenv(PROXYBOUND_ALLOW_LEAKS_ENV_VAR);
+	allow_leak = env && *env == '1';
+	child = fork();
+	if(child == -1) {
+		perror("fork");
+		return EXIT_FAILURE;
+	}
+	if(child == 0) {
+		int lfd;
+		close(sv[0]);
+		/* without the hooks nobody checks where udp goes, refuse the
+		   sockets: only connect() is handed to us */
+		if(!allow_leak && proxybound_install_seccomp(0)) {
+			perror(LOG_PREFIX "supervise: can't install seccomp filter");
+			_exit(127);
+		}
+		lfd = proxybound_install_connect_notifier();
+		if(lfd == -1) {
+			perror(LOG_PREFIX "supervise: can't install seccomp notifier");
+			_exit(127);
+		}
+		if(send_fd(sv[1], lfd))
+			_exit(127);
+		close(lfd);
+		close(sv[1]);
+		execvp(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+
+	close(sv[1]);
+	notify_fd = recv_fd(sv[0]);
+	close(sv[0]);
+	if(notify_fd == -1) {
+		waitpid(child, &status, 0);
+		return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+	}
+
+	supervise_loop();
+	close(notify_fd);
+
+	if(waitpid(child, &status, 0) == -1)
+		return EXIT_FAILURE;
+	if(WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
+
+#else
+
+void *load_dll_sym(const char *dll_path, const char *name) {
+	(void) dll_path; (void) name;
+	return NULL;
+}
+
+connect_t load_dll_connect(const char *dll_path) {
+	(void) dll_path;
+	return NULL;
+}
+
+int supervise_run(const char *dll_path, char **argv) {
+	(void) dll_path; (void) argv;
+	fprintf(stderr, LOG_PREFIX "supervise mode requires linux\n");
+	return EXIT_FAILURE;
+}
+
+#endif
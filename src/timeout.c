@@ -0,0 +1,162 @@
+/* per proxy timeouts. a [ProxyList] line can set connect_timeout= and
+   read_timeout= for its proxy, in ms. with adaptive_timeouts K in the
+   config every other proxy gets K times the p95 of its last 32 to
+   TIMEOUT_WINDOW tcp connect, greeting and hop handshake times, at least
+   adaptive_timeout_floor and at most tcp_connect_time_out or
+   tcp_read_time_out, once it has TIMEOUT_MIN_SAMPLES of a kind. that
+   few samples resolve a p95 by skipping the slowest 5%: 3 of 64, 1 of 32,
+   none of 16 to 19, where it is the slowest. a single outlier doesn't
+   move it once the window holds 20.
+   a timeout counts as a sample of its length, so a proxy that got slower
+   widens its timeouts again instead of failing at the old ones.
+   the reply to the request for the target is none of these: it takes as
+   long as the proxy needs to reach the target, which says nothing about
+   the proxy, so it always gets tcp_read_time_out (see tunnel_to()).
+
+   samples go to histograms with 4 buckets per power of two (at most 25%
+   too long) over two halves of the window, the older half is dropped
+   when the newer one is full. every proxy has a lock of its own that a
+   sample only tries: a sample that finds it taken is dropped rather than
+   making the connect wait. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "core.h"
+#include "common.h"
+
+#define TIMEOUT_WINDOW 64
+#define TIMEOUT_MIN_SAMPLES 16
+#define TIMEOUT_PERCENTILE 95
+#define TIMEOUT_BUCKETS 128  // 4 per power of two of 32 bit microseconds
+
+extern int tcp_read_time_out;
+extern int tcp_connect_time_out;
+
+unsigned int proxy_timeout_k;
+unsigned int proxy_timeout_floor = 50;
+
+typedef struct {
+	uint8_t hist[2][TIMEOUT_BUCKETS];  // the newer and the older half of the window
+	uint8_t n;                         // samples in the newer half
+	uint8_t full;                      // the older half holds TIMEOUT_WINDOW / 2
+} rtt_window;
+
+typedef struct {
+	int busy;  // the lock of the windows
+	rtt_window win[TIMEOUT_KINDS];
+	uint32_t ms[TIMEOUT_KINDS];  // the timeouts, 0 until there are enough samples
+} proxy_rtt;
+
+static proxy_rtt **rtt;  // by table index, an entry is allocated on its first sample
+
+/* log2 with 2 bits of mantissa, 0-3 are exact */
+static unsigned int bucket_of(uint32_t us) {
+	unsigned int e;
+	if(us < 4)
+		return us;
+	e = 31 - __builtin_clz(us);
+	return (e - 1) * 4 + ((us >> (e - 2)) & 3);
+}
+
+/* the smallest time above the bucket's */
+static uint64_t bucket_top(unsigned int b) {
+	if(b < 4)
+		return b + 1;
+	return (uint64_t) (5 + b % 4) << (b / 4 - 1);
+}
+
+/* TIMEOUT_PERCENTILE of the window in us, 0 without enough samples */
+static uint64_t window_quantile(const rtt_window *w) {
+	unsigned int total = w->n + (w->full ? TIMEOUT_WINDOW / 2 : 0), skip, seen = 0;
+	int b;
+	if(total < TIMEOUT_MIN_SAMPLES)
+		return 0;
+	skip = total * (100 - TIMEOUT_PERCENTILE) / 100;
+	for(b = TIMEOUT_BUCKETS - 1; b >= 0; b--) {
+		seen += w->hist[0][b] + w->hist[1][b];
+		if(seen > skip)
+			return bucket_top(b);
+	}
+	return 0;
+}
+
+/* the entry of table index i, allocated by whoever gets there first */
+static proxy_rtt *rtt_get(uint32_t i) {
+	proxy_rtt **all = __atomic_load_n(&rtt, __ATOMIC_ACQUIRE), **none = NULL, *p, *exp = NULL;
+	if(!all) {
+		if(!(all = calloc(proxybound_proxy_count, sizeof(*all))))
+			return NULL;
+		if(!__atomic_compare_exchange_n(&rtt, &none, all, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			free(all);
+			all = none;
+		}
+	}
+	if((p = __atomic_load_n(&all[i], __ATOMIC_ACQUIRE)))
+		return p;
+	if(!(p = calloc(1, sizeof(*p))))
+		return NULL;
+	if(!__atomic_compare_exchange_n(&all[i], &exp, p, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(p);
+		p = exp;
+	}
+	return p;
+}
+
+static int table_index(const proxy_data *pd, uint32_t *i) {
+	if(pd < proxybound_pd || pd >= proxybound_pd + proxybound_proxy_count)
+		return -1;
+	*i = pd - proxybound_pd;
+	return 0;
+}
+
+/* ms to wait for a connect to pd or for a read of its handshake, kind
+   TIMEOUT_* */
+int proxy_timeout(const proxy_data *pd, int kind) {
+	int global = kind == TIMEOUT_CONNECT ? tcp_connect_time_out : tcp_read_time_out;
+	unsigned int set = kind == TIMEOUT_CONNECT ? pd->connect_ms : pd->read_ms;
+	proxy_rtt **all, *p;
+	uint32_t i, ms;
+
+	if(set)
+		return set;
+	if(!proxy_timeout_k || table_index(pd, &i) || !(all = __atomic_load_n(&rtt, __ATOMIC_ACQUIRE)) ||
+	   !(p = __atomic_load_n(&all[i], __ATOMIC_ACQUIRE)))
+		return global;
+	ms = __atomic_load_n(&p->ms[kind], __ATOMIC_RELAXED);
+	return ms && ms < (unsigned int) global ? (int) ms : global;
+}
+
+/* a connect or handshake that took us, or timed out after us */
+void proxy_timeout_record(const proxy_data *pd, int kind, uint64_t us) {
+	rtt_window *w;
+	proxy_rtt *p;
+	uint64_t ms;
+	uint32_t i;
+
+	if(!proxy_timeout_k || (kind == TIMEOUT_CONNECT ? pd->connect_ms : pd->read_ms) || table_index(pd, &i))
+		return;
+	if(us > 0xffffffffULL)
+		us = 0xffffffffULL;
+	if(!(p = rtt_get(i)) || __atomic_exchange_n(&p->busy, 1, __ATOMIC_ACQUIRE))
+		return;
+	w = &p->win[kind];
+	if(w->n == TIMEOUT_WINDOW / 2) {
+		memcpy(w->hist[1], w->hist[0], sizeof(w->hist[0]));
+		memset(w->hist[0], 0, sizeof(w->hist[0]));
+		w->n = 0;
+		w->full = 1;
+	}
+	w->hist[0][bucket_of(us)]++;
+	w->n++;
+	if((ms = window_quantile(w))) {
+		ms = (ms * proxy_timeout_k + 999) / 1000;
+		if(ms < proxy_timeout_floor)
+			ms = proxy_timeout_floor;
+		__atomic_store_n(&p->ms[kind], ms > 0xffffffffULL ? 0xffffffffU : (uint32_t) ms, __ATOMIC_RELAXED);
+		PDEBUG("timeout: proxy %u %s %llu ms\n", i,
+		       kind == TIMEOUT_CONNECT ? "connect" : kind == TIMEOUT_READ ? "read" : "hop",
+		       (unsigned long long) ms);
+	}
+	__atomic_store_n(&p->busy, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,84 @@
+/* chrome trace event export of the connect() phases, see trace.h.
+   events of one connect are collected in a per-thread buffer and written
+   with a single append once the connect is over, so the file io doesn't
+   show up in the timings. every process writes its own
+   <PROXYBOUND_TRACE_FILE>.<pid>.json, open it in chrome://tracing or
+   ui.perfetto.dev. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "core.h"
+#include "common.h"
+#include "trace.h"
+
+#define TRACE_BUF_SIZE 8192
+
+int trace_enabled;
+
+static const char *trace_prefix;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_fd = -1;
+static pid_t trace_pid;
+
+static __thread char tbuf[TRACE_BUF_SIZE];
+static __thread size_t tlen;
+
+void trace_init(void) {
+	trace_prefix = getenv(PROXYBOUND_TRACE_FILE_ENV_VAR);
+	trace_enabled = trace_prefix && *trace_prefix;
+}
+
+/* a forked child gets a file of its own */
+static int trace_open(void) {
+	char path[512];
+	struct stat st;
+	pid_t pid = getpid();
+
+	if(trace_fd != -1 && trace_pid == pid)
+		return trace_fd;
+	if(trace_fd != -1)
+		close(trace_fd);
+	snprintf(path, sizeof(path), "%s.%d.json", trace_prefix, (int) pid);
+	trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	trace_pid = pid;
+	/* the closing bracket is optional in the json array format */
+	if(trace_fd != -1 && !fstat(trace_fd, &st) && !st.st_size && write(trace_fd, "[\n", 2) != 2)
+		PDEBUG("trace: can't write %s\n", path);
+	return trace_fd;
+}
+
+void trace_flush(void) {
+	int fd;
+	if(!tlen)
+		return;
+	pthread_mutex_lock(&trace_lock);
+	if((fd = trace_open()) != -1 && write(fd, tbuf, tlen) != (ssize_t) tlen)
+		PDEBUG("trace: short write\n");
+	pthread_mutex_unlock(&trace_lock);
+	tlen = 0;
+}
+
+void trace_phase(const char *name, uint64_t start_us, uint64_t end_us, uint32_t ip, uint16_t port, int res) {
+	char addr[16];
+	struct in_addr in;
+	int n;
+
+	if(tlen + 256 > sizeof(tbuf))
+		trace_flush();
+	in.s_addr = ip;
+	inet_ntop(AF_INET, &in, addr, sizeof(addr));
+	n = snprintf(tbuf + tlen, sizeof(tbuf) - tlen,
+		     "{\"name\":\"%s\",\"cat\":\"proxybound\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,"
+		     "\"pid\":%d,\"tid\":%d,\"args\":{\"addr\":\"%s:%u\",\"result\":%d}},\n",
+		     name, (unsigned long long) start_us, (unsigned long long) (end_us - start_us),
+		     (int) getpid(), (int) syscall(SYS_gettid), addr, (unsigned) ntohs(port), res);
+	if(n > 0 && tlen + n < sizeof(tbuf))
+		tlen += n;
+}
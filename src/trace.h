@@ -0,0 +1,34 @@
+/* per connect() phase tracing.
+   every phase is a static USDT probe in the "proxybound" provider when
+   <sys/sdt.h> is available (attach with perf or bpftrace, a nop otherwise)
+   and, with PROXYBOUND_TRACE_FILE set, a chrome trace event. probe args:
+   start_us, end_us, ip, port (network order) and the phase result. */
+
+#ifndef __TRACE_HEADER
+#define __TRACE_HEADER
+
+#include <stdint.h>
+
+#if defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define PB_PROBE(name, s, e, ip, port, res) DTRACE_PROBE5(proxybound, name, s, e, ip, port, res)
+# endif
+#endif
+#ifndef PB_PROBE
+# define PB_PROBE(name, s, e, ip, port, res) do {} while(0)
+#endif
+
+extern int trace_enabled;
+
+void trace_init(void);
+void trace_phase(const char *name, uint64_t start_us, uint64_t end_us, uint32_t ip, uint16_t port, int res);
+void trace_flush(void);
+
+#define PB_TRACE(name, s, e, ip, port, res) do { \
+	PB_PROBE(name, s, e, ip, port, res); \
+	if(trace_enabled) \
+		trace_phase(#name, s, e, ip, port, res); \
+} while(0)
+
+#endif
@@ -0,0 +1,67 @@
+/* per connect() overhead of the interposition path.
+   connects N times to a loopback listener (which proxybound never proxies) and
+   reports ns per connect, so only the hook / supervisor cost is measured:
+     ./tests/bench_connect 20000
+     ./proxybound -q tests/bench_connect 20000
+     ./proxybound -q --supervise tests/bench_connect 20000 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static int lsock;
+
+static void *acceptor(void *arg) {
+	int fd;
+	(void) arg;
+	while((fd = accept(lsock, NULL, NULL)) != -1)
+		close(fd);
+	return NULL;
+}
+
+static unsigned long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+	struct sockaddr_in addr;
+	socklen_t alen = sizeof(addr);
+	unsigned long long start, total;
+	pthread_t t;
+	int i, n = argc > 1 ? atoi(argv[1]) : 10000;
+	int one = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	lsock = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if(bind(lsock, (struct sockaddr *) &addr, sizeof(addr)) || listen(lsock, 1024)) {
+		perror("listen");
+		return 1;
+	}
+	getsockname(lsock, (struct sockaddr *) &addr, &alen);
+	pthread_create(&t, NULL, acceptor, NULL);
+
+	total = 0;
+	for(i = 0; i < n; i++) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		start = now_ns();
+		if(connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+			perror("connect");
+			return 1;
+		}
+		total += now_ns() - start;
+		close(fd);
+	}
+	printf("connects=%d ns_per_connect=%llu\n", n, total / n);
+	return 0;
+}
@@ -0,0 +1,196 @@
+/* end to end benchmark through libproxybound.so against loopback stand-ins.
+   for every proxy type, chain type and chain length 1..N it runs a worker
+   (this program re-executed with LD_PRELOAD) that measures connect()
+   latency to an echo target and bulk throughput to a sink target, both
+   reached by host name so they go through the fake ip / remote dns path.
+   output is one tab separated row per case:
+     make bench
+     tests/bench_e2e ./libproxybound.so 3 > before.tsv
+   BENCH_CONNECTS (default 200) and BENCH_BULK_MB (default 32) scale a case. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "standin.h"
+
+#define MAX_LEN 8
+
+static const int kinds[] = { STANDIN_SOCKS4, STANDIN_SOCKS5, STANDIN_SOCKS5_AUTH, STANDIN_HTTP };
+static const char *kind_labels[] = { "socks4", "socks5", "socks5_auth", "http" };
+static const char *chains[] = { "strict", "dynamic", "random", "round_robin", "hash" };
+
+static unsigned long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_ull(const void *a, const void *b) {
+	unsigned long long x = *(const unsigned long long *) a, y = *(const unsigned long long *) b;
+	return x < y ? -1 : x > y;
+}
+
+static int dial_name(const char *name, unsigned short port) {
+	struct addrinfo hints, *res;
+	struct sockaddr_in sin;
+	int fd;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(name, NULL, &hints, &res))
+		return -1;
+	memcpy(&sin, res->ai_addr, sizeof(sin));
+	freeaddrinfo(res);
+	sin.sin_port = htons(port);
+	if((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		return -1;
+	if(connect(fd, (struct sockaddr *) &sin, sizeof(sin))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* runs preloaded, prints "p50 p90 p99 max MBps" */
+static int worker(unsigned short echo_port, unsigned short sink_port, int n, int bulk_mb) {
+	static char chunk[64 * 1024];
+	unsigned long long *lat = calloc(n, sizeof(*lat)), start, total = 0, got = 0;
+	unsigned char be[8];
+	char c = 'x';
+	double secs;
+	int i, fd;
+
+	for(i = 0; i < n; i++) {
+		start = now_ns();
+		if((fd = dial_name("echo.bench", echo_port)) == -1)
+			return 1;
+		lat[i] = now_ns() - start;
+		if(write(fd, &c, 1) != 1 || standin_read_n(fd, &c, 1))
+			return 1;
+		close(fd);
+	}
+	qsort(lat, n, sizeof(*lat), cmp_ull);
+
+	if((fd = dial_name("sink.bench", sink_port)) == -1)
+		return 1;
+	start = now_ns();
+	for(i = 0; i < bulk_mb * 16; i++) {
+		if(standin_write_n(fd, chunk, sizeof(chunk)))
+			return 1;
+		total += sizeof(chunk);
+	}
+	shutdown(fd, SHUT_WR);
+	if(standin_read_n(fd, be, 8))
+		return 1;
+	secs = (now_ns() - start) / 1e9;
+	close(fd);
+	for(i = 0; i < 8; i++)
+		got = got << 8 | be[i];
+	if(got != total)
+		return 1;
+
+	printf("%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n", lat[n / 2] / 1e3, lat[n * 90 / 100] / 1e3,
+	       lat[n * 99 / 100] / 1e3, lat[n - 1] / 1e3, total / secs / (1024 * 1024));
+	free(lat);
+	return 0;
+}
+
+static int write_conf(const char *path, const char *chain, int len, int kind, struct standin *proxies) {
+	FILE *f = fopen(path, "w");
+	int i;
+	if(!f)
+		return -1;
+	fprintf(f, "%s_chain\nchain_len = %d\nquiet_mode\nproxy_dns\nremote_dns_subnet 224\n"
+		"tcp_read_time_out 15000\ntcp_connect_time_out 8000\n[ProxyList]\n", chain, len);
+	for(i = 0; i < len; i++) {
+		fprintf(f, "%s 127.0.0.1 %u", standin_type(kind), proxies[i].port);
+		if(kind == STANDIN_SOCKS5_AUTH || kind == STANDIN_HTTP)
+			fprintf(f, " %s %s", STANDIN_USER, STANDIN_PASS);
+		fprintf(f, "\n");
+	}
+	return fclose(f);
+}
+
+static int run_case(const char *dll, const char *conf, const char *args[4], char *out, size_t outsize) {
+	int p[2], status;
+	ssize_t n;
+	size_t len = 0;
+	pid_t pid;
+
+	if(pipe(p))
+		return -1;
+	if((pid = fork()) == 0) {
+		close(p[0]);
+		dup2(p[1], 1);
+		setenv("LD_PRELOAD", dll, 1);
+		setenv("PROXYBOUND_CONF_FILE", conf, 1);
+		execl("/proc/self/exe", "bench_e2e", "--worker", args[0], args[1], args[2], args[3], (char *) NULL);
+		_exit(127);
+	}
+	close(p[1]);
+	while(len < outsize - 1 && (n = read(p[0], out + len, outsize - 1 - len)) > 0)
+		len += n;
+	out[len] = 0;
+	close(p[0]);
+	if(pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+		return -1;
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	struct standin echo_s, sink_s, proxies[sizeof(kinds) / sizeof(kinds[0])][MAX_LEN];
+	char conf[] = "/tmp/proxybound-bench.XXXXXX", dll[4096], out[256];
+	char ports[2][8], nconn[16], nbulk[16];
+	const char *args[4] = { ports[0], ports[1], nconn, nbulk };
+	int k, c, len, max_len, n, bulk_mb, fd;
+
+	if(argc == 6 && !strcmp(argv[1], "--worker"))
+		return worker(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+
+	if(!realpath(argc > 1 ? argv[1] : "./libproxybound.so", dll)) {
+		perror("libproxybound.so");
+		return 1;
+	}
+	max_len = argc > 2 ? atoi(argv[2]) : 3;
+	if(max_len < 1 || max_len > MAX_LEN)
+		max_len = 3;
+	n = getenv("BENCH_CONNECTS") ? atoi(getenv("BENCH_CONNECTS")) : 200;
+	bulk_mb = getenv("BENCH_BULK_MB") ? atoi(getenv("BENCH_BULK_MB")) : 32;
+	if(n < 1 || bulk_mb < 1)
+		return 1;
+
+	if(standin_start(&echo_s, STANDIN_ECHO) || standin_start(&sink_s, STANDIN_SINK))
+		return 1;
+	for(k = 0; k < (int) (sizeof(kinds) / sizeof(kinds[0])); k++)
+		for(len = 0; len < max_len; len++)
+			if(standin_start(&proxies[k][len], kinds[k]))
+				return 1;
+	if((fd = mkstemp(conf)) == -1)
+		return 1;
+	close(fd);
+	snprintf(ports[0], sizeof(ports[0]), "%u", echo_s.port);
+	snprintf(ports[1], sizeof(ports[1]), "%u", sink_s.port);
+	snprintf(nconn, sizeof(nconn), "%d", n);
+	snprintf(nbulk, sizeof(nbulk), "%d", bulk_mb);
+
+	printf("proxy\tchain\tlen\tconnects\tp50_us\tp90_us\tp99_us\tmax_us\tbulk_MBps\n");
+	for(k = 0; k < (int) (sizeof(kinds) / sizeof(kinds[0])); k++)
+		for(c = 0; c < (int) (sizeof(chains) / sizeof(chains[0])); c++)
+			for(len = 1; len <= max_len; len++) {
+				if(write_conf(conf, chains[c], len, kinds[k], proxies[k]) ||
+				   run_case(dll, conf, args, out, sizeof(out)))
+					snprintf(out, sizeof(out), "FAILED\n");
+				printf("%s\t%s\t%d\t%d\t%s", kind_labels[k], chains[c], len, n, out);
+				fflush(stdout);
+			}
+	unlink(conf);
+	return 0;
+}
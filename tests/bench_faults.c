@@ -0,0 +1,486 @@
+/* failover and tail latency under injected faults.
+   every scenario file describes a chain of loopback stand-in proxies and a
+   fault script per proxy (see standin.h); a worker (this program
+   re-executed with LD_PRELOAD) connects to an echo target through the
+   chain and the harness reports the connect latency distribution, the
+   chain retries counted by the dll metrics, the connections every proxy
+   saw and the most it had open at once. one tab separated row per scenario:
+     make bench-faults
+     tests/bench_faults ./libproxybound.so tests/scenarios/strict_slow.scn ...
+
+   scenario keywords, one per line, '#' starts a comment:
+     chain strict|dynamic|random|round_robin|hash
+     chain_len N                  (random, round_robin and hash)
+     connects N                   (default 50)
+     tcp_connect_time_out MS      (default 500)
+     tcp_read_time_out MS         (default 1000)
+     sticky_ttl S                 (random_chain, default 0)
+     latency_order N              (random_chain, default 0)
+     health_check_interval MS     (default 0, off)
+     health_check_timeout MS      (default 0, tcp_connect_time_out)
+     fork_per_connect 0|1         every connect from a new process
+     threads N                    connecting threads of the worker (default 1)
+     proxy_max_inflight N         proxy limits (default 0, off)
+     proxy_max_conns N
+     proxy_queue_timeout MS       (default 0, tcp_connect_time_out)
+     proxy_limits_shared 0|1      limits over all processes
+     chain_retries N              retry policy (defaults as in the dll:
+     chain_retry_budget MS         8 retries, no budget, 10ms backoff
+     chain_retry_backoff MS        doubling up to 1000ms)
+     chain_retry_backoff_max MS
+     adaptive_timeouts K          per proxy timeouts (default 0, off)
+     adaptive_timeout_floor MS    (default 50)
+     proxy TYPE STEP...           TYPE: socks4 socks5 socks5_auth http
+                                  STEP: ok delay:MS refuse blackhole partial
+                                        split:MS blocked noauth reset hop:MS
+                                        target:MS
+     proxy TYPE down              nothing listens, connect() is refused
+     proxy TYPE NAME=MS STEP...   connect_timeout= and read_timeout= are
+                                  added to the proxy's line
+   the steps of a proxy apply to its successive connections, cyclically. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "standin.h"
+#include "../src/metrics.h"
+
+#define MAX_PROXIES 16
+
+struct scenario {
+	char chain[16];
+	int chain_len;
+	int connects;
+	int connect_timeout;
+	int read_timeout;
+	int sticky_ttl;
+	int latency_order;
+	int health_interval;
+	int health_timeout;
+	int fork_each;
+	int threads;
+	int max_inflight;
+	int max_conns;
+	int queue_timeout;
+	int limits_shared;
+	int retries;
+	int retry_budget;
+	int retry_backoff;
+	int retry_backoff_max;
+	int timeout_k;
+	int timeout_floor;
+	int nproxies;
+	int kinds[MAX_PROXIES];
+	int down[MAX_PROXIES];
+	char options[MAX_PROXIES][64];
+	struct standin_step steps[MAX_PROXIES][STANDIN_MAX_STEPS];
+	int nsteps[MAX_PROXIES];
+};
+
+static const char *kind_labels[] = {
+	[STANDIN_SOCKS4] = "socks4", [STANDIN_SOCKS5] = "socks5",
+	[STANDIN_SOCKS5_AUTH] = "socks5_auth", [STANDIN_HTTP] = "http",
+};
+
+static unsigned long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_ull(const void *a, const void *b) {
+	unsigned long long x = *(const unsigned long long *) a, y = *(const unsigned long long *) b;
+	return x < y ? -1 : x > y;
+}
+
+static int dial_name(const char *name, unsigned short port) {
+	struct addrinfo hints, *res;
+	struct sockaddr_in sin;
+	int fd;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(name, NULL, &hints, &res))
+		return -1;
+	memcpy(&sin, res->ai_addr, sizeof(sin));
+	freeaddrinfo(res);
+	sin.sin_port = htons(port);
+	if((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		return -1;
+	if(connect(fd, (struct sockaddr *) &sin, sizeof(sin))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int echo_once(unsigned short echo_port) {
+	char c = 'x';
+	int fd = dial_name("echo.bench", echo_port), ok;
+	if(fd == -1)
+		return 0;
+	ok = write(fd, &c, 1) == 1 && !standin_read_n(fd, &c, 1);
+	close(fd);
+	return ok;
+}
+
+struct worker_part {
+	pthread_t thread;
+	unsigned short echo_port;
+	int fork_each;
+	unsigned long long *lat;
+	int n, ok;
+};
+
+static void *worker_thread(void *arg) {
+	struct worker_part *w = arg;
+	unsigned long long start;
+	int i, status;
+	pid_t pid;
+
+	for(i = 0; i < w->n; i++) {
+		start = now_ns();
+		if(!w->fork_each)
+			w->ok += echo_once(w->echo_port);
+		else if((pid = fork()) == 0)
+			_exit(!echo_once(w->echo_port));
+		else if(pid != -1 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && !WEXITSTATUS(status))
+			w->ok++;
+		w->lat[i] = now_ns() - start;
+	}
+	return NULL;
+}
+
+/* runs preloaded, prints "ok failed p50 p90 p99 max", latencies of failed
+   connects included. with fork_each every connect comes from a child that
+   starts with a fresh dll, the latency includes its fork and init. the
+   connects are spread over the threads, which run at the same time */
+static int worker(unsigned short echo_port, int n, int fork_each, int threads) {
+	unsigned long long *lat = calloc(n, sizeof(*lat));
+	struct worker_part *parts;
+	int i, done = 0, ok = 0;
+
+	threads = threads < 1 ? 1 : threads > n ? n : threads;
+	if(!lat || !(parts = calloc(threads, sizeof(*parts))))
+		return 1;
+	for(i = 0; i < threads; i++) {
+		parts[i].echo_port = echo_port;
+		parts[i].fork_each = fork_each;
+		parts[i].lat = lat + done;
+		parts[i].n = (n - done) / (threads - i);
+		done += parts[i].n;
+		if(pthread_create(&parts[i].thread, NULL, worker_thread, &parts[i]))
+			return 1;
+	}
+	for(i = 0; i < threads; i++) {
+		pthread_join(parts[i].thread, NULL);
+		ok += parts[i].ok;
+	}
+	free(parts);
+	qsort(lat, n, sizeof(*lat), cmp_ull);
+	printf("%d\t%d\t%.1f\t%.1f\t%.1f\t%.1f\n", ok, n - ok, lat[n / 2] / 1e3, lat[n * 90 / 100] / 1e3,
+	       lat[n * 99 / 100] / 1e3, lat[n - 1] / 1e3);
+	free(lat);
+	return 0;
+}
+
+static int parse_kind(const char *s) {
+	unsigned i;
+	for(i = 0; i < sizeof(kind_labels) / sizeof(kind_labels[0]); i++)
+		if(!strcmp(s, kind_labels[i]))
+			return i;
+	return -1;
+}
+
+static int parse_scenario(const char *path, struct scenario *sc) {
+	char line[1024], *tok, *val, *save;
+	FILE *f = fopen(path, "r");
+	int lineno = 0, i;
+
+	if(!f) {
+		perror(path);
+		return -1;
+	}
+	memset(sc, 0, sizeof(*sc));
+	strcpy(sc->chain, "strict");
+	sc->chain_len = 1;
+	sc->connects = 50;
+	sc->connect_timeout = 500;
+	sc->read_timeout = 1000;
+	sc->threads = 1;
+	sc->retries = 8;
+	sc->retry_backoff = 10;
+	sc->retry_backoff_max = 1000;
+	sc->timeout_floor = 50;
+	while(fgets(line, sizeof(line), f)) {
+		lineno++;
+		if((tok = strchr(line, '#')))
+			*tok = 0;
+		if(!(tok = strtok_r(line, " \t\r\n", &save)))
+			continue;
+		if(!strcmp(tok, "proxy")) {
+			if(sc->nproxies == MAX_PROXIES || !(tok = strtok_r(NULL, " \t\r\n", &save)) ||
+			   (sc->kinds[sc->nproxies] = parse_kind(tok)) == -1)
+				goto bad;
+			for(i = 0; (tok = strtok_r(NULL, " \t\r\n", &save)); i++) {
+				if(!strcmp(tok, "down")) {
+					sc->down[sc->nproxies] = 1;
+					continue;
+				}
+				if(strchr(tok, '=')) {
+					size_t used = strlen(sc->options[sc->nproxies]);
+					snprintf(sc->options[sc->nproxies] + used, sizeof(sc->options[0]) - used, " %s", tok);
+					i--;
+					continue;
+				}
+				if(i == STANDIN_MAX_STEPS || standin_parse_step(tok, &sc->steps[sc->nproxies][i]))
+					goto bad;
+				sc->nsteps[sc->nproxies] = i + 1;
+			}
+			sc->nproxies++;
+			continue;
+		}
+		if(!(val = strtok_r(NULL, " \t\r\n", &save)))
+			goto bad;
+		if(!strcmp(tok, "chain"))
+			snprintf(sc->chain, sizeof(sc->chain), "%s", val);
+		else if(!strcmp(tok, "chain_len"))
+			sc->chain_len = atoi(val);
+		else if(!strcmp(tok, "connects"))
+			sc->connects = atoi(val);
+		else if(!strcmp(tok, "tcp_connect_time_out"))
+			sc->connect_timeout = atoi(val);
+		else if(!strcmp(tok, "tcp_read_time_out"))
+			sc->read_timeout = atoi(val);
+		else if(!strcmp(tok, "sticky_ttl"))
+			sc->sticky_ttl = atoi(val);
+		else if(!strcmp(tok, "latency_order"))
+			sc->latency_order = atoi(val);
+		else if(!strcmp(tok, "health_check_interval"))
+			sc->health_interval = atoi(val);
+		else if(!strcmp(tok, "health_check_timeout"))
+			sc->health_timeout = atoi(val);
+		else if(!strcmp(tok, "fork_per_connect"))
+			sc->fork_each = atoi(val);
+		else if(!strcmp(tok, "threads"))
+			sc->threads = atoi(val);
+		else if(!strcmp(tok, "proxy_max_inflight"))
+			sc->max_inflight = atoi(val);
+		else if(!strcmp(tok, "proxy_max_conns"))
+			sc->max_conns = atoi(val);
+		else if(!strcmp(tok, "proxy_queue_timeout"))
+			sc->queue_timeout = atoi(val);
+		else if(!strcmp(tok, "proxy_limits_shared"))
+			sc->limits_shared = atoi(val);
+		else if(!strcmp(tok, "chain_retries"))
+			sc->retries = atoi(val);
+		else if(!strcmp(tok, "chain_retry_budget"))
+			sc->retry_budget = atoi(val);
+		else if(!strcmp(tok, "chain_retry_backoff"))
+			sc->retry_backoff = atoi(val);
+		else if(!strcmp(tok, "chain_retry_backoff_max"))
+			sc->retry_backoff_max = atoi(val);
+		else if(!strcmp(tok, "adaptive_timeouts"))
+			sc->timeout_k = atoi(val);
+		else if(!strcmp(tok, "adaptive_timeout_floor"))
+			sc->timeout_floor = atoi(val);
+		else
+			goto bad;
+	}
+	fclose(f);
+	if(!sc->nproxies || sc->connects < 1)
+		goto bad_scenario;
+	return 0;
+	bad:
+	fclose(f);
+	bad_scenario:
+	fprintf(stderr, "%s:%d: bad scenario\n", path, lineno);
+	return -1;
+}
+
+/* a port nobody listens on */
+static unsigned short dead_port(void) {
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(fd == -1 || bind(fd, (struct sockaddr *) &sin, sizeof(sin)) ||
+	   getsockname(fd, (struct sockaddr *) &sin, &len))
+		sin.sin_port = htons(1);
+	if(fd != -1)
+		close(fd);
+	return ntohs(sin.sin_port);
+}
+
+static int write_conf(const char *path, struct scenario *sc, unsigned short *ports) {
+	FILE *f = fopen(path, "w");
+	int i;
+	if(!f)
+		return -1;
+	fprintf(f, "%s_chain\nchain_len = %d\nquiet_mode\nproxy_dns\nremote_dns_subnet 224\n"
+		"tcp_read_time_out %d\ntcp_connect_time_out %d\nsticky_ttl %d\n"
+		"latency_order %d\nhealth_check_interval %d\nhealth_check_timeout %d\n"
+		"proxy_max_inflight %d\nproxy_max_conns %d\nproxy_queue_timeout %d\n"
+		"chain_retries %d\nchain_retry_budget %d\nchain_retry_backoff %d\nchain_retry_backoff_max %d\n"
+		"adaptive_timeouts %d\nadaptive_timeout_floor %d\n",
+		sc->chain, sc->chain_len, sc->read_timeout, sc->connect_timeout, sc->sticky_ttl,
+		sc->latency_order, sc->health_interval, sc->health_timeout,
+		sc->max_inflight, sc->max_conns, sc->queue_timeout,
+		sc->retries, sc->retry_budget, sc->retry_backoff, sc->retry_backoff_max,
+		sc->timeout_k, sc->timeout_floor);
+	if(sc->limits_shared)
+		fprintf(f, "proxy_limits_shared\n");
+	fprintf(f, "[ProxyList]\n");
+	for(i = 0; i < sc->nproxies; i++) {
+		fprintf(f, "%s 127.0.0.1 %u", standin_type(sc->kinds[i]), ports[i]);
+		if(sc->kinds[i] == STANDIN_SOCKS5_AUTH || sc->kinds[i] == STANDIN_HTTP)
+			fprintf(f, " %s %s", STANDIN_USER, STANDIN_PASS);
+		fprintf(f, "%s\n", sc->options[i]);
+	}
+	return fclose(f);
+}
+
+/* chain retries of the config's metrics segment, -1 without one */
+static long long chain_retries(const char *conf, const char *chain) {
+	static const char *types[METRICS_CHAIN_TYPES] = { "dynamic", "strict", "random", "round_robin", "hash" };
+	metrics_segment *seg;
+	struct stat st;
+	char name[64];
+	long long r = -1;
+	int fd, i;
+
+	metrics_shm_name(name, sizeof(name), conf, "metrics");
+	if((fd = shm_open(name, O_RDONLY, 0)) == -1)
+		return -1;
+	if(!fstat(fd, &st) && (size_t) st.st_size >= sizeof(metrics_segment) &&
+	   (seg = mmap(NULL, sizeof(*seg), PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+		for(i = 0; i < METRICS_CHAIN_TYPES; i++)
+			if(!strcmp(chain, types[i]) && seg->h.magic == METRICS_MAGIC && seg->h.version == METRICS_VERSION)
+				r = __atomic_load_n(&seg->chain[i].retries, __ATOMIC_RELAXED);
+		munmap(seg, sizeof(*seg));
+	}
+	close(fd);
+	return r;
+}
+
+/* every scenario has a proxy list of its own, start it on new segments */
+static void drop_metrics(const char *conf) {
+	char name[64];
+	metrics_shm_name(name, sizeof(name), conf, "metrics");
+	shm_unlink(name);
+	metrics_shm_name(name, sizeof(name), conf, "health");
+	shm_unlink(name);
+}
+
+static int run_worker(const char *dll, const char *conf, const char *port, const char *n, int fork_each,
+		      int threads, char *out, size_t outsize) {
+	char nthreads[16];
+	int p[2], status;
+	ssize_t r;
+	size_t len = 0;
+	pid_t pid;
+
+	snprintf(nthreads, sizeof(nthreads), "%d", threads);
+	if(pipe(p))
+		return -1;
+	if((pid = fork()) == 0) {
+		close(p[0]);
+		dup2(p[1], 1);
+		setenv("LD_PRELOAD", dll, 1);
+		setenv("PROXYBOUND_CONF_FILE", conf, 1);
+		execl("/proc/self/exe", "bench_faults", "--worker", port, n, fork_each ? "1" : "0", nthreads, (char *) NULL);
+		_exit(127);
+	}
+	close(p[1]);
+	while(len < outsize - 1 && (r = read(p[0], out + len, outsize - 1 - len)) > 0)
+		len += r;
+	out[len] = 0;
+	close(p[0]);
+	if(pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+		return -1;
+	return 0;
+}
+
+static void run_scenario(const char *dll, const char *conf, const char *path, struct standin *echo_s) {
+	struct standin proxies[MAX_PROXIES];
+	unsigned short ports[MAX_PROXIES];
+	struct scenario sc;
+	char out[256], port[8], n[16], retries[24];
+	const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	long long after;
+	int i;
+
+	if(parse_scenario(path, &sc))
+		return;
+	for(i = 0; i < sc.nproxies; i++) {
+		if(sc.down[i])
+			ports[i] = dead_port();
+		else if(standin_start_script(&proxies[i], sc.kinds[i], sc.steps[i], sc.nsteps[i]))
+			return;
+		else
+			ports[i] = proxies[i].port;
+	}
+	snprintf(port, sizeof(port), "%u", echo_s->port);
+	snprintf(n, sizeof(n), "%d", sc.connects);
+	drop_metrics(conf);
+	if(write_conf(conf, &sc, ports) || run_worker(dll, conf, port, n, sc.fork_each, sc.threads, out, sizeof(out)))
+		snprintf(out, sizeof(out), "FAILED\n");
+	after = chain_retries(conf, sc.chain);
+	if(after < 0)
+		snprintf(retries, sizeof(retries), "-");
+	else
+		snprintf(retries, sizeof(retries), "%lld", after);
+	out[strcspn(out, "\n")] = 0;
+	printf("%s\t%s\t%d\t%s\t%s\t", name, sc.chain, sc.connects, out, retries);
+	for(i = 0; i < sc.nproxies; i++)
+		printf("%s%lu", i ? "," : "", sc.down[i] ? 0 : __atomic_load_n(&proxies[i].accepted, __ATOMIC_RELAXED));
+	printf("\t");
+	for(i = 0; i < sc.nproxies; i++) {
+		printf("%s%lu", i ? "," : "", sc.down[i] ? 0 : __atomic_load_n(&proxies[i].peak, __ATOMIC_RELAXED));
+		if(!sc.down[i])
+			standin_stop(&proxies[i]);
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+	struct standin echo_s;
+	char conf[] = "/tmp/proxybound-faults.XXXXXX", dll[4096];
+	int i, fd;
+
+	if(argc == 6 && !strcmp(argv[1], "--worker"))
+		return worker(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+	if(argc < 3) {
+		fprintf(stderr, "usage: %s libproxybound.so scenario...\n", argv[0]);
+		return 1;
+	}
+	if(!realpath(argv[1], dll)) {
+		perror(argv[1]);
+		return 1;
+	}
+	if(standin_start(&echo_s, STANDIN_ECHO) || (fd = mkstemp(conf)) == -1)
+		return 1;
+	close(fd);
+
+	printf("scenario\tchain\tconnects\tok\tfailed\tp50_us\tp90_us\tp99_us\tmax_us\tretries\tproxy_conns\tproxy_peak\n");
+	for(i = 2; i < argc; i++)
+		run_scenario(dll, conf, argv[i], &echo_s);
+	drop_metrics(conf);
+	unlink(conf);
+	return 0;
+}
@@ -0,0 +1,321 @@
+/* per call cost of the hooks.
+   every hooked function is timed through the preloaded dll and through the
+   libc symbol looked up with dlopen("libc.so.6"), which bypasses the hooks.
+   syscalls per call come from the raw_syscalls:sys_enter tracepoint when
+   perf_event_open() may use it (tracefs mounted, perf_event_paranoid),
+   "-" otherwise. the program re-executes itself preloaded once per policy
+   combination (PROXYBOUND_ALLOW_LEAKS, PROXYBOUND_ALLOW_DNS, proxy_dns):
+     tests/bench_hooks ./libproxybound.so [iterations] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+typedef int (*connect_fn)(int, const struct sockaddr *, socklen_t);
+typedef int (*bind_fn)(int, const struct sockaddr *, socklen_t);
+typedef ssize_t (*send_fn)(int, const void *, size_t, int);
+typedef ssize_t (*sendto_fn)(int, const void *, size_t, int, const struct sockaddr *, socklen_t);
+typedef ssize_t (*sendmsg_fn)(int, const struct msghdr *, int);
+typedef int (*getaddrinfo_fn)(const char *, const char *, const struct addrinfo *, struct addrinfo **);
+typedef void (*freeaddrinfo_fn)(struct addrinfo *);
+
+struct fns {
+	connect_fn connect;
+	bind_fn bind;
+	send_fn send;
+	sendto_fn sendto;
+	sendmsg_fn sendmsg;
+	getaddrinfo_fn getaddrinfo;
+	freeaddrinfo_fn freeaddrinfo;
+};
+
+struct result {
+	double ns;
+	double syscalls;  // < 0 when not available
+	int errors;
+};
+
+static int iterations = 20000;
+static int perf_fd = -1;
+static struct sockaddr_un unix_addr;
+static struct sockaddr_in lo_addr, localnet_addr, udp_addr;
+static int stream_fd, udp_fd;
+
+static unsigned long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void perf_open(void) {
+#ifdef __linux__
+	static const char *ids[] = {
+		"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+		"/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+	};
+	struct perf_event_attr attr;
+	unsigned i;
+	FILE *f;
+	long id = -1;
+
+	for(i = 0; i < sizeof(ids) / sizeof(ids[0]) && id < 0; i++)
+		if((f = fopen(ids[i], "r"))) {
+			if(fscanf(f, "%ld", &id) != 1)
+				id = -1;
+			fclose(f);
+		}
+	if(id < 0)
+		return;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_TRACEPOINT;
+	attr.size = sizeof(attr);
+	attr.config = id;
+	attr.disabled = 1;
+	attr.exclude_kernel = 0;
+	perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+static unsigned long long perf_read(void) {
+	unsigned long long v = 0;
+	if(perf_fd == -1 || read(perf_fd, &v, sizeof(v)) != sizeof(v))
+		return 0;
+	return v;
+}
+
+static void perf_enable(int on) {
+#ifdef __linux__
+	if(perf_fd != -1)
+		ioctl(perf_fd, on ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+#else
+	(void) on;
+#endif
+}
+
+/* one timed call; setup and cleanup run outside of the measured window,
+   the syscalls of the clock reads are vdso calls and don't count */
+#define MEASURE(res, setup, call, cleanup) do { \
+	unsigned long long _t = 0, _s, _c0, _c1; \
+	int _i; \
+	(res)->errors = 0; \
+	_c0 = perf_read(); \
+	for(_i = 0; _i < iterations; _i++) { \
+		setup; \
+		perf_enable(1); \
+		_s = now_ns(); \
+		if((call) < 0) (res)->errors++; \
+		_t += now_ns() - _s; \
+		perf_enable(0); \
+		cleanup; \
+	} \
+	_c1 = perf_read(); \
+	(res)->ns = (double) _t / iterations; \
+	(res)->syscalls = perf_fd == -1 ? -1 : (double) (_c1 - _c0) / iterations - 1; /* the disabling ioctl */ \
+} while(0)
+
+static void *drain(void *arg) {
+	char buf[65536];
+	int fd = (int) (long) arg;
+	while(read(fd, buf, sizeof(buf)) > 0)
+		;
+	return NULL;
+}
+
+static void setup_targets(void) {
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	pthread_t t;
+	int lfd, sv[2];
+
+	/* unix listener, the backlog overflows to ECONNREFUSED/EAGAIN but the
+	   hook runs the same way */
+	memset(&unix_addr, 0, sizeof(unix_addr));
+	unix_addr.sun_family = AF_UNIX;
+	snprintf(unix_addr.sun_path, sizeof(unix_addr.sun_path), "/tmp/proxybound-bench-hooks.%d", (int) getpid());
+	lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(unix_addr.sun_path);
+	bind(lfd, (struct sockaddr *) &unix_addr, sizeof(unix_addr));
+	listen(lfd, 4096);
+
+	memset(&lo_addr, 0, sizeof(lo_addr));
+	lo_addr.sin_family = AF_INET;
+	lo_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	bind(lfd, (struct sockaddr *) &lo_addr, sizeof(lo_addr));
+	listen(lfd, 4096);
+	getsockname(lfd, (struct sockaddr *) &sin, &len);
+	lo_addr.sin_port = sin.sin_port;
+
+	/* TEST-NET-1 is listed as localnet in the config, sockets are non
+	   blocking so the connect returns at once */
+	localnet_addr = lo_addr;
+	inet_aton("192.0.2.1", &localnet_addr.sin_addr);
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	stream_fd = sv[0];
+	pthread_create(&t, NULL, drain, (void *) (long) sv[1]);
+
+	udp_addr = lo_addr;
+	udp_addr.sin_port = 0;
+	lfd = socket(AF_INET, SOCK_DGRAM, 0);
+	bind(lfd, (struct sockaddr *) &udp_addr, sizeof(udp_addr));
+	len = sizeof(sin);
+	getsockname(lfd, (struct sockaddr *) &sin, &len);
+	udp_addr.sin_port = sin.sin_port;
+	pthread_create(&t, NULL, drain, (void *) (long) lfd);
+	udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+}
+
+static int gai(struct fns *f, const char *name) {
+	struct addrinfo *res;
+	int r = f->getaddrinfo(name, NULL, NULL, &res);
+	if(!r)
+		f->freeaddrinfo(res);
+	return r ? -1 : 0;
+}
+
+static void run_all(struct fns *f, const char *policy, const char *variant, struct result *out) {
+	static const char *names[] = {
+		"connect_unix", "connect_loopback", "connect_localnet", "send", "sendto_udp", "sendmsg_udp",
+		"bind_udp", "getaddrinfo_localhost", "getaddrinfo_numeric",
+	};
+	struct msghdr msg;
+	struct iovec iov;
+	struct sockaddr_in any;
+	char c = 'x';
+	int fd = -1, i;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_name = &udp_addr;
+	msg.msg_namelen = sizeof(udp_addr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	memset(&any, 0, sizeof(any));
+	any.sin_family = AF_INET;
+	any.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	MEASURE(&out[0], fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0),
+		f->connect(fd, (struct sockaddr *) &unix_addr, sizeof(unix_addr)), close(fd));
+	MEASURE(&out[1], fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0),
+		f->connect(fd, (struct sockaddr *) &lo_addr, sizeof(lo_addr)) && errno != EINPROGRESS ? -1 : 0, close(fd));
+	MEASURE(&out[2], fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0),
+		f->connect(fd, (struct sockaddr *) &localnet_addr, sizeof(localnet_addr)) && errno != EINPROGRESS ? -1 : 0,
+		close(fd));
+	MEASURE(&out[3], (void) 0, f->send(stream_fd, &c, 1, 0), (void) 0);
+	MEASURE(&out[4], (void) 0, f->sendto(udp_fd, &c, 1, 0, (struct sockaddr *) &udp_addr, sizeof(udp_addr)), (void) 0);
+	MEASURE(&out[5], (void) 0, f->sendmsg(udp_fd, &msg, 0), (void) 0);
+	MEASURE(&out[6], fd = socket(AF_INET, SOCK_DGRAM, 0), f->bind(fd, (struct sockaddr *) &any, sizeof(any)), close(fd));
+	MEASURE(&out[7], (void) 0, gai(f, "localhost"), (void) 0);
+	MEASURE(&out[8], (void) 0, gai(f, "127.0.0.1"), (void) 0);
+
+	for(i = 0; i < 9; i++) {
+		printf("%s\t%s\t%s\t%.1f\t", policy, names[i], variant, out[i].ns);
+		if(out[i].syscalls < 0)
+			printf("-");
+		else
+			printf("%.2f", out[i].syscalls);
+		printf("\t%d\n", out[i].errors);
+	}
+	fflush(stdout);
+}
+
+static int worker(const char *policy) {
+	struct result hooked[9], direct[9];
+	struct fns hook, libc;
+	void *h = dlopen("libc.so.6", RTLD_NOW | RTLD_NOLOAD);
+
+	if(!h && !(h = dlopen("libc.so.6", RTLD_NOW))) {
+		fprintf(stderr, "%s\n", dlerror());
+		return 1;
+	}
+	hook.connect = connect;
+	hook.bind = bind;
+	hook.send = send;
+	hook.sendto = sendto;
+	hook.sendmsg = sendmsg;
+	hook.getaddrinfo = getaddrinfo;
+	hook.freeaddrinfo = freeaddrinfo;
+	libc.connect = (connect_fn) dlsym(h, "connect");
+	libc.bind = (bind_fn) dlsym(h, "bind");
+	libc.send = (send_fn) dlsym(h, "send");
+	libc.sendto = (sendto_fn) dlsym(h, "sendto");
+	libc.sendmsg = (sendmsg_fn) dlsym(h, "sendmsg");
+	libc.getaddrinfo = (getaddrinfo_fn) dlsym(h, "getaddrinfo");
+	libc.freeaddrinfo = (freeaddrinfo_fn) dlsym(h, "freeaddrinfo");
+
+	perf_open();
+	setup_targets();
+	/* first call initialises the dll */
+	gai(&hook, "localhost");
+	run_all(&libc, policy, "libc", direct);
+	run_all(&hook, policy, "hooked", hooked);
+	unlink(unix_addr.sun_path);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	char conf[] = "/tmp/proxybound-bench-hooks.XXXXXX", dll[4096], policy[64];
+	int leaks, dns, proxy_dns, fd, status;
+	FILE *f;
+	pid_t pid;
+
+	if(argc == 4 && !strcmp(argv[1], "--worker")) {
+		iterations = atoi(argv[3]);
+		return worker(argv[2]);
+	}
+	if(!realpath(argc > 1 ? argv[1] : "./libproxybound.so", dll)) {
+		perror("libproxybound.so");
+		return 1;
+	}
+	if(argc > 2)
+		iterations = atoi(argv[2]);
+	if(iterations < 1 || (fd = mkstemp(conf)) == -1)
+		return 1;
+	close(fd);
+
+	printf("policy\tcall\tvariant\tns_per_call\tsyscalls_per_call\terrors\n");
+	fflush(stdout);
+	for(leaks = 0; leaks < 2; leaks++)
+		for(dns = 0; dns < 2; dns++)
+			for(proxy_dns = 0; proxy_dns < 2; proxy_dns++) {
+				if(!(f = fopen(conf, "w")))
+					return 1;
+				fprintf(f, "strict_chain\nquiet_mode\n%slocalnet 192.0.2.0/255.255.255.0\n"
+					"[ProxyList]\nsocks5 127.0.0.1 1\n", proxy_dns ? "proxy_dns\n" : "");
+				fclose(f);
+				snprintf(policy, sizeof(policy), "leaks=%d,dns=%d,proxy_dns=%d", leaks, dns, proxy_dns);
+				if((pid = fork()) == 0) {
+					char n[16];
+					snprintf(n, sizeof(n), "%d", iterations);
+					setenv("LD_PRELOAD", dll, 1);
+					setenv("PROXYBOUND_CONF_FILE", conf, 1);
+					setenv("PROXYBOUND_ALLOW_LEAKS", leaks ? "1" : "0", 1);
+					setenv("PROXYBOUND_ALLOW_DNS", dns ? "1" : "0", 1);
+					execl("/proc/self/exe", "bench_hooks", "--worker", policy, n, (char *) NULL);
+					_exit(127);
+				}
+				if(pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+					fprintf(stderr, "worker %s failed\n", policy);
+			}
+	unlink(conf);
+	return 0;
+}
@@ -0,0 +1,335 @@
+/* replays a PROXYBOUND_RECORD recording (see src/record.h) against loopback
+   stand-in proxies. every recorded thread becomes a thread of a preloaded
+   worker that issues the same resolver calls and connects at the recorded
+   offsets, so bursts and concurrency are kept. the stand-ins send every
+   request to a local echo target, connects to 127.x go to it directly.
+   prints recorded and replayed latencies per phase, one tab separated row
+   each:
+     PROXYBOUND_RECORD=/tmp/rec proxybound firefox
+     tests/bench_replay ./libproxybound.so /tmp/rec.*.pbr
+   REPLAY_SPEED (default 1, 0: no waiting), REPLAY_CHAIN (strict, dynamic,
+   random), REPLAY_LEN (default 1) and REPLAY_PROXY (socks4, socks5,
+   socks5_auth, http) pick the replay setup. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "standin.h"
+#include "../src/record.h"
+
+#define MAX_LEN 8
+
+enum { PH_RESOLVE, PH_CONNECT_PROXIED, PH_CONNECT_DIRECT, PH_COUNT };
+
+static const char *phase_names[PH_COUNT] = { "resolve", "connect_proxied", "connect_direct" };
+
+struct event {
+	record_event rec;
+	char name[256];
+	uint64_t at_ns;  // offset from the start of the earliest recording
+	int file;
+	int phase;
+};
+
+struct phase {
+	unsigned long long *recorded, *replayed;
+	size_t n, done;
+	int rec_errors, errors;
+};
+
+struct player {
+	struct event *ev;
+	size_t n;
+	pthread_t thread;
+};
+
+static struct phase phases[PH_COUNT];
+static unsigned short echo_port;
+static double speed = 1;
+static unsigned long long t0;
+
+static unsigned long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_ull(const void *a, const void *b) {
+	unsigned long long x = *(const unsigned long long *) a, y = *(const unsigned long long *) b;
+	return x < y ? -1 : x > y;
+}
+
+/* by file, thread, time */
+static int cmp_event(const void *a, const void *b) {
+	const struct event *x = a, *y = b;
+	if(x->file != y->file)
+		return x->file - y->file;
+	if(x->rec.tid != y->rec.tid)
+		return x->rec.tid < y->rec.tid ? -1 : 1;
+	return x->at_ns < y->at_ns ? -1 : x->at_ns > y->at_ns;
+}
+
+static int load(char **files, int nfiles, struct event **out, size_t *count) {
+	struct event *ev = NULL, *e;
+	uint64_t *starts = calloc(nfiles, sizeof(*starts)), first = UINT64_MAX, first_ev = UINT64_MAX;
+	record_header hdr;
+	size_t n = 0, capa = 0, i;
+	FILE *f;
+	int k;
+
+	for(k = 0; k < nfiles; k++) {
+		if(!(f = fopen(files[k], "r")) || fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+		   hdr.magic != RECORD_MAGIC || hdr.version != RECORD_VERSION) {
+			fprintf(stderr, "%s: not a proxybound recording\n", files[k]);
+			return -1;
+		}
+		starts[k] = hdr.start_unix_ns;
+		if(starts[k] < first)
+			first = starts[k];
+		for(;;) {
+			if(n == capa && !(ev = realloc(ev, (capa = capa ? capa * 2 : 1024) * sizeof(*ev))))
+				return -1;
+			e = &ev[n];
+			if(fread(&e->rec, sizeof(e->rec), 1, f) != 1)
+				break;
+			if(fread(e->name, 1, e->rec.name_len, f) != e->rec.name_len)
+				break;
+			e->name[e->rec.name_len] = 0;
+			e->file = k;
+			if(e->rec.type == RECORD_RESOLVE && e->rec.name_len)
+				e->phase = PH_RESOLVE;
+			else if(e->rec.type == RECORD_CONNECT)
+				e->phase = (ntohl(e->rec.ip) >> 24) == 127 ? PH_CONNECT_DIRECT : PH_CONNECT_PROXIED;
+			else
+				continue;
+			e->at_ns = e->rec.ts_ns;
+			n++;
+		}
+		fclose(f);
+	}
+	/* replay from the first event on, not from the process start */
+	for(i = 0; i < n; i++)
+		if((ev[i].at_ns += starts[ev[i].file] - first) < first_ev)
+			first_ev = ev[i].at_ns;
+	for(i = 0; i < n; i++)
+		ev[i].at_ns -= first_ev;
+	qsort(ev, n, sizeof(*ev), cmp_event);
+	free(starts);
+	*out = ev;
+	*count = n;
+	return 0;
+}
+
+static int resolve(const char *name, struct in_addr *in) {
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(name, NULL, &hints, &res))
+		return -1;
+	*in = ((struct sockaddr_in *) res->ai_addr)->sin_addr;
+	freeaddrinfo(res);
+	return 0;
+}
+
+/* returns the duration in ns, the sign tells about failure */
+static long long play(struct event *e) {
+	struct sockaddr_in sin;
+	unsigned long long start;
+	int fd, r;
+
+	if(e->phase == PH_RESOLVE) {
+		start = now_ns();
+		r = resolve(e->name, &sin.sin_addr);
+		start = now_ns() - start;
+		return r ? -(long long) start : (long long) start;
+	}
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = e->rec.ip;
+	sin.sin_port = e->rec.port;
+	if(e->phase == PH_CONNECT_DIRECT) {
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sin.sin_port = htons(echo_port);
+	} else if(e->rec.name_len && resolve(e->name, &sin.sin_addr))
+		return -1;
+	if((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		return -1;
+	start = now_ns();
+	r = connect(fd, (struct sockaddr *) &sin, sizeof(sin));
+	start = now_ns() - start;
+	close(fd);
+	return r ? -(long long) start : (long long) start;
+}
+
+static void *player_thread(void *arg) {
+	struct player *p = arg;
+	struct phase *ph;
+	unsigned long long due, now;
+	struct timespec ts;
+	long long d;
+	size_t i, slot;
+
+	for(i = 0; i < p->n; i++) {
+		if(speed > 0) {
+			due = t0 + (unsigned long long) (p->ev[i].at_ns / speed);
+			if((now = now_ns()) < due) {
+				ts.tv_sec = (due - now) / 1000000000ULL;
+				ts.tv_nsec = (due - now) % 1000000000ULL;
+				nanosleep(&ts, NULL);
+			}
+		}
+		ph = &phases[p->ev[i].phase];
+		d = play(&p->ev[i]);
+		slot = __atomic_fetch_add(&ph->done, 1, __ATOMIC_RELAXED);
+		ph->replayed[slot] = d < 0 ? -d : d;
+		if(d < 0)
+			__atomic_fetch_add(&ph->errors, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static void pct(unsigned long long *v, size_t n, double q, char *out, size_t outsize) {
+	if(!n)
+		snprintf(out, outsize, "-");
+	else
+		snprintf(out, outsize, "%.1f", v[(size_t) ((n - 1) * q)] / 1e3);
+}
+
+static int worker(char **files, int nfiles) {
+	struct event *ev;
+	struct player *players;
+	struct phase *ph;
+	size_t n, i, j, np = 0;
+	char c[6][32];
+	int k;
+
+	if(load(files, nfiles, &ev, &n))
+		return 1;
+	for(i = 0; i < n; i++)
+		phases[ev[i].phase].n++;
+	for(k = 0; k < PH_COUNT; k++) {
+		phases[k].recorded = calloc(phases[k].n + 1, sizeof(unsigned long long));
+		phases[k].replayed = calloc(phases[k].n + 1, sizeof(unsigned long long));
+		phases[k].n = 0;
+	}
+	for(i = 0; i < n; i++) {
+		ph = &phases[ev[i].phase];
+		ph->recorded[ph->n++] = ev[i].rec.dur_us * 1000ULL;
+		if(ev[i].rec.result && !(ev[i].phase != PH_RESOLVE && ev[i].rec.err == EINPROGRESS))
+			ph->rec_errors++;
+	}
+
+	players = calloc(n + 1, sizeof(*players));
+	for(i = 0; i < n; i = j) {
+		for(j = i; j < n && ev[j].file == ev[i].file && ev[j].rec.tid == ev[i].rec.tid; j++)
+			;
+		players[np].ev = &ev[i];
+		players[np++].n = j - i;
+	}
+	t0 = now_ns() + 10000000ULL;  // let every thread start before the first event
+	for(i = 0; i < np; i++)
+		if(pthread_create(&players[i].thread, NULL, player_thread, &players[i]))
+			return 1;
+	for(i = 0; i < np; i++)
+		pthread_join(players[i].thread, NULL);
+	fprintf(stderr, "replayed %zu events of %zu threads in %.3fs\n", n, np, (now_ns() - t0) / 1e9);
+
+	printf("phase\tcount\trec_p50_us\trec_p99_us\trec_errors\tp50_us\tp90_us\tp99_us\tmax_us\terrors\n");
+	for(k = 0; k < PH_COUNT; k++) {
+		ph = &phases[k];
+		qsort(ph->recorded, ph->n, sizeof(*ph->recorded), cmp_ull);
+		qsort(ph->replayed, ph->done, sizeof(*ph->replayed), cmp_ull);
+		pct(ph->recorded, ph->n, .5, c[0], sizeof(c[0]));
+		pct(ph->recorded, ph->n, .99, c[1], sizeof(c[1]));
+		pct(ph->replayed, ph->done, .5, c[2], sizeof(c[2]));
+		pct(ph->replayed, ph->done, .9, c[3], sizeof(c[3]));
+		pct(ph->replayed, ph->done, .99, c[4], sizeof(c[4]));
+		pct(ph->replayed, ph->done, 1, c[5], sizeof(c[5]));
+		printf("%s\t%zu\t%s\t%s\t%d\t%s\t%s\t%s\t%s\t%d\n", phase_names[k], ph->n, c[0], c[1], ph->rec_errors,
+		       c[2], c[3], c[4], c[5], ph->errors);
+	}
+	return 0;
+}
+
+static int parse_kind(const char *s) {
+	static const char *labels[] = { "socks4", "socks5", "socks5_auth", "http" };
+	static const int kinds[] = { STANDIN_SOCKS4, STANDIN_SOCKS5, STANDIN_SOCKS5_AUTH, STANDIN_HTTP };
+	unsigned i;
+	for(i = 0; i < sizeof(labels) / sizeof(labels[0]); i++)
+		if(!strcmp(s, labels[i]))
+			return kinds[i];
+	return -1;
+}
+
+int main(int argc, char **argv) {
+	struct standin echo_s, proxies[MAX_LEN];
+	char conf[] = "/tmp/proxybound-replay.XXXXXX", dll[4096], port[8], **args;
+	const char *chain = getenv("REPLAY_CHAIN") ? getenv("REPLAY_CHAIN") : "strict";
+	int len = getenv("REPLAY_LEN") ? atoi(getenv("REPLAY_LEN")) : 1;
+	int kind = parse_kind(getenv("REPLAY_PROXY") ? getenv("REPLAY_PROXY") : "socks5");
+	int i, fd, status;
+	pid_t pid;
+	FILE *f;
+
+	if(getenv("REPLAY_SPEED"))
+		speed = atof(getenv("REPLAY_SPEED"));
+	if(argc > 3 && !strcmp(argv[1], "--worker")) {
+		echo_port = atoi(argv[2]);
+		return worker(argv + 3, argc - 3);
+	}
+	if(argc < 3 || len < 1 || len > MAX_LEN || kind == -1) {
+		fprintf(stderr, "usage: %s libproxybound.so recording.pbr...\n", argv[0]);
+		return 1;
+	}
+	if(!realpath(argv[1], dll)) {
+		perror(argv[1]);
+		return 1;
+	}
+	if(standin_start(&echo_s, STANDIN_ECHO))
+		return 1;
+	for(i = 0; i < len; i++) {
+		if(standin_start(&proxies[i], kind))
+			return 1;
+		standin_redirect(&proxies[i], echo_s.port);
+	}
+	if((fd = mkstemp(conf)) == -1 || !(f = fdopen(fd, "w")))
+		return 1;
+	fprintf(f, "%s_chain\nchain_len = %d\nquiet_mode\nproxy_dns\nremote_dns_subnet 224\n"
+		"tcp_read_time_out 15000\ntcp_connect_time_out 8000\n[ProxyList]\n", chain, len);
+	for(i = 0; i < len; i++) {
+		fprintf(f, "%s 127.0.0.1 %u", standin_type(kind), proxies[i].port);
+		if(kind == STANDIN_SOCKS5_AUTH || kind == STANDIN_HTTP)
+			fprintf(f, " %s %s", STANDIN_USER, STANDIN_PASS);
+		fprintf(f, "\n");
+	}
+	fclose(f);
+
+	snprintf(port, sizeof(port), "%u", echo_s.port);
+	if(!(args = calloc(argc + 2, sizeof(*args))))
+		return 1;
+	args[0] = "bench_replay";
+	args[1] = "--worker";
+	args[2] = port;
+	for(i = 2; i < argc; i++)
+		args[i + 1] = argv[i];
+	if((pid = fork()) == 0) {
+		setenv("LD_PRELOAD", dll, 1);
+		setenv("PROXYBOUND_CONF_FILE", conf, 1);
+		unsetenv("PROXYBOUND_RECORD");
+		execv("/proc/self/exe", args);
+		_exit(127);
+	}
+	status = pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status);
+	unlink(conf);
+	return status;
+}
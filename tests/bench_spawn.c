@@ -0,0 +1,69 @@
+/* process startup overhead of the preloaded dll.
+   fork/execs a trivial program N times without and with LD_PRELOAD and
+   reports the mean cost of one spawn for both:
+     ./tests/bench_spawn 10000 ./libproxybound.so [/bin/true] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+static unsigned long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long spawn_loop(int n, char *prog, char **envp) {
+	char *argv[] = { prog, NULL };
+	unsigned long long start = now_ns();
+	int i, status;
+	pid_t pid;
+
+	for(i = 0; i < n; i++) {
+		if((pid = fork()) == 0) {
+			execve(prog, argv, envp);
+			_exit(127);
+		}
+		if(pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "spawn of %s failed\n", prog);
+			exit(1);
+		}
+	}
+	return (now_ns() - start) / n;
+}
+
+int main(int argc, char **argv) {
+	int n = argc > 1 ? atoi(argv[1]) : 10000;
+	char *dll = argc > 2 ? argv[2] : "./libproxybound.so";
+	char *prog = argc > 3 ? argv[3] : "/bin/true";
+	char preload[4096], *dll_path;
+	char *plain_env[256], *preload_env[257];
+	int i, j = 0;
+
+	if(!(dll_path = realpath(dll, NULL))) {
+		perror(dll);
+		return 1;
+	}
+	snprintf(preload, sizeof(preload), "LD_PRELOAD=%s", dll_path);
+	for(i = 0; environ[i] && j < 255; i++)
+		if(strncmp(environ[i], "LD_PRELOAD=", 11))
+			plain_env[j++] = environ[i];
+	plain_env[j] = NULL;
+	memcpy(preload_env, plain_env, (j + 1) * sizeof(char *));
+	preload_env[j] = preload;
+	preload_env[j + 1] = NULL;
+
+	/* warm up the page cache for both variants */
+	spawn_loop(10, prog, plain_env);
+	spawn_loop(10, prog, preload_env);
+
+	printf("spawns=%d plain_ns=%llu", n, spawn_loop(n, prog, plain_env));
+	printf(" preload_ns=%llu\n", spawn_loop(n, prog, preload_env));
+	free(dll_path);
+	return 0;
+}
@@ -0,0 +1,232 @@
+/* connect storm: N threads of one preloaded process loop over
+   getaddrinfo() + connect() + close() through a loopback stand-in socks5
+   proxy, for N = 1, 2, 4 .. max. names come from a pool shared by all
+   threads, so the fake ip table sees inserts first and lookups later.
+   reports throughput, latency percentiles of resolve+connect, failures and
+   the contention of the dll mutexes (from the metrics segment, zero when
+   the dll is built without THREAD_SAFE). one tab separated row per N:
+     tests/bench_storm ./libproxybound.so [max_threads]
+   BENCH_STORM_MS (default 1000) is the run time per N, BENCH_NAMES
+   (default 4096) the name pool and BENCH_CHAIN (strict, dynamic, random)
+   the chain type. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "standin.h"
+#include "../src/metrics.h"
+
+struct storm_thread {
+	pthread_t thread;
+	unsigned seed;
+	unsigned long long *lat;
+	size_t n, capa;
+	int errors;
+};
+
+static const char *lock_names[METRICS_LOCKS] = { "ips", "hostdb", "state" };
+static unsigned short echo_port;
+static unsigned long long deadline;
+static int names = 4096;
+
+static unsigned long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_ull(const void *a, const void *b) {
+	unsigned long long x = *(const unsigned long long *) a, y = *(const unsigned long long *) b;
+	return x < y ? -1 : x > y;
+}
+
+static int resolve_connect(const char *name) {
+	struct addrinfo hints, *res;
+	struct sockaddr_in sin;
+	int fd, r;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(name, NULL, &hints, &res))
+		return -1;
+	memcpy(&sin, res->ai_addr, sizeof(sin));
+	freeaddrinfo(res);
+	sin.sin_port = htons(echo_port);
+	if((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		return -1;
+	r = connect(fd, (struct sockaddr *) &sin, sizeof(sin));
+	close(fd);
+	return r;
+}
+
+static void *storm_thread(void *arg) {
+	struct storm_thread *t = arg;
+	unsigned long long start, end;
+	char name[64];
+
+	while((start = now_ns()) < deadline) {
+		snprintf(name, sizeof(name), "n%d.storm", (int) (rand_r(&t->seed) % names));
+		if(resolve_connect(name))
+			t->errors++;
+		end = now_ns();
+		if(t->n == t->capa) {
+			t->capa = t->capa ? t->capa * 2 : 4096;
+			if(!(t->lat = realloc(t->lat, t->capa * sizeof(*t->lat))))
+				return NULL;
+		}
+		t->lat[t->n++] = end - start;
+	}
+	return NULL;
+}
+
+/* runs preloaded, prints "ops ops_per_s errors p50 p90 p99 max" */
+static int worker(int nthreads, int ms) {
+	struct storm_thread *t = calloc(nthreads, sizeof(*t));
+	unsigned long long *all, start;
+	size_t total = 0, i;
+	int k, errors = 0;
+
+	if(!t)
+		return 1;
+	start = now_ns();
+	deadline = start + ms * 1000000ULL;
+	for(k = 0; k < nthreads; k++) {
+		t[k].seed = k + 1;
+		if(pthread_create(&t[k].thread, NULL, storm_thread, &t[k]))
+			return 1;
+	}
+	for(k = 0; k < nthreads; k++) {
+		pthread_join(t[k].thread, NULL);
+		total += t[k].n;
+		errors += t[k].errors;
+	}
+	if(!total || !(all = malloc(total * sizeof(*all))))
+		return 1;
+	for(k = 0, i = 0; k < nthreads; k++) {
+		memcpy(all + i, t[k].lat, t[k].n * sizeof(*all));
+		i += t[k].n;
+	}
+	qsort(all, total, sizeof(*all), cmp_ull);
+	printf("%zu\t%.0f\t%d\t%.1f\t%.1f\t%.1f\t%.1f\n", total, total / ((now_ns() - start) / 1e9), errors,
+	       all[total / 2] / 1e3, all[total * 90 / 100] / 1e3, all[total * 99 / 100] / 1e3, all[total - 1] / 1e3);
+	return 0;
+}
+
+/* the lock counters of the config's metrics segment, zeroed without one */
+static void read_locks(const char *conf, metrics_lock *out) {
+	metrics_segment *seg;
+	struct stat st;
+	char name[64];
+	int fd, i;
+
+	memset(out, 0, METRICS_LOCKS * sizeof(*out));
+	metrics_shm_name(name, sizeof(name), conf, "metrics");
+	if((fd = shm_open(name, O_RDONLY, 0)) == -1)
+		return;
+	if(!fstat(fd, &st) && (size_t) st.st_size >= sizeof(metrics_segment) &&
+	   (seg = mmap(NULL, sizeof(*seg), PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+		if(seg->h.magic == METRICS_MAGIC && seg->h.version == METRICS_VERSION)
+			for(i = 0; i < METRICS_LOCKS; i++) {
+				out[i].acquired = __atomic_load_n(&seg->lock[i].acquired, __ATOMIC_RELAXED);
+				out[i].contended = __atomic_load_n(&seg->lock[i].contended, __ATOMIC_RELAXED);
+				out[i].wait_us = __atomic_load_n(&seg->lock[i].wait_us, __ATOMIC_RELAXED);
+			}
+		munmap(seg, sizeof(*seg));
+	}
+	close(fd);
+}
+
+static int run_worker(const char *dll, const char *conf, char **args, char *out, size_t outsize) {
+	int p[2], status;
+	ssize_t r;
+	size_t len = 0;
+	pid_t pid;
+
+	if(pipe(p))
+		return -1;
+	if((pid = fork()) == 0) {
+		close(p[0]);
+		dup2(p[1], 1);
+		setenv("LD_PRELOAD", dll, 1);
+		setenv("PROXYBOUND_CONF_FILE", conf, 1);
+		setenv("PROXYBOUND_LOCK_STATS", "1", 1);
+		execv("/proc/self/exe", args);
+		_exit(127);
+	}
+	close(p[1]);
+	while(len < outsize - 1 && (r = read(p[0], out + len, outsize - 1 - len)) > 0)
+		len += r;
+	out[len] = 0;
+	close(p[0]);
+	if(pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+		return -1;
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	struct standin echo_s, proxy;
+	metrics_lock before[METRICS_LOCKS], after[METRICS_LOCKS];
+	char conf[] = "/tmp/proxybound-storm.XXXXXX", dll[4096], out[256], port[8], nthreads[16], ms[16];
+	char name[64];
+	char *args[] = { "bench_storm", "--worker", port, nthreads, ms, NULL };
+	const char *chain = getenv("BENCH_CHAIN") ? getenv("BENCH_CHAIN") : "strict";
+	int n, max, fd, i;
+	FILE *f;
+
+	if(getenv("BENCH_NAMES") && (names = atoi(getenv("BENCH_NAMES"))) < 1)
+		names = 1;
+	if(argc == 5 && !strcmp(argv[1], "--worker")) {
+		echo_port = atoi(argv[2]);
+		return worker(atoi(argv[3]), atoi(argv[4]));
+	}
+	if(!realpath(argc > 1 ? argv[1] : "./libproxybound.so", dll)) {
+		perror("libproxybound.so");
+		return 1;
+	}
+	max = argc > 2 ? atoi(argv[2]) : 256;
+	snprintf(ms, sizeof(ms), "%d", getenv("BENCH_STORM_MS") ? atoi(getenv("BENCH_STORM_MS")) : 1000);
+	if(standin_start(&echo_s, STANDIN_ECHO) || standin_start(&proxy, STANDIN_SOCKS5))
+		return 1;
+	if((fd = mkstemp(conf)) == -1 || !(f = fdopen(fd, "w")))
+		return 1;
+	fprintf(f, "%s_chain\nchain_len = 1\nquiet_mode\nproxy_dns\nremote_dns_subnet 224\n"
+		"tcp_read_time_out 15000\ntcp_connect_time_out 8000\n[ProxyList]\nsocks5 127.0.0.1 %u\n",
+		chain, proxy.port);
+	fclose(f);
+	snprintf(port, sizeof(port), "%u", echo_s.port);
+
+	printf("threads\tops\tops_per_s\terrors\tp50_us\tp90_us\tp99_us\tmax_us");
+	for(i = 0; i < METRICS_LOCKS; i++)
+		printf("\t%s_contended\t%s_wait_us", lock_names[i], lock_names[i]);
+	printf("\n");
+	for(n = 1; n <= max; n *= 2) {
+		snprintf(nthreads, sizeof(nthreads), "%d", n);
+		read_locks(conf, before);
+		if(run_worker(dll, conf, args, out, sizeof(out)))
+			snprintf(out, sizeof(out), "FAILED\n");
+		read_locks(conf, after);
+		out[strcspn(out, "\n")] = 0;
+		printf("%d\t%s", n, out);
+		for(i = 0; i < METRICS_LOCKS; i++)
+			printf("\t%llu\t%llu", (unsigned long long) (after[i].contended - before[i].contended),
+			       (unsigned long long) (after[i].wait_us - before[i].wait_us));
+		printf("\n");
+		fflush(stdout);
+	}
+	metrics_shm_name(name, sizeof(name), conf, "metrics");
+	shm_unlink(name);
+	unlink(conf);
+	return 0;
+}
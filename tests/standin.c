@@ -0,0 +1,475 @@
+/* loopback stand-in proxies and targets, see standin.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "standin.h"
+
+#define STANDIN_BASIC_AUTH "Basic YmVuY2g6c2VjcmV0"  // STANDIN_USER:STANDIN_PASS
+
+struct conn {
+	struct standin *owner;
+	int kind;
+	int fd;
+	struct standin_step step;
+	unsigned short redirect;
+};
+
+static const char *fault_names[] = {
+	[FAULT_OK] = "ok", [FAULT_DELAY] = "delay", [FAULT_REFUSE] = "refuse",
+	[FAULT_BLACKHOLE] = "blackhole", [FAULT_PARTIAL] = "partial", [FAULT_SPLIT] = "split",
+	[FAULT_BLOCKED] = "blocked", [FAULT_NOAUTH] = "noauth", [FAULT_RESET] = "reset",
+	[FAULT_HOP] = "hop", [FAULT_TARGET] = "target",
+};
+
+int standin_parse_step(const char *str, struct standin_step *step) {
+	const char *colon = strchr(str, ':');
+	size_t len = colon ? (size_t) (colon - str) : strlen(str);
+	unsigned i;
+	for(i = 0; i < sizeof(fault_names) / sizeof(fault_names[0]); i++)
+		if(strlen(fault_names[i]) == len && !strncmp(str, fault_names[i], len)) {
+			step->fault = i;
+			step->ms = colon ? atoi(colon + 1) : (i == FAULT_SPLIT);
+			return 0;
+		}
+	return -1;
+}
+
+const char *standin_type(int kind) {
+	switch (kind) {
+		case STANDIN_SOCKS4:
+			return "socks4";
+		case STANDIN_SOCKS5:
+		case STANDIN_SOCKS5_AUTH:
+			return "socks5";
+		case STANDIN_HTTP:
+			return "http";
+	}
+	return "?";
+}
+
+int standin_read_n(int fd, void *buf, size_t n) {
+	size_t got = 0;
+	ssize_t r;
+	while(got < n) {
+		r = read(fd, (char *) buf + got, n - got);
+		if(r <= 0) {
+			if(r == -1 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		got += r;
+	}
+	return 0;
+}
+
+int standin_write_n(int fd, const void *buf, size_t n) {
+	size_t put = 0;
+	ssize_t r;
+	while(put < n) {
+		r = write(fd, (const char *) buf + put, n - put);
+		if(r <= 0) {
+			if(r == -1 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		put += r;
+	}
+	return 0;
+}
+
+/* the next close() sends a RST */
+static void reset(int fd) {
+	struct linger l = { 1, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+}
+
+/* keep the connection open until the client gives up */
+static void hold(int fd) {
+	char buf[4096];
+	while(read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+/* a handshake reply, subject to the fault of the connection */
+static int reply(struct conn *c, const void *buf, size_t n) {
+	size_t i;
+	switch (c->step.fault) {
+		case FAULT_RESET:
+			reset(c->fd);
+			return -1;
+		case FAULT_PARTIAL:
+			standin_write_n(c->fd, buf, n / 2 ? n / 2 : 1);
+			hold(c->fd);
+			return -1;
+		case FAULT_SPLIT:
+			for(i = 0; i < n; i++) {
+				if(i)
+					usleep(c->step.ms * 1000);
+				if(standin_write_n(c->fd, (const char *) buf + i, 1))
+					return -1;
+			}
+			return 0;
+	}
+	return standin_write_n(c->fd, buf, n);
+}
+
+static int read_cstring(int fd, char *buf, size_t bufsize) {
+	size_t i;
+	for(i = 0; i < bufsize; i++) {
+		if(standin_read_n(fd, &buf[i], 1))
+			return -1;
+		if(!buf[i])
+			return 0;
+	}
+	return -1;
+}
+
+/* every host name is ours, the handshakes pass them as INADDR_ANY. a
+   redirect keeps loopback targets (the next proxy of a chain) */
+static int dial(struct conn *c, uint32_t ip, uint16_t port) {
+	struct sockaddr_in sin;
+	int one = 1;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd == -1)
+		return -1;
+	if(c->step.fault == FAULT_HOP && ip == htonl(INADDR_LOOPBACK))
+		usleep(c->step.ms * 1000);
+	if(c->step.fault == FAULT_TARGET && ip != htonl(INADDR_LOOPBACK))
+		usleep(c->step.ms * 1000);
+	if(c->redirect && ip != htonl(INADDR_LOOPBACK)) {
+		ip = htonl(INADDR_LOOPBACK);
+		port = htons(c->redirect);
+	} else if(ip == htonl(INADDR_ANY))
+		ip = htonl(INADDR_LOOPBACK);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = ip;
+	sin.sin_port = port;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if(connect(fd, (struct sockaddr *) &sin, sizeof(sin))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void standin_relay(int a, int b) {
+	char buf[64 * 1024];
+	struct pollfd p[2];
+	int open_a = 1, open_b = 1;
+	ssize_t n;
+
+	while(open_a || open_b) {
+		p[0].fd = open_a ? a : -1;
+		p[0].events = POLLIN;
+		p[1].fd = open_b ? b : -1;
+		p[1].events = POLLIN;
+		if(poll(p, 2, -1) == -1) {
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		if(p[0].revents) {
+			n = read(a, buf, sizeof(buf));
+			if(n <= 0 || standin_write_n(b, buf, n)) {
+				shutdown(b, SHUT_WR);
+				open_a = 0;
+			}
+		}
+		if(p[1].revents) {
+			n = read(b, buf, sizeof(buf));
+			if(n <= 0 || standin_write_n(a, buf, n)) {
+				shutdown(a, SHUT_WR);
+				open_b = 0;
+			}
+		}
+	}
+}
+
+static int socks4_handshake(struct conn *c) {
+	unsigned char req[8], rep[8] = { 0, 90 };
+	int fd = c->fd;
+	char user[256], host[256];
+	uint32_t ip;
+	int up;
+
+	if(standin_read_n(fd, req, 8) || req[0] != 4 || req[1] != 1 || read_cstring(fd, user, sizeof(user)))
+		return -1;
+	memcpy(&ip, &req[4], 4);
+	/* socks4a: 0.0.0.x followed by the host name */
+	if(!req[4] && !req[5] && !req[6] && req[7]) {
+		if(read_cstring(fd, host, sizeof(host)))
+			return -1;
+		ip = htonl(INADDR_ANY);
+	}
+	if(c->step.fault == FAULT_BLOCKED || c->step.fault == FAULT_NOAUTH)
+		up = -1;
+	else
+		up = dial(c, ip, *(uint16_t *) &req[2]);
+	if(up == -1)
+		rep[1] = 91;
+	if(reply(c, rep, 8) || up == -1) {
+		if(up != -1)
+			close(up);
+		return -1;
+	}
+	return up;
+}
+
+static int socks5_handshake(struct conn *c, int auth) {
+	unsigned char buf[512], rep[10] = { 5, 0, 0, 1 };
+	uint32_t ip = htonl(INADDR_ANY);
+	uint16_t port;
+	int i, up, want = auth ? 2 : 0, offered = 0, fd = c->fd;
+
+	if(standin_read_n(fd, buf, 2) || buf[0] != 5 || standin_read_n(fd, buf + 2, buf[1]))
+		return -1;
+	for(i = 0; i < buf[1]; i++)
+		if(buf[2 + i] == want)
+			offered = 1;
+	if(c->step.fault == FAULT_NOAUTH)
+		offered = 0;
+	buf[0] = 5;
+	buf[1] = offered ? want : 0xFF;
+	if(reply(c, buf, 2) || !offered)
+		return -1;
+	if(auth) {
+		char user[256] = { 0 }, pass[256] = { 0 };
+		if(standin_read_n(fd, buf, 2) || buf[0] != 1 || standin_read_n(fd, user, buf[1]) ||
+		   standin_read_n(fd, buf, 1) || standin_read_n(fd, pass, buf[0]))
+			return -1;
+		buf[0] = 1;
+		buf[1] = strcmp(user, STANDIN_USER) || strcmp(pass, STANDIN_PASS);
+		if(reply(c, buf, 2) || buf[1])
+			return -1;
+	}
+	if(standin_read_n(fd, buf, 4) || buf[0] != 5 || buf[1] != 1)
+		return -1;
+	switch (buf[3]) {
+		case 1:
+			if(standin_read_n(fd, &ip, 4))
+				return -1;
+			break;
+		case 3:
+			if(standin_read_n(fd, buf, 1) || standin_read_n(fd, buf + 1, buf[0]))
+				return -1;
+			break;
+		default:
+			return -1;
+	}
+	if(standin_read_n(fd, &port, 2))
+		return -1;
+	if(c->step.fault == FAULT_BLOCKED) {
+		up = -1;
+		rep[1] = 2;
+	} else if((up = dial(c, ip, port)) == -1)
+		rep[1] = 5;
+	if(reply(c, rep, sizeof(rep)) || up == -1) {
+		if(up != -1)
+			close(up);
+		return -1;
+	}
+	return up;
+}
+
+static int http_handshake(struct conn *c) {
+	char buf[4096], host[256];
+	const char *ok = "HTTP/1.0 200 Connection established\r\n\r\n";
+	const char *denied = "HTTP/1.0 407 Proxy Authentication Required\r\n\r\n";
+	const char *forbidden = "HTTP/1.0 403 Forbidden\r\n\r\n";
+	size_t len = 0;
+	unsigned port;
+	struct in_addr in;
+	int up, fd = c->fd;
+
+	/* the client waits for our answer, reading past the header is fine */
+	while(len < 4 || memcmp(buf + len - 4, "\r\n\r\n", 4)) {
+		ssize_t n = read(fd, buf + len, sizeof(buf) - 1 - len);
+		if(n <= 0 || (len += n) >= sizeof(buf) - 1)
+			return -1;
+		buf[len] = 0;
+	}
+	buf[len] = 0;
+	if(sscanf(buf, "CONNECT %255[^:]:%u", host, &port) != 2)
+		return -1;
+	if(!strstr(buf, "Proxy-Authorization: " STANDIN_BASIC_AUTH "\r\n") || c->step.fault == FAULT_NOAUTH) {
+		reply(c, denied, strlen(denied));
+		return -1;
+	}
+	if(c->step.fault == FAULT_BLOCKED) {
+		reply(c, forbidden, strlen(forbidden));
+		return -1;
+	}
+	if(!inet_aton(host, &in))
+		in.s_addr = htonl(INADDR_ANY);
+	if((up = dial(c, in.s_addr, htons(port))) == -1)
+		return -1;
+	if(reply(c, ok, strlen(ok))) {
+		close(up);
+		return -1;
+	}
+	return up;
+}
+
+static void echo(int fd) {
+	char buf[64 * 1024];
+	ssize_t n;
+	while((n = read(fd, buf, sizeof(buf))) > 0)
+		if(standin_write_n(fd, buf, n))
+			break;
+}
+
+static void sink(int fd) {
+	char buf[64 * 1024];
+	unsigned long long total = 0;
+	unsigned char be[8];
+	ssize_t n;
+	int i;
+	while((n = read(fd, buf, sizeof(buf))) > 0)
+		total += n;
+	for(i = 0; i < 8; i++)
+		be[i] = (unsigned char) (total >> (56 - 8 * i));
+	standin_write_n(fd, be, 8);
+}
+
+static void *conn_thread(void *arg) {
+	struct conn *c = arg;
+	int up = -1, one = 1;
+
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	switch (c->step.fault) {
+		case FAULT_DELAY:
+			usleep(c->step.ms * 1000);
+			break;
+		case FAULT_REFUSE:
+			reset(c->fd);
+			goto out;
+		case FAULT_BLACKHOLE:
+			hold(c->fd);
+			goto out;
+	}
+	switch (c->kind) {
+		case STANDIN_SOCKS4:
+			up = socks4_handshake(c);
+			break;
+		case STANDIN_SOCKS5:
+		case STANDIN_SOCKS5_AUTH:
+			up = socks5_handshake(c, c->kind == STANDIN_SOCKS5_AUTH);
+			break;
+		case STANDIN_HTTP:
+			up = http_handshake(c);
+			break;
+		case STANDIN_ECHO:
+			echo(c->fd);
+			break;
+		case STANDIN_SINK:
+			sink(c->fd);
+			break;
+	}
+	if(up != -1) {
+		standin_relay(c->fd, up);
+		close(up);
+	}
+	out:
+	close(c->fd);
+	__atomic_fetch_sub(&c->owner->active, 1, __ATOMIC_RELAXED);
+	free(c);
+	return NULL;
+}
+
+static void *accept_thread(void *arg) {
+	struct standin *s = arg;
+	pthread_attr_t attr;
+	pthread_t t;
+	struct conn *c;
+	unsigned long n, active, peak;
+	int fd;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while((fd = accept(s->fd, NULL, NULL)) != -1 || errno == EINTR || errno == ECONNABORTED) {
+		if(fd == -1)
+			continue;
+		if(!(c = malloc(sizeof(*c)))) {
+			close(fd);
+			continue;
+		}
+		n = __atomic_fetch_add(&s->accepted, 1, __ATOMIC_RELAXED);
+		active = __atomic_add_fetch(&s->active, 1, __ATOMIC_RELAXED);
+		peak = __atomic_load_n(&s->peak, __ATOMIC_RELAXED);
+		while(active > peak && !__atomic_compare_exchange_n(&s->peak, &peak, active, 0, __ATOMIC_RELAXED,
+								    __ATOMIC_RELAXED))
+			;
+		c->owner = s;
+		c->kind = s->kind;
+		c->fd = fd;
+		c->step.fault = FAULT_OK;
+		c->step.ms = 0;
+		c->redirect = __atomic_load_n(&s->redirect, __ATOMIC_RELAXED);
+		if(s->nsteps)
+			c->step = s->script[n % s->nsteps];
+		if(pthread_create(&t, &attr, conn_thread, c)) {
+			close(fd);
+			__atomic_fetch_sub(&s->active, 1, __ATOMIC_RELAXED);
+			free(c);
+		}
+	}
+	pthread_attr_destroy(&attr);
+	return NULL;
+}
+
+int standin_start(struct standin *s, int kind) {
+	return standin_start_script(s, kind, NULL, 0);
+}
+
+int standin_start_script(struct standin *s, int kind, const struct standin_step *steps, int nsteps) {
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int one = 1;
+
+	if(nsteps < 0 || nsteps > STANDIN_MAX_STEPS)
+		return -1;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	s->kind = kind;
+	s->nsteps = nsteps;
+	s->accepted = 0;
+	s->active = s->peak = 0;
+	s->redirect = 0;
+	if(nsteps)
+		memcpy(s->script, steps, nsteps * sizeof(*steps));
+	if((s->fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		return -1;
+	setsockopt(s->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if(bind(s->fd, (struct sockaddr *) &sin, sizeof(sin)) || listen(s->fd, 1024) ||
+	   getsockname(s->fd, (struct sockaddr *) &sin, &len)) {
+		close(s->fd);
+		return -1;
+	}
+	s->port = ntohs(sin.sin_port);
+	if(pthread_create(&s->thread, NULL, accept_thread, s)) {
+		close(s->fd);
+		return -1;
+	}
+	return 0;
+}
+
+void standin_redirect(struct standin *s, unsigned short port) {
+	__atomic_store_n(&s->redirect, port, __ATOMIC_RELAXED);
+}
+
+void standin_stop(struct standin *s) {
+	shutdown(s->fd, SHUT_RDWR);
+	pthread_join(s->thread, NULL);
+	close(s->fd);
+}
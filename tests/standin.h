@@ -0,0 +1,75 @@
+/* loopback stand-ins for the benchmarks: minimal socks4/4a, socks5 (with or
+   without rfc1929 auth) and http CONNECT (basic auth) proxies, plus echo and
+   sink targets. every server runs on 127.0.0.1 with a kernel chosen port and
+   a thread per connection. proxies resolve any host name to 127.0.0.1, so a
+   benchmark can reach a target through proxybound's fake ips with e.g.
+   "echo.bench" while the real address stays on loopback.
+   a proxy can be given a fault script: step i of the script is applied to
+   the i-th accepted connection, modulo the script length. */
+
+#ifndef STANDIN_H
+#define STANDIN_H
+
+#include <pthread.h>
+
+#define STANDIN_USER "bench"
+#define STANDIN_PASS "secret"
+
+enum standin_kind {
+	STANDIN_SOCKS4,       // socks4 and socks4a
+	STANDIN_SOCKS5,
+	STANDIN_SOCKS5_AUTH,  // requires STANDIN_USER / STANDIN_PASS
+	STANDIN_HTTP,         // CONNECT with basic auth of STANDIN_USER / STANDIN_PASS
+	STANDIN_ECHO,
+	STANDIN_SINK,         // reads until eof, answers the byte count as 8 bytes big endian
+};
+
+enum standin_fault {
+	FAULT_OK,
+	FAULT_DELAY,      // sleep ms before handling the connection, then ok
+	FAULT_REFUSE,     // reset right after accept
+	FAULT_BLACKHOLE,  // read everything, never answer
+	FAULT_PARTIAL,    // first half of the first reply, then silence
+	FAULT_SPLIT,      // every reply one byte at a time, ms apart
+	FAULT_BLOCKED,    // socks4 91, socks5 "not allowed", http 403
+	FAULT_NOAUTH,     // socks5 method 0xFF, http 407, socks4 like BLOCKED
+	FAULT_RESET,      // reset instead of the first reply
+	FAULT_HOP,        // sleep ms before dialing the next proxy of a chain, then ok
+	FAULT_TARGET,     // sleep ms before dialing the target, then ok
+};
+
+#define STANDIN_MAX_STEPS 32
+
+struct standin_step {
+	int fault;
+	int ms;
+};
+
+struct standin {
+	int kind;
+	int fd;
+	unsigned short port;  // host order
+	pthread_t thread;
+	struct standin_step script[STANDIN_MAX_STEPS];
+	int nsteps;              // 0: always ok
+	unsigned long accepted;  // connections seen, read with __atomic_load_n
+	unsigned long active, peak;  // open connections, now and at most
+	unsigned short redirect; // host order, see standin_redirect()
+};
+
+/* proxybound.conf type name of a proxy kind */
+const char *standin_type(int kind);
+int standin_start(struct standin *s, int kind);
+int standin_start_script(struct standin *s, int kind, const struct standin_step *steps, int nsteps);
+/* send every request of a proxy to 127.0.0.1:port instead of its target */
+void standin_redirect(struct standin *s, unsigned short port);
+/* "ok", "delay:50", "split:2", ...; returns -1 on unknown names */
+int standin_parse_step(const char *str, struct standin_step *step);
+void standin_stop(struct standin *s);
+
+/* shared helpers */
+int standin_read_n(int fd, void *buf, size_t n);
+int standin_write_n(int fd, const void *buf, size_t n);
+void standin_relay(int a, int b);
+
+#endif